@@ -35,6 +35,7 @@ public class Atum : ModuleRules
 		PrivateDependencyModuleNames.AddRange(new[]
 		{
 			"DeveloperSettings",
+			"Json",
 			"Projects"
 		});
 	}
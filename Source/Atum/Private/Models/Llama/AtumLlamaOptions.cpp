@@ -27,6 +27,10 @@ void FAtumLlamaOptions::SetFrom(const LlamaConfig& Options) noexcept
 	RopeTheta = Options.rope_theta;
 	AttentionBias = Options.attention_bias;
 	ScalarType = AtumEnums::Cast(Options.dtype);
+	Quantization = AtumEnums::Cast(Options.quantization);
+	QuantizationGroupSize = Options.quantization_group_size;
+	QuantizeLmHead = Options.quantize_lm_head;
+	KVCacheQuantization = AtumEnums::Cast(Options.kv_cache_quantization);
 }
 
 #undef LOCTEXT_NAMESPACE
\ No newline at end of file
@@ -0,0 +1,5 @@
+#include "Models/Llama/AtumLlamaQuantization.h"
+
+
+#define LOCTEXT_NAMESPACE "AtumLlamaQuantization"
+#undef LOCTEXT_NAMESPACE
@@ -0,0 +1,9 @@
+#include "Models/Llama/AtumLlamaSamplingOptions.h"
+
+#define LOCTEXT_NAMESPACE "AtumLlamaSamplingOptions"
+
+FAtumLlamaSamplingOptions::FAtumLlamaSamplingOptions() noexcept
+{
+}
+
+#undef LOCTEXT_NAMESPACE
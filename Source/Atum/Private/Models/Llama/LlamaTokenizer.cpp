@@ -0,0 +1,196 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#include "Models/Llama/LlamaTokenizer.h"
+
+#include "IAtumModule.h"
+#include "Macros/AtumMacrosLog.h"
+#include "Misc/Paths.h"
+
+#include "Tensors/AtumTensorLong.h"
+#include "UObject/Package.h"
+
+
+namespace
+{
+	std::string ToUtf8(const FString& Text)
+	{
+		const FTCHARToUTF8 Converter(*Text);
+		return std::string(Converter.Get(), Converter.Length());
+	}
+
+	FString FromUtf8(const std::string& Text)
+	{
+		const FUTF8ToTCHAR Converter(Text.data(), static_cast<int32>(Text.size()));
+		return FString(Converter.Length(), Converter.Get());
+	}
+}
+
+
+bool ULlamaTokenizer::LoadFromFile(const FString& Path)
+{
+	FString const FilePath = IAtumModule::GetContentDirectory(Path);
+	if (!FPaths::FileExists(FilePath))
+	{
+		UE_LOG(LogTemp, Warning, TEXT("File does not exist: %s"), *FilePath);
+		return false;
+	}
+
+	DecodeStreams.Empty();
+	Tokenizer = nullptr;
+
+	try
+	{
+		Tokenizer = MakeShared<LlamaTokenizer>(TCHAR_TO_UTF8(*FilePath));
+	}
+	catch (const std::exception& Exception)
+	{
+		ATUM_LOG(Error, TEXT("%hs"), Exception.what())
+		return false;
+	}
+
+	return true;
+}
+
+bool ULlamaTokenizer::IsLoaded() const
+{
+	return Tokenizer.IsValid();
+}
+
+TArray<int64> ULlamaTokenizer::Encode(const FString& Text, const bool bAddBos) const
+{
+	TArray<int64> Tokens;
+	if (!Tokenizer)
+	{
+		ATUM_LOG(Error, TEXT("Llama tokenizer is not loaded!"))
+		return Tokens;
+	}
+
+	const std::vector<int64_t> Ids = Tokenizer->encode(ToUtf8(Text), bAddBos);
+	Tokens.Append(Ids.data(), static_cast<int32>(Ids.size()));
+	return Tokens;
+}
+
+TArray<FAtumLlamaTokenIds> ULlamaTokenizer::EncodeBatch(const TArray<FString>& Texts, const bool bAddBos) const
+{
+	TArray<FAtumLlamaTokenIds> Batch;
+	if (!Tokenizer)
+	{
+		ATUM_LOG(Error, TEXT("Llama tokenizer is not loaded!"))
+		return Batch;
+	}
+
+	std::vector<std::string> StdTexts;
+	StdTexts.reserve(Texts.Num());
+	for (const FString& Text : Texts)
+	{
+		StdTexts.push_back(ToUtf8(Text));
+	}
+
+	const std::vector<std::vector<int64_t>> Ids = Tokenizer->encode_batch(StdTexts, bAddBos);
+	Batch.SetNum(static_cast<int32>(Ids.size()));
+	for (int32 Index = 0; Index < Batch.Num(); ++Index)
+	{
+		Batch[Index].Ids.Append(Ids[Index].data(), static_cast<int32>(Ids[Index].size()));
+	}
+	return Batch;
+}
+
+bool ULlamaTokenizer::EncodeToTensor(const FString& Text, TScriptInterface<IAtumTensor>& Output, const bool bAddBos) const
+{
+	if (!Tokenizer)
+	{
+		ATUM_LOG(Error, TEXT("Llama tokenizer is not loaded!"))
+		return false;
+	}
+
+	const std::vector<int64_t> Ids = Tokenizer->encode(ToUtf8(Text), bAddBos);
+	Output = NewObject<UAtumTensorLong>(GetTransientPackage());
+	Output->SetData(torch::tensor(Ids, torch::kLong).unsqueeze(0));
+	return true;
+}
+
+FString ULlamaTokenizer::Decode(const TArray<int64>& Tokens) const
+{
+	if (!Tokenizer)
+	{
+		ATUM_LOG(Error, TEXT("Llama tokenizer is not loaded!"))
+		return FString();
+	}
+
+	return FromUtf8(Tokenizer->decode(Tokens.GetData(), Tokens.Num()));
+}
+
+FString ULlamaTokenizer::DecodeTensor(const TScriptInterface<IAtumTensor>& Input) const
+{
+	if (!Tokenizer)
+	{
+		ATUM_LOG(Error, TEXT("Llama tokenizer is not loaded!"))
+		return FString();
+	}
+
+	torch::Tensor Tokens = Input->GetDataChecked().to(torch::kCPU, torch::kLong);
+	if (Tokens.dim() > 1)
+	{
+		Tokens = Tokens[0];
+	}
+	Tokens = Tokens.flatten().contiguous();
+	return FromUtf8(Tokenizer->decode(Tokens.data_ptr<int64_t>(), Tokens.numel()));
+}
+
+int32 ULlamaTokenizer::BeginDecodeStream()
+{
+	if (!Tokenizer)
+	{
+		ATUM_LOG(Error, TEXT("Llama tokenizer is not loaded!"))
+		return INDEX_NONE;
+	}
+
+	const int32 StreamId = NextDecodeStreamId++;
+	// the space a leading "▁" stands for is dropped like Decode does
+	DecodeStreams.Add(StreamId, MakeShared<LlamaDetokenizer>(*Tokenizer, Tokenizer->get_add_dummy_prefix()));
+	return StreamId;
+}
+
+FString ULlamaTokenizer::DecodeStream(const int32 StreamId, const TArray<int64>& Tokens)
+{
+	const TSharedPtr<LlamaDetokenizer>* const Stream = DecodeStreams.Find(StreamId);
+	if (!Stream)
+	{
+		ATUM_LOG(Error, TEXT("Unknown Llama decode stream %d!"), StreamId)
+		return FString();
+	}
+
+	std::string Text;
+	for (const int64 Token : Tokens)
+	{
+		Text += (*Stream)->push(Token);
+	}
+	return FromUtf8(Text);
+}
+
+FString ULlamaTokenizer::EndDecodeStream(const int32 StreamId)
+{
+	TSharedPtr<LlamaDetokenizer> Stream;
+	if (!DecodeStreams.RemoveAndCopyValue(StreamId, Stream))
+	{
+		ATUM_LOG(Error, TEXT("Unknown Llama decode stream %d!"), StreamId)
+		return FString();
+	}
+
+	return FromUtf8(Stream->flush());
+}
+
+int64 ULlamaTokenizer::GetVocabSize() const
+{
+	return Tokenizer ? Tokenizer->vocab_size() : 0;
+}
+
+int64 ULlamaTokenizer::GetBosId() const
+{
+	return Tokenizer ? Tokenizer->get_bos_id() : INDEX_NONE;
+}
+
+int64 ULlamaTokenizer::GetEosId() const
+{
+	return Tokenizer ? Tokenizer->get_eos_id() : INDEX_NONE;
+}
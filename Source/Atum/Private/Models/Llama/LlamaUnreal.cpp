@@ -2,13 +2,17 @@
 
 #pragma once
 #include "Models/Llama/LlamaUnreal.h"
+#include "Models/Llama/llama_safetensors.h"
 #include "Models/Llama/llama_utils.h"
 
 #include "IAtumModule.h"
+#include "Async/Async.h"
 #include "Macros/AtumMacrosLog.h"
 #include "Misc/Paths.h"
 
+#include "Tensors/AtumTensorLong.h"
 #include "Tensors/IAtumTensor.h"
+#include "UObject/Package.h"
 
 
 
@@ -19,21 +23,36 @@ bool ULlamaUnreal::OnInitializeData_Implementation(const bool bRetry)
 	UE_LOG(LogTemp, Warning, TEXT("ULlamaUnreal::OnInitializeData_Implementation"));
 	auto LlamaOptions = static_cast<LlamaConfig>(Options);
 	// LlamaOptions.dtype = torch::kFloat32;
+	LlamaOptions.init_weights = bInitializeWeights && !bInitializingForLoad;
 	Module = MakeShared<LlamaCausalLM>(std::make_shared<LlamaCausalLMImpl>(
 		LlamaOptions
 	));
+	// the cache layout depends on the options the module was built with
+	KVCache.Reset();
+	Scheduler.Reset();
+	Sessions.Empty();
+	KVBlockPool = nullptr;
+	PrefixCache = nullptr;
 	return true;
 }
 
 
 bool ULlamaUnreal::LoadFromFile_Implementation(const FString& RelativePath)
 {
-	
+	const std::unique_lock<std::mutex> ModuleLock = TryLockModule();
+	if (!ModuleLock.owns_lock() || !InitializeForLoad())
+		return false;
+
 	if (!IAtumLayer::LoadFromFile_Implementation(RelativePath))
 		return false;
 
 
 	Options.SetFrom((*Module)->config);
+
+	if (bFuseProjections)
+	{
+		(*Module)->fuse_projections();
+	}
 	
 	return true;
 }
@@ -54,8 +73,10 @@ bool ULlamaUnreal::OnForward_Implementation(
 		return false;
 	}
 
+	const std::unique_lock<std::mutex> ModuleLock = TryLockModule();
+	if (!ModuleLock.owns_lock())
+		return false;
 
-	
 	auto const LmOutputs = (*Module)(Input->GetDataChecked().to(c10::kLong));  // Embedding typically requires Long type indices
 
 	
@@ -77,6 +98,63 @@ void ULlamaUnreal::SetOptions(const FAtumLlamaOptions& NewOptions)
 	Options = NewOptions;
 }
 
+void ULlamaUnreal::SetSamplingOptions(const FAtumLlamaSamplingOptions& NewSamplingOptions)
+{
+	SamplingOptions = NewSamplingOptions;
+}
+
+void ULlamaUnreal::SetDraftModel(ULlamaUnreal* NewDraftModel, const int32 NewNumDraftTokens)
+{
+	if (NewDraftModel == this)
+	{
+		ATUM_LOG(Error, TEXT("A Llama model cannot draft for itself!"))
+		return;
+	}
+
+	DraftModel = NewDraftModel;
+	NumDraftTokens = FMath::Max(1, NewNumDraftTokens);
+}
+
+void ULlamaUnreal::ReleaseKVCache()
+{
+	KVCache.Reset();
+}
+
+int64 ULlamaUnreal::GetKVCacheMemoryBytes() const
+{
+	return KVCache ? KVCache->memory_bytes() : 0;
+}
+
+void ULlamaUnreal::ClearPrefixCache()
+{
+	if (PrefixCache)
+	{
+		PrefixCache->clear();
+	}
+}
+
+int64 ULlamaUnreal::GetPrefixCacheMemoryBytes() const
+{
+	return PrefixCache ? PrefixCache->memory_bytes() : 0;
+}
+
+std::shared_ptr<LlamaPrefixCache> ULlamaUnreal::GetPrefixCache()
+{
+	if (PrefixCacheMaxMegabytes <= 0)
+		return nullptr;
+
+	if (!PrefixCache || PrefixCache->get_block_size() != PrefixCacheBlockSize)
+	{
+		auto implPtr = std::dynamic_pointer_cast<LlamaCausalLMImpl>(Module->ptr());
+		PrefixCache = std::make_shared<LlamaPrefixCache>(
+			implPtr->config,
+			static_cast<int64>(PrefixCacheMaxMegabytes) * 1024 * 1024,
+			PrefixCacheBlockSize
+		);
+	}
+	return PrefixCache;
+}
+
 bool ULlamaUnreal::Generate_Implementation(const TScriptInterface<IAtumTensor>& Input, TScriptInterface<IAtumTensor>& Output, const int32& NumNewTokens  = 10)
 {
 
@@ -89,16 +167,68 @@ bool ULlamaUnreal::Generate_Implementation(const TScriptInterface<IAtumTensor>&
 		return false;
 	}
 
-	
-	
+	const std::unique_lock<std::mutex> ModuleLock = TryLockModule();
+	if (!ModuleLock.owns_lock())
+		return false;
+
 	auto implPtr = std::dynamic_pointer_cast<LlamaCausalLMImpl>(Module->ptr());
 
 	implPtr->eval();
 
 
 	torch::Tensor InputTensor = Input->GetDataChecked().to(c10::kLong);
-	
-	auto const LmOutputs = implPtr->generate(InputTensor, NumNewTokens);
+
+	// reuse the session cache unless the batch no longer fits into it
+	if (!KVCache || KVCache->get_batch_size() < InputTensor.size(0))
+	{
+		KVCache = MakeShared<LlamaStaticCache>(implPtr->config, InputTensor.size(0), -1, InputTensor.device());
+	}
+	KVCache->reset();
+
+	// the draft model only helps a single sequence, batches decode normally
+	// so does a draft model busy with an async generation of its own
+	std::unique_lock<std::mutex> DraftLock;
+	if (DraftModel && DraftModel != this && DraftModel->Module && InputTensor.size(0) == 1)
+	{
+		DraftLock = DraftModel->TryLockModule();
+	}
+	const bool bSpeculative = DraftLock.owns_lock();
+
+	torch::Tensor LmOutputs;
+	try
+	{
+		if (bSpeculative)
+		{
+			auto DraftPtr = std::dynamic_pointer_cast<LlamaCausalLMImpl>(DraftModel->Module->ptr());
+			DraftPtr->eval();
+
+			LmOutputs = implPtr->speculative_generate(
+				InputTensor,
+				*DraftPtr,
+				NumNewTokens,
+				NumDraftTokens,
+				KVCache.Get(),
+				nullptr,
+				static_cast<LlamaSamplingOptions>(SamplingOptions)
+			);
+		}
+		else
+		{
+			LmOutputs = implPtr->generate(
+				InputTensor,
+				NumNewTokens,
+				KVCache.Get(),
+				static_cast<LlamaSamplingOptions>(SamplingOptions),
+				nullptr,
+				GetPrefixCache().get()
+			);
+		}
+	}
+	catch (const std::exception& Exception)
+	{
+		ATUM_LOG(Error, TEXT("%hs"), Exception.what())
+		return false;
+	}
 	Output = DuplicateObject(Input.GetObject(), nullptr);
 
 	Output->SetData(LmOutputs);
@@ -112,7 +242,8 @@ bool ULlamaUnreal::LoadParams_Implementation(const FString& Path)
 {
 
 	FString const FilePath = IAtumModule::GetContentDirectory(Path);
-	if (!FPaths::FileExists(FilePath))
+	const bool bDirectory = FPaths::DirectoryExists(FilePath);
+	if (!bDirectory && !FPaths::FileExists(FilePath))
 	{
 		// Handle the case where the file doesn't exist if needed
 		UE_LOG(LogTemp, Warning, TEXT("File does not exist: %s"), *FilePath);
@@ -121,9 +252,60 @@ bool ULlamaUnreal::LoadParams_Implementation(const FString& Path)
 
 	UE_LOG(LogTemp, Warning, TEXT("File exists: %s"), *FilePath);
 	std::string StdPath = TCHAR_TO_UTF8(*FilePath);
-	
-	
-	torch::load(*Module, StdPath);
+
+	// the weights are replaced, quantized and fused in place
+	const std::unique_lock<std::mutex> ModuleLock = TryLockModule();
+	if (!ModuleLock.owns_lock() || !InitializeForLoad())
+		return false;
+
+	const bool bSafetensors = bDirectory || FPaths::GetExtension(FilePath) == TEXT("safetensors");
+	if (bSafetensors)
+	{
+		// the weights stay mapped, no second copy is deserialised, unless a training module asks for copies
+		try
+		{
+			if (bMapWeights)
+			{
+				(*Module)->eval();
+			}
+			else
+			{
+				(*Module)->train();
+			}
+			load_safetensors(**Module, StdPath, bParallelLoad);
+		}
+		catch (const std::exception& Exception)
+		{
+			ATUM_LOG(Error, TEXT("%hs"), Exception.what())
+			return false;
+		}
+	}
+	else
+	{
+		torch::load(*Module, StdPath);
+	}
+
+	// archives that already hold quantized weights are built quantized through Options instead
+	if (QuantizeOnLoad != EAtumLlamaQuantization::None)
+	{
+		try
+		{
+			(*Module)->quantize(AtumEnums::Cast(QuantizeOnLoad), Options.QuantizationGroupSize, Options.QuantizeLmHead);
+		}
+		catch (const std::exception& Exception)
+		{
+			ATUM_LOG(Error, TEXT("%hs"), Exception.what())
+			return false;
+		}
+		Options.SetFrom((*Module)->config);
+	}
+
+	// fusing copies the projections out of the mapping, which would leave most of every layer unshared
+	const bool bMapped = bSafetensors && bMapWeights && QuantizeOnLoad == EAtumLlamaQuantization::None;
+	if (bFuseProjections && !bMapped)
+	{
+		(*Module)->fuse_projections();
+	}
 
 
 	UE_LOG(LogTemp, Warning, TEXT("Loaded parameters"));
@@ -156,3 +338,438 @@ bool ULlamaUnreal::ToArchive_Implementation(const FString& InPath, const FString
 	return true;
 }
 
+
+bool ULlamaUnreal::ToQuantizedArchive(const FString& InPath, const FString& OutPath, const EAtumLlamaQuantization Quantization)
+{
+	FString const FilePath = IAtumModule::GetContentDirectory(InPath);
+	if (!FPaths::FileExists(FilePath))
+	{
+		UE_LOG(LogTemp, Warning, TEXT("File does not exist: %s"), *FilePath);
+		return false;  
+	}
+
+	std::string StdPath = TCHAR_TO_UTF8(*FilePath);
+	FString const OutFilePath = IAtumModule::GetContentDirectory(OutPath);
+
+	try
+	{
+		QuantizedArchiveConverter converter(AtumEnums::Cast(Quantization), Options.QuantizationGroupSize, Options.QuantizeLmHead);
+		converter.toOutputArchive(StdPath, TCHAR_TO_UTF8(*OutFilePath));
+	}
+	catch (const std::exception& Exception)
+	{
+		ATUM_LOG(Error, TEXT("%hs"), Exception.what())
+		return false;
+	}
+
+	return true;
+}
+
+
+bool ULlamaUnreal::ToSafetensors(const FString& OutPath)
+{
+	if (!Module)
+	{
+		ATUM_LOG(Error, TEXT("Llama module is not initialised!"))
+		return false;
+	}
+
+	FString const OutFilePath = IAtumModule::GetContentDirectory(OutPath);
+
+	try
+	{
+		save_safetensors(**Module, TCHAR_TO_UTF8(*OutFilePath));
+	}
+	catch (const std::exception& Exception)
+	{
+		ATUM_LOG(Error, TEXT("%hs"), Exception.what())
+		return false;
+	}
+
+	return true;
+}
+
+
+int32 ULlamaUnreal::BeginSession()
+{
+	if (!Module)
+	{
+		ATUM_LOG(Error, TEXT("Llama module is not initialised!"))
+		return INDEX_NONE;
+	}
+
+	auto implPtr = std::dynamic_pointer_cast<LlamaCausalLMImpl>(Module->ptr());
+
+	TSharedPtr<LlamaCache> Cache;
+	try
+	{
+		if (SessionWindowTokens > 0)
+		{
+			Cache = MakeShared<LlamaSinkCache>(implPtr->config, SessionSinkTokens, SessionWindowTokens);
+		}
+		else
+		{
+			Cache = MakeShared<LlamaPagedCache>(implPtr->config, GetKVBlockPool());
+		}
+	}
+	catch (const std::exception& Exception)
+	{
+		ATUM_LOG(Error, TEXT("%hs"), Exception.what())
+		return INDEX_NONE;
+	}
+
+	const int32 SessionId = NextSessionId++;
+	Sessions.Add(SessionId, FLlamaSession{ Cache, torch::Tensor(), {} });
+	return SessionId;
+}
+
+bool ULlamaUnreal::GenerateInSession(
+	const int32 SessionId,
+	const TScriptInterface<IAtumTensor>& Input,
+	TScriptInterface<IAtumTensor>& Output,
+	const int32& NumNewTokens
+)
+{
+	FLlamaSession* const Session = Sessions.Find(SessionId);
+	if (!Session)
+	{
+		ATUM_LOG(Error, TEXT("Unknown Llama session %d!"), SessionId)
+		return false;
+	}
+
+	TArray<int64> InputSizes;
+	Input->GetSizes(InputSizes);
+
+	if (InputSizes.Num() != 2 || InputSizes[0] != 1)
+	{
+		ATUM_LOG(Error, TEXT("Sessions take a [1, seq_len] input tensor!"))
+		return false;
+	}
+
+	const std::unique_lock<std::mutex> ModuleLock = TryLockModule();
+	if (!ModuleLock.owns_lock())
+		return false;
+
+	auto implPtr = std::dynamic_pointer_cast<LlamaCausalLMImpl>(Module->ptr());
+	implPtr->eval();
+
+	torch::Tensor InputTensor = Input->GetDataChecked().to(c10::kLong);
+
+	// the token sampled last time has not been cached yet
+	const int64 NumPending = Session->PendingTokens.defined() ? Session->PendingTokens.size(1) : 0;
+	if (NumPending > 0)
+	{
+		InputTensor = torch::cat({Session->PendingTokens, InputTensor}, 1);
+	}
+
+	torch::Tensor LmOutputs;
+	try
+	{
+		// only the first call of a session starts on an empty cache and can reuse a prefix
+		LmOutputs = implPtr->generate(
+			InputTensor,
+			NumNewTokens,
+			Session->Cache.Get(),
+			static_cast<LlamaSamplingOptions>(SamplingOptions),
+			nullptr,
+			GetPrefixCache().get(),
+			Session->History
+		);
+	}
+	catch (const std::exception& Exception)
+	{
+		ATUM_LOG(Error, TEXT("%hs"), Exception.what())
+		return false;
+	}
+
+	// nothing was generated, so nothing of the input reached the cache and all of it stays pending
+	const int64 NumInput = InputTensor.size(1);
+	if (LmOutputs.size(1) == NumInput)
+	{
+		Session->PendingTokens = InputTensor;
+		if (NumNewTokens > 0)
+		{
+			ATUM_LOG(Error, TEXT("Llama session %d has no room left for new tokens!"), SessionId)
+			return false;
+		}
+
+		Output = DuplicateObject(Input.GetObject(), nullptr);
+		Output->SetData(LmOutputs.narrow(1, NumPending, 0));
+		return true;
+	}
+
+	// everything but the last sampled token went through the model
+	const torch::Tensor Consumed = LmOutputs.narrow(1, 0, LmOutputs.size(1) - 1).to(torch::kCPU).contiguous();
+	Session->History.insert(Session->History.end(), Consumed.data_ptr<int64_t>(), Consumed.data_ptr<int64_t>() + Consumed.numel());
+
+	// a sink cache forgets old tokens, so do the penalties
+	if (SessionWindowTokens > 0 && Session->History.size() > static_cast<size_t>(SessionWindowTokens))
+	{
+		Session->History.erase(Session->History.begin(), Session->History.end() - SessionWindowTokens);
+	}
+
+	Session->PendingTokens = LmOutputs.narrow(1, LmOutputs.size(1) - 1, 1);
+
+	Output = DuplicateObject(Input.GetObject(), nullptr);
+	Output->SetData(LmOutputs.narrow(1, NumPending, LmOutputs.size(1) - NumPending));
+
+	return true;
+}
+
+bool ULlamaUnreal::EndSession(const int32 SessionId)
+{
+	// dropping the cache hands its blocks back to the pool
+	return Sessions.Remove(SessionId) > 0;
+}
+
+float ULlamaUnreal::GetKVCacheOccupancy() const
+{
+	return KVBlockPool ? static_cast<float>(KVBlockPool->occupancy()) : 0.0f;
+}
+
+std::shared_ptr<LlamaBlockPool> ULlamaUnreal::GetKVBlockPool()
+{
+	if (!KVBlockPool)
+	{
+		auto implPtr = std::dynamic_pointer_cast<LlamaCausalLMImpl>(Module->ptr());
+		KVBlockPool = std::make_shared<LlamaBlockPool>(implPtr->config, KVCacheNumBlocks, KVCacheBlockSize);
+	}
+	return KVBlockPool;
+}
+
+int32 ULlamaUnreal::SubmitGeneration(const TScriptInterface<IAtumTensor>& Input, const int32 NumNewTokens)
+{
+	if (!Module)
+	{
+		ATUM_LOG(Error, TEXT("Llama module is not initialised!"))
+		return INDEX_NONE;
+	}
+
+	TArray<int64> InputSizes;
+	Input->GetSizes(InputSizes);
+
+	if (InputSizes.IsEmpty() || (InputSizes.Num() == 2 && InputSizes[0] != 1) || InputSizes.Num() > 2)
+	{
+		ATUM_LOG(Error, TEXT("Batched generation takes one [1, seq_len] prompt per request!"))
+		return INDEX_NONE;
+	}
+
+	if (!Scheduler)
+	{
+		const std::unique_lock<std::mutex> ModuleLock = TryLockModule();
+		if (!ModuleLock.owns_lock())
+			return INDEX_NONE;
+
+		auto implPtr = std::dynamic_pointer_cast<LlamaCausalLMImpl>(Module->ptr());
+		implPtr->eval();
+		Scheduler = MakeShared<LlamaScheduler>(implPtr, GetKVBlockPool(), MaxBatchSize);
+	}
+
+	try
+	{
+		return static_cast<int32>(Scheduler->submit(
+			Input->GetDataChecked(),
+			NumNewTokens,
+			static_cast<LlamaSamplingOptions>(SamplingOptions)
+		));
+	}
+	catch (const std::exception& Exception)
+	{
+		ATUM_LOG(Error, TEXT("%hs"), Exception.what())
+		return INDEX_NONE;
+	}
+}
+
+bool ULlamaUnreal::StepGeneration()
+{
+	if (!Scheduler)
+		return false;
+
+	// still unfinished, the requests are stepped once the async generation is done
+	const std::unique_lock<std::mutex> ModuleLock = TryLockModule();
+	if (!ModuleLock.owns_lock())
+		return Scheduler->has_unfinished();
+
+	try
+	{
+		Scheduler->step();
+	}
+	catch (const std::exception& Exception)
+	{
+		ATUM_LOG(Error, TEXT("%hs"), Exception.what())
+	}
+	return Scheduler->has_unfinished();
+}
+
+bool ULlamaUnreal::GetGenerationResult(const int32 RequestId, TScriptInterface<IAtumTensor>& Output)
+{
+	if (!Scheduler || !Scheduler->is_finished(RequestId))
+		return false;
+
+	// a failed request is forgotten as well, and reports why
+	torch::Tensor Result;
+	try
+	{
+		Result = Scheduler->take_result(RequestId);
+	}
+	catch (const std::exception& Exception)
+	{
+		ATUM_LOG(Error, TEXT("%hs"), Exception.what())
+		return false;
+	}
+
+	Output = NewObject<UAtumTensorLong>(GetTransientPackage());
+	Output->SetData(Result);
+	return true;
+}
+
+void ULlamaUnreal::CancelGeneration(const int32 RequestId)
+{
+	if (Scheduler)
+	{
+		Scheduler->cancel(RequestId);
+	}
+}
+
+int32 ULlamaUnreal::GenerateAsync(
+	const TScriptInterface<IAtumTensor>& Input,
+	const int32 NumNewTokens,
+	FAtumLlamaOnTokens OnTokens,
+	FAtumLlamaOnGenerationComplete OnComplete
+)
+{
+	if (!Module)
+	{
+		ATUM_LOG(Error, TEXT("Llama module is not initialised!"))
+		return INDEX_NONE;
+	}
+
+	TArray<int64> InputSizes;
+	Input->GetSizes(InputSizes);
+
+	if (InputSizes.Num() != 2 || InputSizes[0] != 1)
+	{
+		ATUM_LOG(Error, TEXT("Async generation takes a [1, seq_len] input tensor!"))
+		return INDEX_NONE;
+	}
+
+	// switched to eval by the worker, the module may still be in use by an earlier one
+	auto implPtr = std::dynamic_pointer_cast<LlamaCausalLMImpl>(Module->ptr());
+
+	const int32 RequestId = NextAsyncGenerationId++;
+	TSharedPtr<std::atomic<bool>> bCancelled = MakeShared<std::atomic<bool>>(false);
+	AsyncGenerations.Add(RequestId, bCancelled);
+
+	// everything the worker touches is captured by value, the object may die before it finishes
+	torch::Tensor InputTensor = Input->GetDataChecked().to(c10::kLong).clone();
+	const LlamaSamplingOptions Sampling = static_cast<LlamaSamplingOptions>(SamplingOptions);
+	const int32 FlushInterval = TokensPerCallback;
+	TWeakObjectPtr<ULlamaUnreal> WeakThis(this);
+	std::shared_ptr<std::mutex> Mutex = AsyncGenerationMutex;
+	std::shared_ptr<LlamaPrefixCache> SharedPrefixCache = GetPrefixCache();
+
+	Async(EAsyncExecution::Thread, [=]() mutable
+	{
+		TArray<int64> Pending;
+		auto FlushPending = [&]()
+		{
+			if (Pending.IsEmpty())
+				return;
+
+			AsyncTask(ENamedThreads::GameThread, [OnTokens, RequestId, Tokens = MoveTemp(Pending)]()
+			{
+				OnTokens.ExecuteIfBound(RequestId, Tokens);
+			});
+			Pending.Reset();
+		};
+
+		torch::Tensor Result;
+		bool bSuccess = true;
+		{
+			std::lock_guard<std::mutex> Lock(*Mutex);
+			try
+			{
+				implPtr->eval();
+				Result = implPtr->generate(
+					InputTensor,
+					NumNewTokens,
+					nullptr,
+					Sampling,
+					[&](const torch::Tensor& NextTokens)
+					{
+						Pending.Add(NextTokens.index({0, 0}).item<int64>());
+						if (Pending.Num() >= FlushInterval)
+						{
+							FlushPending();
+						}
+						return !bCancelled->load();
+					},
+					SharedPrefixCache.get()
+				);
+			}
+			catch (const std::exception& Exception)
+			{
+				ATUM_LOG(Error, TEXT("%hs"), Exception.what())
+				bSuccess = false;
+			}
+		}
+		FlushPending();
+
+		TArray<int64> Tokens;
+		if (Result.defined())
+		{
+			const torch::Tensor Row = Result[0].to(torch::kCPU).contiguous();
+			Tokens.Append(Row.data_ptr<int64>(), Row.numel());
+		}
+		bSuccess = bSuccess && !bCancelled->load();
+
+		AsyncTask(ENamedThreads::GameThread, [WeakThis, OnComplete, RequestId, bSuccess, Tokens = MoveTemp(Tokens)]()
+		{
+			if (ULlamaUnreal* const This = WeakThis.Get())
+			{
+				This->AsyncGenerations.Remove(RequestId);
+			}
+			OnComplete.ExecuteIfBound(RequestId, bSuccess, Tokens);
+		});
+	});
+
+	return RequestId;
+}
+
+std::unique_lock<std::mutex> ULlamaUnreal::TryLockModule() const
+{
+	std::unique_lock<std::mutex> Lock(*AsyncGenerationMutex, std::try_to_lock);
+	if (!Lock.owns_lock())
+	{
+		ATUM_LOG(Error, TEXT("Llama module is busy with an async generation, try again once it completes!"))
+	}
+	return Lock;
+}
+bool ULlamaUnreal::InitializeForLoad()
+{
+	if (bInitialized)
+		return true;
+
+	TGuardValue<bool> InitializingForLoad(bInitializingForLoad, true);
+	return Execute_InitializeData(this, false);
+}
+
+void ULlamaUnreal::CancelAsyncGeneration(const int32 RequestId)
+{
+	if (const TSharedPtr<std::atomic<bool>>* const bCancelled = AsyncGenerations.Find(RequestId))
+	{
+		(*bCancelled)->store(true);
+	}
+}
+
+void ULlamaUnreal::BeginDestroy()
+{
+	// workers keep the module alive on their own, they only need to stop early
+	for (const auto& Generation : AsyncGenerations)
+	{
+		Generation.Value->store(true);
+	}
+	AsyncGenerations.Empty();
+
+	Super::BeginDestroy();
+}
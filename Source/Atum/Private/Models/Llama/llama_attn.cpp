@@ -4,12 +4,14 @@
 #include <stdexcept>
 #include <Models/Llama/llama_attn.h>
 #include <Models/Llama/llama_utils.h>
+#include <Models/Llama/llama_kernels.h>
 
 
 
 
-LlamaAttentionImpl::LlamaAttentionImpl(const LlamaConfig& config)
+LlamaAttentionImpl::LlamaAttentionImpl(const LlamaConfig& config, int64_t layer_idx)
     : config(config),
+      layer_idx(layer_idx),
       hidden_size(config.hidden_size),
       num_heads(config.num_attention_heads),
       head_dim(hidden_size / num_heads),
@@ -17,10 +19,10 @@ LlamaAttentionImpl::LlamaAttentionImpl(const LlamaConfig& config)
       max_position_embeddings(config.max_position_embeddings),
       rope_theta(config.rope_theta),
       is_causal(true),
-      q_proj(torch::nn::Linear(torch::nn::LinearOptions(hidden_size, num_heads * head_dim).bias(false))),
-      k_proj(torch::nn::Linear(torch::nn::LinearOptions(hidden_size, config.num_key_value_heads * head_dim).bias(false))),
-      v_proj(torch::nn::Linear(torch::nn::LinearOptions(hidden_size, config.num_key_value_heads * head_dim).bias(false))),
-      o_proj(torch::nn::Linear(torch::nn::LinearOptions(num_heads * head_dim, hidden_size).bias(false)))
+      q_proj(LlamaLinear(hidden_size, num_heads * head_dim, config.quantization, config.quantization_group_size, config.dtype, config.init_weights)),
+      k_proj(LlamaLinear(hidden_size, config.num_key_value_heads * head_dim, config.quantization, config.quantization_group_size, config.dtype, config.init_weights)),
+      v_proj(LlamaLinear(hidden_size, config.num_key_value_heads * head_dim, config.quantization, config.quantization_group_size, config.dtype, config.init_weights)),
+      o_proj(LlamaLinear(num_heads * head_dim, hidden_size, config.quantization, config.quantization_group_size, config.dtype, config.init_weights))
 {
     // Constructor implementation
     // Ensure the module is registered
@@ -50,7 +52,8 @@ LlamaAttentionImpl::forward(
     const c10::optional<torch::Tensor>& position_ids,
     c10::optional<std::tuple<torch::Tensor, torch::Tensor>>& past_key_value,
     bool output_attentions,
-    bool use_cache)
+    bool use_cache,
+    LlamaCache* cache)
 {
     // Forward implementation
     // Extract sequence length from shape
@@ -58,9 +61,22 @@ LlamaAttentionImpl::forward(
     int64_t bsz = hidden_states.size(0);
 
     // Calculate query, key, value
-    torch::Tensor q = q_proj->forward(hidden_states);
-    torch::Tensor k = k_proj->forward(hidden_states);
-    torch::Tensor v = v_proj->forward(hidden_states);
+    torch::Tensor q, k, v;
+    // the fused weight is not registered, gradients only reach the parameters through the separate projections
+    if (qkv_proj && q_proj->is_part_of(*qkv_proj) && k_proj->is_part_of(*qkv_proj) && v_proj->is_part_of(*qkv_proj)
+        && !torch::GradMode::is_enabled()) {
+        // one pass over hidden_states, then split the output into views
+        const int64_t q_size = num_heads * head_dim;
+        const int64_t kv_size = config.num_key_value_heads * head_dim;
+        auto qkv = qkv_proj->forward(hidden_states);
+        q = qkv.narrow(-1, 0, q_size);
+        k = qkv.narrow(-1, q_size, kv_size);
+        v = qkv.narrow(-1, q_size + kv_size, kv_size);
+    } else {
+        q = q_proj->forward(hidden_states);
+        k = k_proj->forward(hidden_states);
+        v = v_proj->forward(hidden_states);
+    }
 
     // Split into num_heads
     q = q.view({bsz, seq_len, num_heads, head_dim}).transpose(1, 2);
@@ -69,45 +85,58 @@ LlamaAttentionImpl::forward(
 
     int64_t kv_seq_len = k.size(-2);
 
-    if (past_key_value.has_value()) {
+    if (cache) {
+        kv_seq_len += cache->get_past_length(seq_len, layer_idx);
+    } else if (past_key_value.has_value()) {
         kv_seq_len += std::get<0>(past_key_value.value()).size(-2);
     }
 
     // Apply rotary embedding
-    auto [cos, sin] = rotary->forward(v, kv_seq_len);
+    auto [cos, sin] = rotary->tables(q.scalar_type(), q.device(), kv_seq_len);
 
-    // apply rotary pos emb and get q, k
-    std::tie(q, k) = apply_rotary_pos_emb(q, k, cos, sin, position_ids);
+    // q and k are fresh projection outputs, so they are rotated in place
+    // unless autograd tracks them, then the rotation has to stay in the graph
+    if (requires_autograd({ q, k })) {
+        std::tie(q, k) = apply_rotary_pos_emb(q, k, cos, sin, position_ids);
+    } else {
+        rotary_embedding_(q, k, cos, sin, position_ids.value());
+    }
 
-    // check if past_key_value is not empty
-// check if past_key_value contains a value
-    if (past_key_value.has_value()) {
+    // a paged cache hands the tiled kernel its pool blocks, which are read through the block table
+    // an int8 cache hands its states to the tiled kernel as they are, dequantizing one key block at a time
+    const bool tiled = !output_attentions && supports_tiled_attention(q);
+    const bool paged_states = cache && cache->is_paged() && tiled;
+    const bool int8_states = cache && cache->is_int8() && tiled && !paged_states;
+    torch::Tensor k_scales, v_scales;
+    LlamaPagedStates paged;
+
+    // an external cache is written in place and hands back the states to attend over
+    if (paged_states) {
+        paged = cache->update_paged(k, v, layer_idx);
+    } else if (int8_states) {
+        std::tie(k, k_scales, v, v_scales) = cache->update_int8(k, v, layer_idx);
+    } else if (cache) {
+        std::tie(k, v) = cache->update(k, v, layer_idx);
+    }
+    // check if past_key_value contains a value
+    else if (past_key_value.has_value()) {
         // If past_key_value contains a value, then access it using the value() method
         // [bs, num_heads, seq_len, head_dim]
         k = torch::cat({std::get<0>(past_key_value.value()), k}, 2);
         v = torch::cat({std::get<1>(past_key_value.value()), v}, 2);
     } 
 
-    if (use_cache) {
+    if (use_cache && !cache) {
         // If use_cache is true, then create a tuple of tensors and assign it to past_key_value
         past_key_value = std::make_tuple(k, v);
     }
 
-    k = repeat_kv(k, num_key_value_groups);
-    v = repeat_kv(v, num_key_value_groups);
-
-    // calculate attention scores
-    torch::Tensor attention_scores = torch::matmul(q, k.transpose(2, 3)) / std::sqrt(head_dim);
-
-    // Check if the size of attention_scores matches the expected dimensions
-    if (!(attention_scores.size(0) == bsz && 
-          attention_scores.size(1) == num_heads &&
-          attention_scores.size(2) == seq_len && 
-          attention_scores.size(3) == kv_seq_len)) {
+    // Check if the size of the states matches the expected dimensions
+    const int64_t num_states = paged_states ? paged.length : k.size(2);
+    if (num_states != kv_seq_len) {
         std::stringstream ss;
         ss << "Attention weights should be of size (" << bsz << ", " << num_heads << ", " << seq_len << ", " << kv_seq_len 
-           << "), but is (" << attention_scores.size(0) << ", " << attention_scores.size(1) << ", "
-           << attention_scores.size(2) << ", " << attention_scores.size(3) << ")";
+           << "), but is (" << bsz << ", " << num_heads << ", " << seq_len << ", " << num_states << ")";
         throw std::runtime_error(ss.str());
     }
 
@@ -120,14 +149,47 @@ LlamaAttentionImpl::forward(
             << attention_mask->size(2) << ", " << attention_mask->size(3) << ")";
             throw std::runtime_error(ss.str());
         }
-        attention_scores = attention_scores + *attention_mask;
     }
 
-    // upcast attention to fp32 using softmax
-    attention_scores = torch::softmax(attention_scores, -1, torch::kFloat32).to(q.dtype());
+    torch::Tensor attention_scores;
+    torch::Tensor attn_output;
+
+    if (paged_states) {
+        attn_output = paged_attention(
+            q, paged.keys, paged.values, paged.key_scales, paged.value_scales, paged.block_table, paged.length,
+            attention_mask, is_causal, 1.0 / std::sqrt(head_dim));
+    } else if (int8_states) {
+        attn_output = tiled_attention_int8(q, k, k_scales, v, v_scales, attention_mask, is_causal, 1.0 / std::sqrt(head_dim));
+    } else if (!output_attentions && supports_tiled_attention(q)) {
+        // tiled with an online softmax, the scores are never materialised
+        // causal skips the key blocks after the last query of each tile, the mask still adds padding
+        attn_output = tiled_attention(q, k, v, attention_mask, is_causal, 1.0 / std::sqrt(head_dim));
+    } else {
+        // grouped query attention without repeat_kv
+        // query head h reads kv head h / num_key_value_groups, so the queries of a group are stacked as rows
+        // [bs, num_key_value_heads, num_key_value_groups * seq_len, head_dim] and k, v are read once per group
+        const int64_t num_key_value_heads = config.num_key_value_heads;
+        auto grouped_q = q.reshape({bsz, num_key_value_heads, num_key_value_groups * seq_len, head_dim});
+
+        // calculate attention scores, [bs, num_key_value_heads, num_key_value_groups, seq_len, kv_seq_len]
+        attention_scores = torch::matmul(grouped_q, k.transpose(2, 3)) / std::sqrt(head_dim);
+        attention_scores = attention_scores.view({bsz, num_key_value_heads, num_key_value_groups, seq_len, kv_seq_len});
+
+        if (attention_mask) {
+            // one mask for every head of every group
+            attention_scores = attention_scores + attention_mask->unsqueeze(2);
+        }
 
+        // upcast attention to fp32 using softmax
+        attention_scores = torch::softmax(attention_scores, -1, torch::kFloat32).to(q.dtype());
 
-    torch::Tensor attn_output = torch::matmul(attention_scores, v);
+        attn_output = torch::matmul(
+            attention_scores.view({bsz, num_key_value_heads, num_key_value_groups * seq_len, kv_seq_len}), v);
+
+        // back to [bs, num_heads, seq_len, ...], free since the groups are contiguous
+        attn_output = attn_output.view({bsz, num_heads, seq_len, head_dim});
+        attention_scores = attention_scores.view({bsz, num_heads, seq_len, kv_seq_len});
+    }
 
 
         // Check if the size of attn_output matches the expected dimensions
@@ -168,3 +230,18 @@ LlamaAttentionImpl::forward(
 
 
 
+
+
+
+void LlamaAttentionImpl::fuse_projections()
+{
+    qkv_proj = LlamaLinear(LlamaLinearImpl::fuse({q_proj.ptr(), k_proj.ptr(), v_proj.ptr()}));
+}
+
+
+bool LlamaAttentionImpl::unfuse_projections()
+{
+    const bool fused = static_cast<bool>(qkv_proj);
+    qkv_proj = nullptr;
+    return fused;
+}
\ No newline at end of file
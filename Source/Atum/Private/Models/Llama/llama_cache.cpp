@@ -0,0 +1,979 @@
+#include "Models/Llama/llama_cache.h"
+#include "Models/Llama/llama_kernels.h"
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+
+
+int64_t LlamaCache::get_past_length(int64_t, int64_t layer_idx) const
+{
+    return get_seq_length(layer_idx);
+}
+
+
+int64_t LlamaCache::get_max_step_length() const
+{
+    return -1;
+}
+
+
+bool LlamaCache::is_int8() const
+{
+    return false;
+}
+
+
+std::tuple<torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor> LlamaCache::update_int8(
+    const torch::Tensor&,
+    const torch::Tensor&,
+    int64_t)
+{
+    throw std::logic_error("The cache does not store int8 states");
+}
+
+
+bool LlamaCache::is_paged() const
+{
+    return false;
+}
+
+
+LlamaPagedStates LlamaCache::update_paged(
+    const torch::Tensor&,
+    const torch::Tensor&,
+    int64_t)
+{
+    throw std::logic_error("The cache does not store its states in pool blocks");
+}
+
+
+namespace {
+
+// turns keys rotated at position p into keys rotated at p + offset, rotary rotations compose
+// computed in float32 so the rounding of repeated shifts stays at that of the storage dtype
+torch::Tensor shift_rotary(const torch::Tensor& keys, const torch::Tensor& inv_freq, int64_t offset)
+{
+    auto angles = (inv_freq * static_cast<double>(offset)).to(keys.device());
+    auto cos = angles.cos().to(torch::kFloat32);
+    auto sin = angles.sin().to(torch::kFloat32);
+
+    auto x = keys.to(torch::kFloat32);
+    const int64_t half = x.size(-1) / 2;
+    auto x1 = x.narrow(-1, 0, half);
+    auto x2 = x.narrow(-1, half, half);
+    return torch::cat({ x1 * cos - x2 * sin, x2 * cos + x1 * sin }, -1).to(keys.scalar_type());
+}
+
+}
+
+
+torch::Dtype kv_cache_dtype(const LlamaConfig& config)
+{
+    switch (config.kv_cache_quantization) {
+    case LlamaQuantization::None:
+        return config.dtype;
+    case LlamaQuantization::Int8:
+        return torch::kInt8;
+    default:
+        throw std::invalid_argument("KV caches hold plain or Int8 states");
+    }
+}
+
+
+
+LlamaStaticCache::LlamaStaticCache(
+    const LlamaConfig& config,
+    int64_t batch_size,
+    int64_t max_cache_len,
+    const torch::Device& device)
+    : batch_size(batch_size),
+    max_cache_len(max_cache_len > 0 ? max_cache_len : config.max_position_embeddings),
+    dtype(config.dtype),
+    seq_lengths(config.num_hidden_layers, 0)
+{
+    const int64_t head_dim = config.hidden_size / config.num_attention_heads;
+    auto options = torch::TensorOptions().dtype(kv_cache_dtype(config)).device(device);
+    const bool int8 = config.kv_cache_quantization == LlamaQuantization::Int8;
+
+    key_cache.reserve(config.num_hidden_layers);
+    value_cache.reserve(config.num_hidden_layers);
+    for (int i = 0; i < config.num_hidden_layers; ++i) {
+        // [bsz, num_key_value_heads, max_cache_len, head_dim]
+        key_cache.push_back(torch::zeros({batch_size, config.num_key_value_heads, this->max_cache_len, head_dim}, options));
+        value_cache.push_back(torch::zeros({batch_size, config.num_key_value_heads, this->max_cache_len, head_dim}, options));
+
+        if (int8) {
+            auto scale_options = options.dtype(torch::kFloat32);
+            key_scales.push_back(torch::zeros({batch_size, config.num_key_value_heads, this->max_cache_len}, scale_options));
+            value_scales.push_back(torch::zeros({batch_size, config.num_key_value_heads, this->max_cache_len}, scale_options));
+        }
+    }
+}
+
+
+int64_t LlamaStaticCache::write(
+    const torch::Tensor& key_states,
+    const torch::Tensor& value_states,
+    int64_t layer_idx)
+{
+    const int64_t bsz = key_states.size(0);
+    const int64_t start = seq_lengths[layer_idx];
+    const int64_t end = start + key_states.size(2);
+
+    if (bsz > batch_size || end > max_cache_len) {
+        std::stringstream ss;
+        ss << "Static cache holds (" << batch_size << ", " << max_cache_len << ") tokens, but ("
+           << bsz << ", " << end << ") were requested";
+        throw std::runtime_error(ss.str());
+    }
+
+    auto keys = key_cache[layer_idx].narrow(0, 0, bsz).narrow(2, start, end - start);
+    auto values = value_cache[layer_idx].narrow(0, 0, bsz).narrow(2, start, end - start);
+
+    // write in place at the current offset
+    if (is_int8()) {
+        auto [qkeys, new_key_scales] = quantize_kv_int8(key_states);
+        auto [qvalues, new_value_scales] = quantize_kv_int8(value_states);
+        keys.copy_(qkeys);
+        values.copy_(qvalues);
+        key_scales[layer_idx].narrow(0, 0, bsz).narrow(2, start, end - start).copy_(new_key_scales);
+        value_scales[layer_idx].narrow(0, 0, bsz).narrow(2, start, end - start).copy_(new_value_scales);
+    } else {
+        keys.copy_(key_states);
+        values.copy_(value_states);
+    }
+    seq_lengths[layer_idx] = end;
+    return end;
+}
+
+
+std::tuple<torch::Tensor, torch::Tensor> LlamaStaticCache::update(
+    const torch::Tensor& key_states,
+    const torch::Tensor& value_states,
+    int64_t layer_idx)
+{
+    const int64_t bsz = key_states.size(0);
+    const int64_t end = write(key_states, value_states, layer_idx);
+
+    auto keys = key_cache[layer_idx].narrow(0, 0, bsz).narrow(2, 0, end);
+    auto values = value_cache[layer_idx].narrow(0, 0, bsz).narrow(2, 0, end);
+    if (is_int8()) {
+        keys = dequantize_kv_int8(keys, key_scales[layer_idx].narrow(0, 0, bsz).narrow(2, 0, end), dtype);
+        values = dequantize_kv_int8(values, value_scales[layer_idx].narrow(0, 0, bsz).narrow(2, 0, end), dtype);
+    }
+    return std::make_tuple(keys, values);
+}
+
+
+std::tuple<torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor> LlamaStaticCache::update_int8(
+    const torch::Tensor& key_states,
+    const torch::Tensor& value_states,
+    int64_t layer_idx)
+{
+    if (!is_int8()) {
+        return LlamaCache::update_int8(key_states, value_states, layer_idx);
+    }
+
+    const int64_t bsz = key_states.size(0);
+    const int64_t end = write(key_states, value_states, layer_idx);
+    return std::make_tuple(
+        key_cache[layer_idx].narrow(0, 0, bsz).narrow(2, 0, end),
+        key_scales[layer_idx].narrow(0, 0, bsz).narrow(2, 0, end),
+        value_cache[layer_idx].narrow(0, 0, bsz).narrow(2, 0, end),
+        value_scales[layer_idx].narrow(0, 0, bsz).narrow(2, 0, end));
+}
+
+
+std::tuple<torch::Tensor, torch::Tensor> LlamaStaticCache::get_states(int64_t layer_idx)
+{
+    const int64_t end = seq_lengths[layer_idx];
+    auto keys = key_cache[layer_idx].narrow(2, 0, end);
+    auto values = value_cache[layer_idx].narrow(2, 0, end);
+    if (is_int8()) {
+        keys = dequantize_kv_int8(keys, key_scales[layer_idx].narrow(2, 0, end), dtype);
+        values = dequantize_kv_int8(values, value_scales[layer_idx].narrow(2, 0, end), dtype);
+    }
+    return std::make_tuple(keys, values);
+}
+
+
+int64_t LlamaStaticCache::get_seq_length(int64_t layer_idx) const
+{
+    return seq_lengths[layer_idx];
+}
+
+
+int64_t LlamaStaticCache::get_max_length() const
+{
+    return max_cache_len;
+}
+
+
+void LlamaStaticCache::reset()
+{
+    // the stale states are overwritten before they are ever read again
+    std::fill(seq_lengths.begin(), seq_lengths.end(), 0);
+}
+
+
+void LlamaStaticCache::crop(int64_t max_length)
+{
+    for (auto& seq_length : seq_lengths) {
+        seq_length = std::min(seq_length, std::max<int64_t>(max_length, 0));
+    }
+}
+
+
+int64_t LlamaStaticCache::memory_bytes() const
+{
+    int64_t bytes = 0;
+    for (size_t i = 0; i < key_cache.size(); ++i) {
+        bytes += key_cache[i].nbytes() + value_cache[i].nbytes();
+    }
+    for (size_t i = 0; i < key_scales.size(); ++i) {
+        bytes += key_scales[i].nbytes() + value_scales[i].nbytes();
+    }
+    return bytes;
+}
+
+
+bool LlamaStaticCache::is_int8() const
+{
+    return !key_scales.empty();
+}
+
+
+int64_t LlamaStaticCache::get_batch_size() const
+{
+    return batch_size;
+}
+
+
+
+LlamaBlockPool::LlamaBlockPool(
+    const LlamaConfig& config,
+    int64_t num_blocks,
+    int64_t block_size,
+    const torch::Device& device)
+    : num_blocks(num_blocks),
+    block_size(block_size),
+    dtype(config.dtype)
+{
+    const int64_t head_dim = config.hidden_size / config.num_attention_heads;
+    auto options = torch::TensorOptions().dtype(kv_cache_dtype(config)).device(device);
+    const bool int8 = config.kv_cache_quantization == LlamaQuantization::Int8;
+
+    key_cache.reserve(config.num_hidden_layers);
+    value_cache.reserve(config.num_hidden_layers);
+    for (int i = 0; i < config.num_hidden_layers; ++i) {
+        key_cache.push_back(torch::zeros({num_blocks, block_size, config.num_key_value_heads, head_dim}, options));
+        value_cache.push_back(torch::zeros({num_blocks, block_size, config.num_key_value_heads, head_dim}, options));
+
+        if (int8) {
+            auto scale_options = options.dtype(torch::kFloat32);
+            key_scales.push_back(torch::zeros({num_blocks, block_size, config.num_key_value_heads}, scale_options));
+            value_scales.push_back(torch::zeros({num_blocks, block_size, config.num_key_value_heads}, scale_options));
+        }
+    }
+
+    // hand out low block ids first
+    free_blocks.reserve(num_blocks);
+    for (int64_t i = num_blocks - 1; i >= 0; --i) {
+        free_blocks.push_back(i);
+    }
+}
+
+
+int64_t LlamaBlockPool::allocate()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (free_blocks.empty()) {
+        throw std::runtime_error("KV block pool is exhausted");
+    }
+    const int64_t block = free_blocks.back();
+    free_blocks.pop_back();
+    return block;
+}
+
+
+void LlamaBlockPool::free(const std::vector<int64_t>& blocks)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    free_blocks.insert(free_blocks.end(), blocks.begin(), blocks.end());
+}
+
+
+int64_t LlamaBlockPool::get_block_size() const
+{
+    return block_size;
+}
+
+
+int64_t LlamaBlockPool::get_num_blocks() const
+{
+    return num_blocks;
+}
+
+
+int64_t LlamaBlockPool::get_num_free_blocks() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return static_cast<int64_t>(free_blocks.size());
+}
+
+
+double LlamaBlockPool::occupancy() const
+{
+    if (num_blocks == 0) {
+        return 0.0;
+    }
+    return 1.0 - static_cast<double>(get_num_free_blocks()) / static_cast<double>(num_blocks);
+}
+
+
+int64_t LlamaBlockPool::memory_bytes() const
+{
+    int64_t bytes = 0;
+    for (size_t i = 0; i < key_cache.size(); ++i) {
+        bytes += key_cache[i].nbytes() + value_cache[i].nbytes();
+    }
+    for (size_t i = 0; i < key_scales.size(); ++i) {
+        bytes += key_scales[i].nbytes() + value_scales[i].nbytes();
+    }
+    return bytes;
+}
+
+
+torch::Tensor& LlamaBlockPool::key_blocks(int64_t layer_idx)
+{
+    return key_cache[layer_idx];
+}
+
+
+torch::Tensor& LlamaBlockPool::value_blocks(int64_t layer_idx)
+{
+    return value_cache[layer_idx];
+}
+
+
+bool LlamaBlockPool::is_int8() const
+{
+    return !key_scales.empty();
+}
+
+
+torch::Dtype LlamaBlockPool::get_dtype() const
+{
+    return dtype;
+}
+
+
+torch::Tensor& LlamaBlockPool::key_scale_blocks(int64_t layer_idx)
+{
+    return key_scales[layer_idx];
+}
+
+
+torch::Tensor& LlamaBlockPool::value_scale_blocks(int64_t layer_idx)
+{
+    return value_scales[layer_idx];
+}
+
+
+
+LlamaPagedCache::LlamaPagedCache(const LlamaConfig& config, std::shared_ptr<LlamaBlockPool> pool)
+    : pool(std::move(pool)),
+    max_cache_len(config.max_position_embeddings),
+    block_table_tensor(torch::empty({0}, torch::kInt64)),
+    seq_lengths(config.num_hidden_layers, 0)
+{
+}
+
+
+LlamaPagedCache::~LlamaPagedCache()
+{
+    pool->free(block_table);
+}
+
+
+void LlamaPagedCache::reserve(int64_t num_tokens)
+{
+    const int64_t block_size = pool->get_block_size();
+    const size_t needed = static_cast<size_t>((num_tokens + block_size - 1) / block_size);
+    if (needed <= block_table.size()) {
+        return;
+    }
+
+    // all or nothing, so a pool running dry leaves the table and its tensor as they were
+    std::vector<int64_t> blocks;
+    blocks.reserve(needed - block_table.size());
+    try {
+        while (block_table.size() + blocks.size() < needed) {
+            blocks.push_back(pool->allocate());
+        }
+    } catch (...) {
+        pool->free(blocks);
+        throw;
+    }
+
+    block_table.insert(block_table.end(), blocks.begin(), blocks.end());
+    block_table_tensor = torch::tensor(block_table, torch::TensorOptions().dtype(torch::kInt64))
+        .to(pool->key_blocks(0).device());
+}
+
+
+int64_t LlamaPagedCache::write(
+    const torch::Tensor& key_states,
+    const torch::Tensor& value_states,
+    int64_t layer_idx)
+{
+    if (key_states.size(0) != 1) {
+        throw std::invalid_argument("Paged cache holds a single sequence");
+    }
+
+    const int64_t block_size = pool->get_block_size();
+    const int64_t start = seq_lengths[layer_idx];
+    const int64_t end = start + key_states.size(2);
+    if (end > max_cache_len) {
+        std::stringstream ss;
+        ss << "Paged cache holds " << max_cache_len << " tokens, but " << end << " were requested";
+        throw std::runtime_error(ss.str());
+    }
+    reserve(end);
+
+    // [1, num_key_value_heads, seq_len, ...] -> [seq_len, num_key_value_heads, ...]
+    std::vector<std::pair<torch::Tensor*, torch::Tensor>> writes;
+    if (pool->is_int8()) {
+        auto [qkeys, new_key_scales] = quantize_kv_int8(key_states);
+        auto [qvalues, new_value_scales] = quantize_kv_int8(value_states);
+        writes = {
+            {&pool->key_blocks(layer_idx), qkeys[0].transpose(0, 1)},
+            {&pool->value_blocks(layer_idx), qvalues[0].transpose(0, 1)},
+            {&pool->key_scale_blocks(layer_idx), new_key_scales[0].transpose(0, 1)},
+            {&pool->value_scale_blocks(layer_idx), new_value_scales[0].transpose(0, 1)}};
+    } else {
+        writes = {
+            {&pool->key_blocks(layer_idx), key_states[0].transpose(0, 1)},
+            {&pool->value_blocks(layer_idx), value_states[0].transpose(0, 1)}};
+    }
+
+    // scatter the new tokens block by block
+    for (int64_t pos = start; pos < end;) {
+        const int64_t block = block_table[pos / block_size];
+        const int64_t offset = pos % block_size;
+        const int64_t count = std::min(block_size - offset, end - pos);
+
+        for (auto& [blocks, states] : writes) {
+            (*blocks)[block].narrow(0, offset, count).copy_(states.narrow(0, pos - start, count));
+        }
+        pos += count;
+    }
+    seq_lengths[layer_idx] = end;
+    return end;
+}
+
+
+std::tuple<torch::Tensor, torch::Tensor> LlamaPagedCache::update(
+    const torch::Tensor& key_states,
+    const torch::Tensor& value_states,
+    int64_t layer_idx)
+{
+    return gather_states(layer_idx, write(key_states, value_states, layer_idx));
+}
+
+
+std::tuple<torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor> LlamaPagedCache::update_int8(
+    const torch::Tensor& key_states,
+    const torch::Tensor& value_states,
+    int64_t layer_idx)
+{
+    if (!is_int8()) {
+        return LlamaCache::update_int8(key_states, value_states, layer_idx);
+    }
+
+    const int64_t end = write(key_states, value_states, layer_idx);
+    return std::make_tuple(
+        gather(pool->key_blocks(layer_idx), end),
+        gather(pool->key_scale_blocks(layer_idx), end),
+        gather(pool->value_blocks(layer_idx), end),
+        gather(pool->value_scale_blocks(layer_idx), end));
+}
+
+
+bool LlamaPagedCache::is_paged() const
+{
+    return true;
+}
+
+
+LlamaPagedStates LlamaPagedCache::update_paged(
+    const torch::Tensor& key_states,
+    const torch::Tensor& value_states,
+    int64_t layer_idx)
+{
+    LlamaPagedStates states;
+    states.length = write(key_states, value_states, layer_idx);
+    states.keys = pool->key_blocks(layer_idx);
+    states.values = pool->value_blocks(layer_idx);
+    if (pool->is_int8()) {
+        states.key_scales = pool->key_scale_blocks(layer_idx);
+        states.value_scales = pool->value_scale_blocks(layer_idx);
+    }
+    states.block_table = block_table_tensor.unsqueeze(0);
+    return states;
+}
+
+
+std::tuple<torch::Tensor, torch::Tensor> LlamaPagedCache::get_states(int64_t layer_idx)
+{
+    return gather_states(layer_idx, seq_lengths[layer_idx]);
+}
+
+
+torch::Tensor LlamaPagedCache::gather(const torch::Tensor& blocks, int64_t num_tokens) const
+{
+    // gather through the block table
+    // [num_seq_blocks, block_size, num_key_value_heads, ...] -> [1, num_key_value_heads, num_tokens, ...]
+    const int64_t block_size = pool->get_block_size();
+    const int64_t num_seq_blocks = (num_tokens + block_size - 1) / block_size;
+    auto table = block_table_tensor.narrow(0, 0, num_seq_blocks);
+    return blocks.index_select(0, table).flatten(0, 1).narrow(0, 0, num_tokens).transpose(0, 1).unsqueeze(0);
+}
+
+
+std::tuple<torch::Tensor, torch::Tensor> LlamaPagedCache::gather_states(int64_t layer_idx, int64_t num_tokens) const
+{
+    auto keys = gather(pool->key_blocks(layer_idx), num_tokens);
+    auto values = gather(pool->value_blocks(layer_idx), num_tokens);
+    if (pool->is_int8()) {
+        keys = dequantize_kv_int8(keys, gather(pool->key_scale_blocks(layer_idx), num_tokens), pool->get_dtype());
+        values = dequantize_kv_int8(values, gather(pool->value_scale_blocks(layer_idx), num_tokens), pool->get_dtype());
+    }
+    return std::make_tuple(keys, values);
+}
+
+
+int64_t LlamaPagedCache::get_seq_length(int64_t layer_idx) const
+{
+    return seq_lengths[layer_idx];
+}
+
+
+int64_t LlamaPagedCache::get_max_length() const
+{
+    return max_cache_len;
+}
+
+
+void LlamaPagedCache::reset()
+{
+    pool->free(block_table);
+    block_table.clear();
+    block_table_tensor = torch::empty({0}, torch::kInt64);
+    std::fill(seq_lengths.begin(), seq_lengths.end(), 0);
+}
+
+
+void LlamaPagedCache::crop(int64_t max_length)
+{
+    max_length = std::max<int64_t>(max_length, 0);
+    for (auto& seq_length : seq_lengths) {
+        seq_length = std::min(seq_length, max_length);
+    }
+
+    // hand the blocks past the new end back to the pool
+    const int64_t block_size = pool->get_block_size();
+    const size_t needed = static_cast<size_t>((max_length + block_size - 1) / block_size);
+    if (needed < block_table.size()) {
+        pool->free(std::vector<int64_t>(block_table.begin() + needed, block_table.end()));
+        block_table.resize(needed);
+        block_table_tensor = block_table_tensor.narrow(0, 0, static_cast<int64_t>(needed)).clone();
+    }
+}
+
+
+int64_t LlamaPagedCache::memory_bytes() const
+{
+    if (pool->get_num_blocks() == 0) {
+        return 0;
+    }
+    return pool->memory_bytes() / pool->get_num_blocks() * static_cast<int64_t>(block_table.size());
+}
+
+
+bool LlamaPagedCache::is_int8() const
+{
+    return pool->is_int8();
+}
+
+
+const std::vector<int64_t>& LlamaPagedCache::get_block_table() const
+{
+    return block_table;
+}
+
+
+
+LlamaBatchCache::LlamaBatchCache(std::vector<LlamaCache*> caches)
+    : caches(std::move(caches))
+{
+}
+
+
+std::tuple<torch::Tensor, torch::Tensor> LlamaBatchCache::update(
+    const torch::Tensor& key_states,
+    const torch::Tensor& value_states,
+    int64_t layer_idx)
+{
+    std::vector<torch::Tensor> keys;
+    std::vector<torch::Tensor> values;
+    keys.reserve(caches.size());
+    values.reserve(caches.size());
+
+    for (size_t i = 0; i < caches.size(); ++i) {
+        const int64_t row = static_cast<int64_t>(i);
+        auto [k, v] = caches[i]->update(key_states.narrow(0, row, 1), value_states.narrow(0, row, 1), layer_idx);
+        keys.push_back(k);
+        values.push_back(v);
+    }
+
+    return pad_and_cat(keys, values);
+}
+
+
+std::tuple<torch::Tensor, torch::Tensor> LlamaBatchCache::get_states(int64_t layer_idx)
+{
+    std::vector<torch::Tensor> keys;
+    std::vector<torch::Tensor> values;
+    keys.reserve(caches.size());
+    values.reserve(caches.size());
+
+    for (auto* cache : caches) {
+        auto [k, v] = cache->get_states(layer_idx);
+        keys.push_back(k);
+        values.push_back(v);
+    }
+
+    return pad_and_cat(keys, values);
+}
+
+
+std::tuple<torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor> LlamaBatchCache::update_int8(
+    const torch::Tensor& key_states,
+    const torch::Tensor& value_states,
+    int64_t layer_idx)
+{
+    std::vector<torch::Tensor> keys, key_scales, values, value_scales;
+    int64_t max_len = 0;
+
+    for (size_t i = 0; i < caches.size(); ++i) {
+        const int64_t row = static_cast<int64_t>(i);
+        auto [k, k_scales, v, v_scales] = caches[i]->update_int8(key_states.narrow(0, row, 1), value_states.narrow(0, row, 1), layer_idx);
+        max_len = std::max(max_len, k.size(2));
+        keys.push_back(k);
+        key_scales.push_back(k_scales);
+        values.push_back(v);
+        value_scales.push_back(v_scales);
+    }
+
+    // padded scales are zero, so the padding dequantizes to zeros like the plain states
+    return std::make_tuple(
+        cat_rows(keys, max_len),
+        cat_rows(key_scales, max_len),
+        cat_rows(values, max_len),
+        cat_rows(value_scales, max_len));
+}
+
+
+bool LlamaBatchCache::is_int8() const
+{
+    return !caches.empty() && std::all_of(caches.begin(), caches.end(), [](const LlamaCache* cache) { return cache->is_int8(); });
+}
+
+
+bool LlamaBatchCache::is_paged() const
+{
+    return !caches.empty() && std::all_of(caches.begin(), caches.end(), [](const LlamaCache* cache) { return cache->is_paged(); });
+}
+
+
+LlamaPagedStates LlamaBatchCache::update_paged(
+    const torch::Tensor& key_states,
+    const torch::Tensor& value_states,
+    int64_t layer_idx)
+{
+    LlamaPagedStates states;
+    std::vector<torch::Tensor> tables;
+    tables.reserve(caches.size());
+    int64_t max_blocks = 0;
+
+    for (size_t i = 0; i < caches.size(); ++i) {
+        const int64_t row = static_cast<int64_t>(i);
+        auto row_states = caches[i]->update_paged(key_states.narrow(0, row, 1), value_states.narrow(0, row, 1), layer_idx);
+        if (i == 0) {
+            states = row_states;
+        } else if (!row_states.keys.is_same(states.keys)) {
+            throw std::invalid_argument("Batched paged caches must share one block pool");
+        }
+        states.length = std::max(states.length, row_states.length);
+        max_blocks = std::max(max_blocks, row_states.block_table.size(1));
+        tables.push_back(row_states.block_table);
+    }
+
+    for (auto& table : tables) {
+        table = torch::constant_pad_nd(table, {0, max_blocks - table.size(1)}, 0);
+    }
+    states.block_table = torch::cat(tables, 0);
+    return states;
+}
+
+
+std::tuple<torch::Tensor, torch::Tensor> LlamaBatchCache::pad_and_cat(
+    std::vector<torch::Tensor>& keys,
+    std::vector<torch::Tensor>& values) const
+{
+    int64_t max_len = 0;
+    for (const auto& k : keys) {
+        max_len = std::max(max_len, k.size(2));
+    }
+
+    return std::make_tuple(cat_rows(keys, max_len), cat_rows(values, max_len));
+}
+
+
+torch::Tensor LlamaBatchCache::cat_rows(std::vector<torch::Tensor>& rows, int64_t max_len)
+{
+    // right pad every row to the longest one, the token dimension is 2 for states and scales alike
+    for (auto& row : rows) {
+        const int64_t pad = max_len - row.size(2);
+        if (pad > 0) {
+            std::vector<int64_t> padding(2 * (row.dim() - 2), 0);
+            padding.back() = pad;
+            row = torch::constant_pad_nd(row, padding);
+        }
+    }
+
+    return torch::cat(rows, 0);
+}
+
+
+int64_t LlamaBatchCache::get_seq_length(int64_t layer_idx) const
+{
+    int64_t seq_length = 0;
+    for (const auto* cache : caches) {
+        seq_length = std::max(seq_length, cache->get_seq_length(layer_idx));
+    }
+    return seq_length;
+}
+
+
+int64_t LlamaBatchCache::get_max_length() const
+{
+    int64_t max_length = -1;
+    for (const auto* cache : caches) {
+        const int64_t length = cache->get_max_length();
+        if (length >= 0 && (max_length < 0 || length < max_length)) {
+            max_length = length;
+        }
+    }
+    return max_length;
+}
+
+
+void LlamaBatchCache::reset()
+{
+    for (auto* cache : caches) {
+        cache->reset();
+    }
+}
+
+
+void LlamaBatchCache::crop(int64_t max_length)
+{
+    for (auto* cache : caches) {
+        cache->crop(max_length);
+    }
+}
+
+
+int64_t LlamaBatchCache::memory_bytes() const
+{
+    int64_t bytes = 0;
+    for (const auto* cache : caches) {
+        bytes += cache->memory_bytes();
+    }
+    return bytes;
+}
+
+
+
+LlamaSinkCache::LlamaSinkCache(
+    const LlamaConfig& config,
+    int64_t num_sink_tokens,
+    int64_t window_length,
+    int64_t batch_size,
+    const torch::Device& device)
+    : num_sink_tokens(num_sink_tokens),
+    window_length(window_length),
+    batch_size(batch_size),
+    seq_lengths(config.num_hidden_layers, 0)
+{
+    if (num_sink_tokens < 0 || window_length < 1) {
+        std::stringstream ss;
+        ss << "Sink cache needs at least one window token and no negative sink tokens, got "
+           << num_sink_tokens << " and " << window_length;
+        throw std::invalid_argument(ss.str());
+    }
+
+    // quantized keys would pick up new rounding error on every shift
+    if (config.kv_cache_quantization != LlamaQuantization::None) {
+        throw std::invalid_argument("Sink caches re-rotate their keys and only hold plain states");
+    }
+
+    const int64_t head_dim = config.hidden_size / config.num_attention_heads;
+    inv_freq = 1.0 / torch::pow(config.rope_theta, torch::arange(0, head_dim, 2, torch::kFloat64) / head_dim);
+
+    auto options = torch::TensorOptions().dtype(config.dtype).device(device);
+    const int64_t capacity = num_sink_tokens + window_length;
+
+    key_cache.reserve(config.num_hidden_layers);
+    value_cache.reserve(config.num_hidden_layers);
+    for (int i = 0; i < config.num_hidden_layers; ++i) {
+        key_cache.push_back(torch::zeros({batch_size, config.num_key_value_heads, capacity, head_dim}, options));
+        value_cache.push_back(torch::zeros({batch_size, config.num_key_value_heads, capacity, head_dim}, options));
+    }
+}
+
+
+int64_t LlamaSinkCache::num_to_evict(int64_t num_new_tokens, int64_t layer_idx) const
+{
+    if (num_new_tokens > window_length) {
+        std::stringstream ss;
+        ss << "Sink cache takes at most " << window_length << " tokens per step, but " << num_new_tokens << " were given";
+        throw std::runtime_error(ss.str());
+    }
+
+    const int64_t seq_length = seq_lengths[layer_idx];
+    const int64_t overflow = seq_length + num_new_tokens - num_sink_tokens - window_length;
+    if (overflow <= 0) {
+        return 0;
+    }
+
+    // at least a quarter of the window, never more than it holds
+    return std::min(seq_length - num_sink_tokens, std::max(overflow, window_length / 4));
+}
+
+
+void LlamaSinkCache::evict(int64_t num_tokens, int64_t layer_idx)
+{
+    const int64_t kept_start = num_sink_tokens + num_tokens;
+    const int64_t num_kept = seq_lengths[layer_idx] - kept_start;
+
+    if (num_kept > 0) {
+        // the kept window moves num_tokens positions down, so do the angles of its keys
+        auto kept_keys = shift_rotary(key_cache[layer_idx].narrow(2, kept_start, num_kept), inv_freq, -num_tokens);
+        auto kept_values = value_cache[layer_idx].narrow(2, kept_start, num_kept).clone();
+        key_cache[layer_idx].narrow(2, num_sink_tokens, num_kept).copy_(kept_keys);
+        value_cache[layer_idx].narrow(2, num_sink_tokens, num_kept).copy_(kept_values);
+    }
+
+    seq_lengths[layer_idx] -= num_tokens;
+}
+
+
+std::tuple<torch::Tensor, torch::Tensor> LlamaSinkCache::update(
+    const torch::Tensor& key_states,
+    const torch::Tensor& value_states,
+    int64_t layer_idx)
+{
+    const int64_t bsz = key_states.size(0);
+    if (bsz > batch_size) {
+        std::stringstream ss;
+        ss << "Sink cache holds " << batch_size << " rows, but " << bsz << " were given";
+        throw std::runtime_error(ss.str());
+    }
+
+    // the new keys were rotated at positions following get_past_length, which already left out the evicted tokens
+    const int64_t num_evicted = num_to_evict(key_states.size(2), layer_idx);
+    if (num_evicted > 0) {
+        evict(num_evicted, layer_idx);
+    }
+
+    const int64_t start = seq_lengths[layer_idx];
+    const int64_t end = start + key_states.size(2);
+
+    key_cache[layer_idx].narrow(0, 0, bsz).narrow(2, start, end - start).copy_(key_states);
+    value_cache[layer_idx].narrow(0, 0, bsz).narrow(2, start, end - start).copy_(value_states);
+    seq_lengths[layer_idx] = end;
+
+    return std::make_tuple(
+        key_cache[layer_idx].narrow(0, 0, bsz).narrow(2, 0, end),
+        value_cache[layer_idx].narrow(0, 0, bsz).narrow(2, 0, end));
+}
+
+
+std::tuple<torch::Tensor, torch::Tensor> LlamaSinkCache::get_states(int64_t layer_idx)
+{
+    const int64_t end = seq_lengths[layer_idx];
+    return std::make_tuple(key_cache[layer_idx].narrow(2, 0, end), value_cache[layer_idx].narrow(2, 0, end));
+}
+
+
+int64_t LlamaSinkCache::get_seq_length(int64_t layer_idx) const
+{
+    return seq_lengths[layer_idx];
+}
+
+
+int64_t LlamaSinkCache::get_max_length() const
+{
+    return -1;
+}
+
+
+void LlamaSinkCache::reset()
+{
+    std::fill(seq_lengths.begin(), seq_lengths.end(), 0);
+}
+
+
+void LlamaSinkCache::crop(int64_t max_length)
+{
+    for (auto& seq_length : seq_lengths) {
+        seq_length = std::min(seq_length, std::max<int64_t>(max_length, 0));
+    }
+}
+
+
+int64_t LlamaSinkCache::memory_bytes() const
+{
+    int64_t bytes = 0;
+    for (size_t i = 0; i < key_cache.size(); ++i) {
+        bytes += key_cache[i].nbytes() + value_cache[i].nbytes();
+    }
+    return bytes;
+}
+
+
+int64_t LlamaSinkCache::get_past_length(int64_t num_new_tokens, int64_t layer_idx) const
+{
+    return seq_lengths[layer_idx] - num_to_evict(num_new_tokens, layer_idx);
+}
+
+
+int64_t LlamaSinkCache::get_max_step_length() const
+{
+    return window_length;
+}
+
+
+int64_t LlamaSinkCache::get_num_sink_tokens() const
+{
+    return num_sink_tokens;
+}
+
+
+int64_t LlamaSinkCache::get_window_length() const
+{
+    return window_length;
+}
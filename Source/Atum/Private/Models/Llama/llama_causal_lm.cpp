@@ -1,16 +1,35 @@
 #pragma once
 #include "Models/Llama/llama_causal_lm.h"
+#include "Models/Llama/llama_attn.h"
+#include "Models/Llama/llama_linear.h"
+#include "Models/Llama/llama_mlp.h"
 #include "Models/Llama/llama_utils.h"
 #include "CoreMinimal.h"
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
 
 
 LlamaCausalLMImpl::LlamaCausalLMImpl(const LlamaConfig& config)
     : config(config),
     model(LlamaModel(config))
 {
-    lm_head = torch::nn::Linear(torch::nn::LinearOptions(config.hidden_size, config.vocab_size).bias(false));
-
     register_module("model", model);
+
+    // tied models project through the embedding weight, so there is no lm_head.weight to allocate, load or save
+    if (config.tie_word_embeddings) {
+        this->config.quantize_lm_head = false;
+        return;
+    }
+
+    lm_head = LlamaLinear(
+        config.hidden_size,
+        config.vocab_size,
+        config.quantize_lm_head ? config.quantization : LlamaQuantization::None,
+        config.quantization_group_size,
+        config.dtype,
+        config.init_weights);
+
     register_module("lm_head", lm_head);
     lm_head->to(config.dtype);
 }
@@ -26,7 +45,9 @@ LlamaCausalLMImpl::forward(
     const std::vector<std::tuple<torch::Tensor, torch::Tensor>>& past_key_values,
     bool output_attentions,
     bool output_hidden_states,
-    bool use_cache)
+    bool use_cache,
+    LlamaCache* cache,
+    int64_t num_logits_to_keep)
 {
     auto outputs = model->forward(
         input_ids,
@@ -36,11 +57,20 @@ LlamaCausalLMImpl::forward(
         past_key_values,
         output_attentions,
         output_hidden_states,
-        use_cache);
+        use_cache,
+        cache);
 
     auto hidden_states = std::get<0>(outputs);
 
-    auto lm_logits = lm_head->forward(hidden_states);
+    // skip the vocab sized projection and float32 copy of positions nobody samples from
+    const int64_t seq_length = hidden_states.size(1);
+    if (num_logits_to_keep > 0 && num_logits_to_keep < seq_length && !labels.has_value()) {
+        hidden_states = hidden_states.narrow(1, seq_length - num_logits_to_keep, num_logits_to_keep);
+    }
+
+    auto lm_logits = lm_head
+        ? lm_head->forward(hidden_states)
+        : torch::nn::functional::linear(hidden_states, model->get_input_embeddings());
 
     // make float32
     lm_logits = lm_logits.to(torch::kFloat32);
@@ -65,10 +95,15 @@ LlamaCausalLMImpl::forward(
 
 torch::Tensor LlamaCausalLMImpl::generate(
     torch::Tensor& input_ids,
-    const int32_t num_new_tokens
+    const int32_t num_new_tokens,
+    LlamaCache* cache,
+    const LlamaSamplingOptions& sampling,
+    const std::function<bool(const torch::Tensor&)>& streamer,
+    LlamaPrefixCache* prefix_cache,
+    const std::vector<int64_t>& past_tokens
 )
 {
-    // generate up to num_new_tokens or max_position_embeddings
+    // generate up to num_new_tokens or until the cache is full
 
     // get shape of input_ids
     auto input_shape = input_ids.sizes();
@@ -77,45 +112,137 @@ torch::Tensor LlamaCausalLMImpl::generate(
     int64_t batch_size = input_shape[0];
     int64_t seq_length = input_shape[1];
 
-    // get max_position_embeddings
-    int64_t max_position_embeddings = config.max_position_embeddings;
+    if (!past_tokens.empty() && batch_size != 1) {
+        throw std::invalid_argument("Past tokens belong to a single [1, seq_len] sequence");
+    }
+
+    // without an external cache, allocate one just big enough for this call
+    std::unique_ptr<LlamaStaticCache> local_cache;
+    if (!cache) {
+        local_cache = std::make_unique<LlamaStaticCache>(
+            config,
+            batch_size,
+            std::min<int64_t>(seq_length + num_new_tokens, config.max_position_embeddings),
+            input_ids.device());
+        cache = local_cache.get();
+    }
+
+    // get the room left in the cache, caches that evict old tokens such as a sink cache never fill up
+    const int64_t max_length = cache->get_max_length();
 
     // calculate num_tokens_to_generate
-    int64_t num_tokens_to_generate = std::min<int64_t>(num_new_tokens, max_position_embeddings - seq_length);
+    int64_t num_tokens_to_generate = num_new_tokens;
+    if (max_length >= 0) {
+        num_tokens_to_generate = std::min<int64_t>(num_new_tokens, max_length - cache->get_seq_length() - seq_length);
+    }
 
     // iterate over num_tokens_to_generate
 
-    // setup container to hold cache
-    std::vector<std::tuple<torch::Tensor, torch::Tensor>> past_key_values;
+    // no autograd bookkeeping while decoding
+    torch::NoGradGuard no_grad;
+
+    // one sampler per row so every sequence keeps its own rng stream
+    std::vector<LlamaSampler> samplers;
+    samplers.reserve(batch_size);
+    for (int64_t b = 0; b < batch_size; b++) {
+        LlamaSamplingOptions row_sampling = sampling;
+        if (sampling.seed.has_value()) {
+            row_sampling.seed = sampling.seed.value() + static_cast<uint64_t>(b);
+        }
+        samplers.emplace_back(row_sampling, config.eos_token_id);
+    }
+
+    // every token of each row so far, for the penalties
+    std::vector<std::vector<int64_t>> histories(batch_size);
+    auto cpu_ids = input_ids.to(torch::kCPU).contiguous();
+    for (int64_t b = 0; b < batch_size; b++) {
+        const int64_t* row = cpu_ids.data_ptr<int64_t>() + b * seq_length;
+        if (b == 0) {
+            histories[b] = past_tokens;
+        }
+        histories[b].insert(histories[b].end(), row, row + seq_length);
+    }
+    const int64_t num_past = static_cast<int64_t>(past_tokens.size());
+
+    const int64_t pad_token_id = config.pad_token_id.value_or(config.eos_token_id);
+    std::vector<bool> finished(batch_size, false);
+    int64_t num_finished = 0;
+
+    // the first pass prefills the cache with the whole prompt, every later pass
+    // only feeds the token sampled in the previous step
+    torch::Tensor step_ids = input_ids;
+
+    // a known prefix of the prompt is copied into the cache instead of being recomputed
+    // an evicting cache no longer holds the prompt as it was, so it neither loads nor stores one
+    const bool use_prefix_cache = prefix_cache && batch_size == 1 && cache->get_seq_length() == 0 && max_length >= 0;
+    if (use_prefix_cache && num_tokens_to_generate > 0) {
+        const int64_t num_reused = prefix_cache->load(histories[0].data() + num_past, seq_length, *cache);
+        step_ids = input_ids.narrow(1, num_reused, seq_length - num_reused);
+    }
+
+    // prompts longer than the cache takes in one forward are prefilled in chunks, the last one is sampled from
+    const int64_t max_step_length = cache->get_max_step_length();
+    while (max_step_length > 0 && num_tokens_to_generate > 0 && step_ids.size(1) > max_step_length) {
+        forward(step_ids.narrow(1, 0, max_step_length), {}, {}, {}, {}, {}, false, false, true, cache, 1);
+        step_ids = step_ids.narrow(1, max_step_length, step_ids.size(1) - max_step_length);
+    }
 
     for (int64_t i = 0; i < num_tokens_to_generate; i++) {
         
         auto outputs = forward(
-            input_ids,
+            step_ids,
+            {},
             {},
             {},
             {},
             {},
-            past_key_values,
             false,
             false,
-            true);
+            true,
+            cache,
+            1);
+
+        if (use_prefix_cache && i == 0) {
+            prefix_cache->store(histories[0].data() + num_past, seq_length, *cache);
+        }
+
+        // get the logits for next token by slicing the last token 
+        // [bsz, seq_len, vocab] -> [bsz, vocab]
+        auto next_logits = std::get<0>(outputs).select(1, -1).to(torch::kCPU);
+
+        std::vector<int64_t> next_tokens(batch_size, pad_token_id);
+        for (int64_t b = 0; b < batch_size; b++) {
+            if (finished[b]) {
+                continue;
+            }
+
+            next_tokens[b] = samplers[b].sample(next_logits[b], histories[b]);
+            histories[b].push_back(next_tokens[b]);
+
+            if (samplers[b].is_stop_token(next_tokens[b])) {
+                finished[b] = true;
+                num_finished++;
+            }
+        }
+
+        // [bsz, 1]
+        auto next_token = torch::tensor(next_tokens, torch::TensorOptions().dtype(torch::kInt64))
+            .view({batch_size, 1})
+            .to(input_ids.device());
 
-        past_key_values = std::get<2>(outputs);
+        // append next_token to input_ids
+        input_ids = torch::cat({input_ids, next_token}, 1);
 
-        auto hidden_states = std::get<0>(outputs);
-        
-        
-        
+        if (streamer && !streamer(next_token)) {
+            break;
+        }
 
-        // get the preds for next token by slicing the last token 
-        auto next_token = hidden_states.index({torch::indexing::Slice(), -1, torch::indexing::Slice()}).argmax();
-        
-        next_token = next_token.to(torch::kInt64).unsqueeze(0).unsqueeze(0);
-        
+        if (num_finished == batch_size) {
+            break;
+        }
 
-        // append next_token to input_ids
-        input_ids = torch::cat({input_ids, next_token}, 1);
+        // position ids are derived from the cache length, so only the new token is fed next
+        step_ids = next_token;
 
     }
 
@@ -129,3 +256,266 @@ torch::Tensor LlamaCausalLMImpl::generate(
 
 
 
+
+
+
+torch::Tensor LlamaCausalLMImpl::speculative_generate(
+    torch::Tensor& input_ids,
+    LlamaCausalLMImpl& draft,
+    const int32_t num_new_tokens,
+    const int64_t num_draft_tokens,
+    LlamaCache* cache,
+    LlamaCache* draft_cache,
+    const LlamaSamplingOptions& sampling,
+    const std::function<bool(const torch::Tensor&)>& streamer
+)
+{
+    if (input_ids.dim() != 2 || input_ids.size(0) != 1) {
+        throw std::invalid_argument("Speculative decoding takes a single [1, seq_len] sequence");
+    }
+
+    if (draft.config.vocab_size != config.vocab_size) {
+        std::stringstream ss;
+        ss << "Draft vocabulary of size " << draft.config.vocab_size
+            << " does not match the target vocabulary of size " << config.vocab_size;
+        throw std::invalid_argument(ss.str());
+    }
+
+    if (num_draft_tokens < 1) {
+        throw std::invalid_argument("num_draft_tokens must be at least 1");
+    }
+
+    // rejected proposals are cropped off by position, which an evicting cache no longer keeps track of
+    if ((cache && cache->get_max_length() < 0) || (draft_cache && draft_cache->get_max_length() < 0)) {
+        throw std::invalid_argument("Speculative decoding needs caches that keep every token");
+    }
+
+    const int64_t seq_length = input_ids.size(1);
+    const auto device = input_ids.device();
+    const auto draft_device = draft.parameters().front().device();
+
+    // without external caches, allocate ones just big enough for this call
+    // verification feeds up to num_draft_tokens tokens past the last accepted one
+    std::unique_ptr<LlamaStaticCache> local_cache;
+    if (!cache) {
+        local_cache = std::make_unique<LlamaStaticCache>(
+            config,
+            1,
+            std::min<int64_t>(seq_length + num_new_tokens + num_draft_tokens, config.max_position_embeddings),
+            device);
+        cache = local_cache.get();
+    }
+
+    std::unique_ptr<LlamaStaticCache> local_draft_cache;
+    if (!draft_cache) {
+        local_draft_cache = std::make_unique<LlamaStaticCache>(
+            draft.config,
+            1,
+            std::min<int64_t>(seq_length + num_new_tokens + num_draft_tokens, draft.config.max_position_embeddings),
+            draft_device);
+        draft_cache = local_draft_cache.get();
+    }
+
+    const int64_t prefix_length = cache->get_seq_length();
+    if (draft_cache->get_seq_length() != prefix_length) {
+        std::stringstream ss;
+        ss << "Draft cache holds " << draft_cache->get_seq_length()
+            << " tokens but the target cache holds " << prefix_length;
+        throw std::invalid_argument(ss.str());
+    }
+
+    // get the room left in the tighter of both caches
+    int64_t max_length = cache->get_max_length() < 0 ? config.max_position_embeddings : cache->get_max_length();
+    int64_t draft_max_length = draft_cache->get_max_length() < 0 ? draft.config.max_position_embeddings : draft_cache->get_max_length();
+    max_length = std::min(max_length, draft_max_length);
+
+    const int64_t num_tokens_to_generate = std::min<int64_t>(num_new_tokens, max_length - prefix_length - seq_length);
+
+    // no autograd bookkeeping while decoding
+    torch::NoGradGuard no_grad;
+
+    LlamaSampler sampler(sampling, config.eos_token_id);
+    LlamaSamplingOptions draft_sampling = sampling;
+    if (sampling.seed.has_value()) {
+        draft_sampling.seed = sampling.seed.value() + 1;
+    }
+    LlamaSampler draft_sampler(draft_sampling, config.eos_token_id);
+
+    // prompt followed by every accepted token
+    auto cpu_ids = input_ids.to(torch::kCPU).contiguous();
+    std::vector<int64_t> tokens(cpu_ids.data_ptr<int64_t>(), cpu_ids.data_ptr<int64_t>() + seq_length);
+
+    // leading tokens of `tokens` already stored in each cache
+    int64_t num_cached = 0;
+    int64_t num_draft_cached = 0;
+
+    auto options = torch::TensorOptions().dtype(torch::kInt64);
+    // logits of the last num_logits positions of ids
+    auto run = [](LlamaCausalLMImpl& lm, const torch::Tensor& ids, LlamaCache* lm_cache, int64_t num_logits) {
+        return std::get<0>(lm.forward(ids, {}, {}, {}, {}, {}, false, false, true, lm_cache, num_logits));
+    };
+
+    int64_t num_generated = 0;
+    bool finished = false;
+
+    while (!finished && num_generated < num_tokens_to_generate) {
+        // never propose more than what is left, the checking forward adds one token of its own
+        const int64_t num_proposed = std::min<int64_t>(num_draft_tokens, num_tokens_to_generate - num_generated - 1);
+
+        // the draft first catches up on the tokens it has not seen, then proposes one token per forward
+        std::vector<int64_t> proposed;
+        std::vector<std::vector<float>> draft_probs;
+        std::vector<int64_t> draft_history = tokens;
+        for (int64_t j = 0; j < num_proposed; j++) {
+            std::vector<int64_t> feed;
+            if (j == 0) {
+                feed.assign(tokens.begin() + num_draft_cached, tokens.end());
+            } else {
+                feed.push_back(proposed.back());
+            }
+
+            auto ids = torch::tensor(feed, options).unsqueeze(0).to(draft_device);
+            auto draft_logits = run(draft, ids, draft_cache, 1).index({0, -1});
+
+            draft_probs.push_back(draft_sampler.distribution(draft_logits, draft_history.data(), static_cast<int64_t>(draft_history.size())));
+            proposed.push_back(draft_sampler.draw(draft_probs.back()));
+            draft_history.push_back(proposed.back());
+        }
+        if (num_proposed > 0) {
+            num_draft_cached = static_cast<int64_t>(tokens.size()) + num_proposed - 1;
+        }
+
+        // one forward of this model scores every proposal plus the token after them
+        std::vector<int64_t> feed(tokens.begin() + num_cached, tokens.end());
+        feed.insert(feed.end(), proposed.begin(), proposed.end());
+
+        auto ids = torch::tensor(feed, options).unsqueeze(0).to(device);
+        // [num_proposed + 1, vocab]
+        auto target_logits = run(*this, ids, cache, num_proposed + 1)[0].to(torch::kCPU);
+
+        const int64_t num_before = static_cast<int64_t>(tokens.size());
+        int64_t num_accepted = 0;
+        bool rejected = false;
+
+        // accept proposal x with probability min(1, p(x) / q(x)), otherwise resample from max(0, p - q)
+        // greedy decoding makes both one-hot, so this reduces to comparing argmaxes
+        for (int64_t j = 0; j < num_proposed && !finished; j++) {
+            auto probs = sampler.distribution(target_logits[j], tokens.data(), static_cast<int64_t>(tokens.size()));
+            const auto& draft_row = draft_probs[j];
+            const int64_t token = proposed[j];
+
+            if (sampler.uniform() * draft_row[token] < probs[token]) {
+                tokens.push_back(token);
+                num_accepted++;
+                finished = sampler.is_stop_token(token);
+                continue;
+            }
+
+            std::vector<float> residual(probs.size());
+            double residual_mass = 0.0;
+            for (size_t v = 0; v < probs.size(); v++) {
+                residual[v] = std::max(0.0f, probs[v] - draft_row[v]);
+                residual_mass += residual[v];
+            }
+            tokens.push_back(sampler.draw(residual_mass > 0.0 ? residual : probs));
+            rejected = true;
+            break;
+        }
+
+        // every proposal held, the last position gives one more token for free
+        if (!rejected && !finished) {
+            auto probs = sampler.distribution(target_logits[num_proposed], tokens.data(), static_cast<int64_t>(tokens.size()));
+            tokens.push_back(sampler.draw(probs));
+        }
+
+        // keep every accepted token cached and drop the rejected ones, the last token stays uncached
+        num_cached = num_before + num_accepted;
+        cache->crop(prefix_length + num_cached);
+        num_draft_cached = std::min(num_draft_cached, num_cached);
+        draft_cache->crop(prefix_length + num_draft_cached);
+
+        for (int64_t i = num_before; i < static_cast<int64_t>(tokens.size()); i++) {
+            num_generated++;
+
+            if (streamer && !streamer(torch::full({1, 1}, tokens[i], options.device(device)))) {
+                finished = true;
+            }
+            if (sampler.is_stop_token(tokens[i])) {
+                finished = true;
+            }
+            if (finished || num_generated >= num_tokens_to_generate) {
+                tokens.resize(i + 1);
+                break;
+            }
+        }
+    }
+
+    // tokens cut by a stop token, the streamer or the budget leave the caches too, the last token stays uncached
+    const int64_t num_kept = static_cast<int64_t>(tokens.size()) - 1;
+    if (num_cached > num_kept) {
+        cache->crop(prefix_length + num_kept);
+    }
+    if (num_draft_cached > num_kept) {
+        draft_cache->crop(prefix_length + num_kept);
+    }
+
+    input_ids = torch::tensor(tokens, options).unsqueeze(0).to(device);
+    return input_ids;
+}
+
+
+void LlamaCausalLMImpl::quantize(LlamaQuantization format, int64_t group_size, bool include_lm_head)
+{
+    if (format == config.quantization) {
+        return;
+    }
+
+    // the fused modules are not registered, so they would keep the concatenated plain weights alive
+    // once the parts let go of them, they are rebuilt from the quantized parts instead
+    const bool fused = unfuse_projections();
+
+    for (const auto& module : model->modules(false)) {
+        if (auto linear = std::dynamic_pointer_cast<LlamaLinearImpl>(module)) {
+            linear->quantize(format, group_size);
+        }
+    }
+    // a tied lm_head is the embedding weight, which stays plain
+    include_lm_head = include_lm_head && lm_head;
+    if (include_lm_head) {
+        lm_head->quantize(format, group_size);
+    }
+
+    config.quantization = format;
+    config.quantization_group_size = static_cast<int>(group_size);
+    config.quantize_lm_head = include_lm_head;
+
+    if (fused) {
+        fuse_projections();
+    }
+}
+
+
+void LlamaCausalLMImpl::fuse_projections()
+{
+    for (const auto& module : model->modules(false)) {
+        if (auto attention = std::dynamic_pointer_cast<LlamaAttentionImpl>(module)) {
+            attention->fuse_projections();
+        } else if (auto mlp = std::dynamic_pointer_cast<LlamaMLPImpl>(module)) {
+            mlp->fuse_projections();
+        }
+    }
+}
+
+
+bool LlamaCausalLMImpl::unfuse_projections()
+{
+    bool fused = false;
+    for (const auto& module : model->modules(false)) {
+        if (auto attention = std::dynamic_pointer_cast<LlamaAttentionImpl>(module)) {
+            fused = attention->unfuse_projections() || fused;
+        } else if (auto mlp = std::dynamic_pointer_cast<LlamaMLPImpl>(module)) {
+            fused = mlp->unfuse_projections() || fused;
+        }
+    }
+    return fused;
+}
\ No newline at end of file
@@ -3,10 +3,10 @@
 #include "Models/Llama/llama_decoder_lay.h"
 
 
-LlamaDecoderLayerImpl::LlamaDecoderLayerImpl(const LlamaConfig& config) 
+LlamaDecoderLayerImpl::LlamaDecoderLayerImpl(const LlamaConfig& config, int64_t layer_idx) 
     : config(config),
     hidden_size(config.hidden_size),
-    self_attn(std::make_shared<LlamaAttentionImpl>(config)),
+    self_attn(std::make_shared<LlamaAttentionImpl>(config, layer_idx)),
     mlp(std::make_shared<LlamaMLPImpl>(config)),
     input_layernorm(std::make_shared<LlamaRMSNormImpl>(config.hidden_size, config.rms_norm_eps)),
     post_attention_layernorm(std::make_shared<LlamaRMSNormImpl>(config.hidden_size, config.rms_norm_eps))
@@ -24,7 +24,8 @@ std::tuple<torch::Tensor, c10::optional<torch::Tensor>, c10::optional<std::tuple
     const c10::optional<torch::Tensor>& position_ids,
     c10::optional<std::tuple<torch::Tensor, torch::Tensor>>& past_key_value,
     bool output_attentions,
-    bool use_cache)
+    bool use_cache,
+    LlamaCache* cache)
 {
     auto residual = hidden_states;
 
@@ -40,15 +41,14 @@ std::tuple<torch::Tensor, c10::optional<torch::Tensor>, c10::optional<std::tuple
         position_ids,
         past_key_value,
         output_attentions,
-        use_cache);
-
-    hidden_states = residual + hidden_states;
+        use_cache,
+        cache);
 
     // fully connected
-
+    // the attention output is fresh, so the residual sum is written into it
+    auto normed = post_attention_layernorm->forward_residual(hidden_states, residual);
     residual = hidden_states;
-    hidden_states = post_attention_layernorm->forward(hidden_states);
-    hidden_states = mlp->forward(hidden_states);
+    hidden_states = mlp->forward(normed);
     hidden_states = residual + hidden_states;
 
     return std::make_tuple(hidden_states, self_attn_outputs, present_key_value);
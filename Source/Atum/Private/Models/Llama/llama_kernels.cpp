@@ -0,0 +1,1423 @@
+#include "Models/Llama/llama_kernels.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define LLAMA_KERNELS_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+// gcc and clang only emit simd instructions inside functions that ask for them
+#if defined(LLAMA_KERNELS_X86) && (defined(__GNUC__) || defined(__clang__))
+#define LLAMA_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define LLAMA_TARGET_AVX512 __attribute__((target("avx512f")))
+#else
+#define LLAMA_TARGET_AVX2
+#define LLAMA_TARGET_AVX512
+#endif
+
+
+namespace {
+
+// above this many rows the product is compute bound and the blas matmul on a dequantized copy wins
+constexpr int64_t kMaxDirectRows = 8;
+
+// output channels dequantized at once for that matmul, so no full precision copy of the whole weight exists
+constexpr int64_t kDequantizeTile = 512;
+
+
+enum class SimdLevel {
+    Scalar,
+    Avx2,
+    Avx512
+};
+
+
+#if defined(LLAMA_KERNELS_X86)
+void cpuid(int leaf, int subleaf, int registers[4])
+{
+#if defined(_MSC_VER)
+    __cpuidex(registers, leaf, subleaf);
+#else
+    unsigned int a, b, c, d;
+    __cpuid_count(leaf, subleaf, a, b, c, d);
+    registers[0] = static_cast<int>(a);
+    registers[1] = static_cast<int>(b);
+    registers[2] = static_cast<int>(c);
+    registers[3] = static_cast<int>(d);
+#endif
+}
+
+
+uint64_t xgetbv0()
+{
+#if defined(_MSC_VER)
+    return _xgetbv(0);
+#else
+    uint32_t eax, edx;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return (static_cast<uint64_t>(edx) << 32) | eax;
+#endif
+}
+#endif
+
+
+SimdLevel detect_simd_level()
+{
+#if defined(LLAMA_KERNELS_X86)
+    int registers[4];
+    cpuid(1, 0, registers);
+    const bool osxsave = (registers[2] & (1 << 27)) != 0;
+    const bool avx = (registers[2] & (1 << 28)) != 0;
+    const bool fma = (registers[2] & (1 << 12)) != 0;
+    if (!osxsave || !avx) {
+        return SimdLevel::Scalar;
+    }
+
+    // the os has to save the wider registers on context switches
+    const uint64_t xcr0 = xgetbv0();
+    if ((xcr0 & 0x6) != 0x6) {
+        return SimdLevel::Scalar;
+    }
+
+    cpuid(7, 0, registers);
+    const bool avx2 = (registers[1] & (1 << 5)) != 0;
+    const bool avx512f = (registers[1] & (1 << 16)) != 0;
+
+    if (avx512f && (xcr0 & 0xE0) == 0xE0) {
+        return SimdLevel::Avx512;
+    }
+    if (avx2 && fma) {
+        return SimdLevel::Avx2;
+    }
+#endif
+    return SimdLevel::Scalar;
+}
+
+
+SimdLevel simd_level()
+{
+    static const SimdLevel level = detect_simd_level();
+    return level;
+}
+
+
+inline float dot_int8(const float* x, const int8_t* w, int64_t n)
+{
+    // independent accumulators let the compiler vectorise the loop
+    float acc0 = 0.0f, acc1 = 0.0f, acc2 = 0.0f, acc3 = 0.0f;
+    int64_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        acc0 += x[i] * static_cast<float>(w[i]);
+        acc1 += x[i + 1] * static_cast<float>(w[i + 1]);
+        acc2 += x[i + 2] * static_cast<float>(w[i + 2]);
+        acc3 += x[i + 3] * static_cast<float>(w[i + 3]);
+    }
+    for (; i < n; ++i) {
+        acc0 += x[i] * static_cast<float>(w[i]);
+    }
+    return (acc0 + acc1) + (acc2 + acc3);
+}
+
+
+// x: float32 [in_features], q: two 4-bit values per byte, low nibble first
+// sums scale * (x . q - zero * sum(x)) over the groups, xsum holds sum(x) per group
+float dot_int4(
+    const float* x,
+    const float* xsum,
+    const uint8_t* q,
+    const at::Half* scales,
+    const at::Half* zeros,
+    int64_t in_features,
+    int64_t group_size)
+{
+    float total = 0.0f;
+    for (int64_t g = 0; g < in_features / group_size; ++g) {
+        const float* xg = x + g * group_size;
+        const uint8_t* qg = q + g * group_size / 2;
+
+        float acc = 0.0f;
+        for (int64_t i = 0; i < group_size / 2; ++i) {
+            acc += xg[2 * i] * static_cast<float>(qg[i] & 0x0F) + xg[2 * i + 1] * static_cast<float>(qg[i] >> 4);
+        }
+        total += static_cast<float>(scales[g]) * (acc - static_cast<float>(zeros[g]) * xsum[g]);
+    }
+    return total;
+}
+
+
+#if defined(LLAMA_KERNELS_X86)
+LLAMA_TARGET_AVX2
+inline float hsum_avx2(__m256 v)
+{
+    __m128 sum = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    __m128 shuffled = _mm_movehdup_ps(sum);
+    sum = _mm_add_ps(sum, shuffled);
+    shuffled = _mm_movehl_ps(shuffled, sum);
+    return _mm_cvtss_f32(_mm_add_ss(sum, shuffled));
+}
+
+
+LLAMA_TARGET_AVX2
+float dot_int8_avx2(const float* x, const int8_t* w, int64_t n)
+{
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    int64_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(w + i));
+        const __m256 w0 = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(bytes));
+        const __m256 w1 = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_srli_si128(bytes, 8)));
+        acc0 = _mm256_fmadd_ps(w0, _mm256_loadu_ps(x + i), acc0);
+        acc1 = _mm256_fmadd_ps(w1, _mm256_loadu_ps(x + i + 8), acc1);
+    }
+
+    float total = hsum_avx2(_mm256_add_ps(acc0, acc1));
+    for (; i < n; ++i) {
+        total += x[i] * static_cast<float>(w[i]);
+    }
+    return total;
+}
+
+
+// 32 packed values -> two registers of 16 bytes each holding one value per byte, in order
+LLAMA_TARGET_AVX2
+inline void unpack_int4(const uint8_t* q, __m128i& first, __m128i& second)
+{
+    const __m128i mask = _mm_set1_epi8(0x0F);
+    const __m128i packed = _mm_loadu_si128(reinterpret_cast<const __m128i*>(q));
+    const __m128i low = _mm_and_si128(packed, mask);
+    const __m128i high = _mm_and_si128(_mm_srli_epi16(packed, 4), mask);
+    first = _mm_unpacklo_epi8(low, high);
+    second = _mm_unpackhi_epi8(low, high);
+}
+
+
+LLAMA_TARGET_AVX2
+float dot_int4_avx2(
+    const float* x,
+    const float* xsum,
+    const uint8_t* q,
+    const at::Half* scales,
+    const at::Half* zeros,
+    int64_t in_features,
+    int64_t group_size)
+{
+    float total = 0.0f;
+    for (int64_t g = 0; g < in_features / group_size; ++g) {
+        const float* xg = x + g * group_size;
+        const uint8_t* qg = q + g * group_size / 2;
+
+        __m256 acc = _mm256_setzero_ps();
+        for (int64_t i = 0; i < group_size; i += 32) {
+            __m128i first, second;
+            unpack_int4(qg + i / 2, first, second);
+
+            acc = _mm256_fmadd_ps(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(first)), _mm256_loadu_ps(xg + i), acc);
+            acc = _mm256_fmadd_ps(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_srli_si128(first, 8))), _mm256_loadu_ps(xg + i + 8), acc);
+            acc = _mm256_fmadd_ps(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(second)), _mm256_loadu_ps(xg + i + 16), acc);
+            acc = _mm256_fmadd_ps(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_srli_si128(second, 8))), _mm256_loadu_ps(xg + i + 24), acc);
+        }
+        total += static_cast<float>(scales[g]) * (hsum_avx2(acc) - static_cast<float>(zeros[g]) * xsum[g]);
+    }
+    return total;
+}
+
+
+LLAMA_TARGET_AVX512
+float dot_int4_avx512(
+    const float* x,
+    const float* xsum,
+    const uint8_t* q,
+    const at::Half* scales,
+    const at::Half* zeros,
+    int64_t in_features,
+    int64_t group_size)
+{
+    const __m128i mask = _mm_set1_epi8(0x0F);
+
+    float total = 0.0f;
+    for (int64_t g = 0; g < in_features / group_size; ++g) {
+        const float* xg = x + g * group_size;
+        const uint8_t* qg = q + g * group_size / 2;
+
+        __m512 acc = _mm512_setzero_ps();
+        for (int64_t i = 0; i < group_size; i += 32) {
+            const __m128i packed = _mm_loadu_si128(reinterpret_cast<const __m128i*>(qg + i / 2));
+            const __m128i low = _mm_and_si128(packed, mask);
+            const __m128i high = _mm_and_si128(_mm_srli_epi16(packed, 4), mask);
+
+            acc = _mm512_fmadd_ps(_mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(_mm_unpacklo_epi8(low, high))), _mm512_loadu_ps(xg + i), acc);
+            acc = _mm512_fmadd_ps(_mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(_mm_unpackhi_epi8(low, high))), _mm512_loadu_ps(xg + i + 16), acc);
+        }
+        total += static_cast<float>(scales[g]) * (_mm512_reduce_add_ps(acc) - static_cast<float>(zeros[g]) * xsum[g]);
+    }
+    return total;
+}
+#endif
+
+
+// gate[i] = silu(gate[i]) * up[i] in float32
+// the silu is rounded to T before the product, as silu_ followed by mul_ does
+template <typename T>
+void silu_mul_row(T* gate, const T* up, int64_t n)
+{
+    for (int64_t i = 0; i < n; ++i) {
+        const float g = static_cast<float>(gate[i]);
+        const T silu = static_cast<T>(g / (1.0f + std::exp(-g)));
+        gate[i] = static_cast<T>(static_cast<float>(silu) * static_cast<float>(up[i]));
+    }
+}
+
+
+#if defined(LLAMA_KERNELS_X86)
+// cephes style exp, range reduction to [-ln2 / 2, ln2 / 2] and a degree 5 polynomial
+LLAMA_TARGET_AVX2
+inline __m256 exp_avx2(__m256 x)
+{
+    x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(-88.3762626647949f)), _mm256_set1_ps(88.3762626647949f));
+
+    const __m256 n = _mm256_floor_ps(_mm256_fmadd_ps(x, _mm256_set1_ps(1.44269504088896341f), _mm256_set1_ps(0.5f)));
+    x = _mm256_fnmadd_ps(n, _mm256_set1_ps(0.693359375f), x);
+    x = _mm256_fnmadd_ps(n, _mm256_set1_ps(-2.12194440e-4f), x);
+
+    __m256 y = _mm256_set1_ps(1.9875691500e-4f);
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(1.3981999507e-3f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(8.3334519073e-3f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(4.1665795894e-2f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(1.6666665459e-1f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(5.0000001201e-1f));
+    y = _mm256_fmadd_ps(y, _mm256_mul_ps(x, x), _mm256_add_ps(x, _mm256_set1_ps(1.0f)));
+
+    // 2^n built straight in the exponent bits
+    const __m256i exponent = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+    return _mm256_mul_ps(y, _mm256_castsi256_ps(exponent));
+}
+
+#endif
+
+
+// rms norm of one row in the order of the torch reference
+// the normalised value is rounded to T before the weight is applied, as x.to(input_dtype) * weight does
+template <typename T>
+void rms_norm_row(const T* x, const T* weight, T* out, int64_t n, float eps)
+{
+    float acc0 = 0.0f, acc1 = 0.0f, acc2 = 0.0f, acc3 = 0.0f;
+    int64_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        const float x0 = static_cast<float>(x[i]);
+        const float x1 = static_cast<float>(x[i + 1]);
+        const float x2 = static_cast<float>(x[i + 2]);
+        const float x3 = static_cast<float>(x[i + 3]);
+        acc0 += x0 * x0;
+        acc1 += x1 * x1;
+        acc2 += x2 * x2;
+        acc3 += x3 * x3;
+    }
+    for (; i < n; ++i) {
+        const float value = static_cast<float>(x[i]);
+        acc0 += value * value;
+    }
+
+    const float inv_rms = 1.0f / std::sqrt((acc0 + acc1 + acc2 + acc3) / static_cast<float>(n) + eps);
+    for (i = 0; i < n; ++i) {
+        const T normalised = static_cast<T>(static_cast<float>(x[i]) * inv_rms);
+        out[i] = static_cast<T>(static_cast<float>(normalised) * static_cast<float>(weight[i]));
+    }
+}
+
+
+// x += residual, then the rms norm of the sum into out
+template <typename T>
+void add_rms_norm_row(T* x, const T* residual, const T* weight, T* out, int64_t n, float eps)
+{
+    for (int64_t i = 0; i < n; ++i) {
+        x[i] = static_cast<T>(static_cast<float>(x[i]) + static_cast<float>(residual[i]));
+    }
+    rms_norm_row(x, weight, out, n, eps);
+}
+
+
+#if defined(LLAMA_KERNELS_X86)
+LLAMA_TARGET_AVX2
+inline __m256 load8(const float* p)
+{
+    return _mm256_loadu_ps(p);
+}
+
+
+LLAMA_TARGET_AVX2
+inline __m256 load8(const c10::BFloat16* p)
+{
+    // bfloat16 is the upper half of a float32
+    const __m128i bits = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(bits), 16));
+}
+
+
+// round to nearest even on the upper 16 bits, leaves the result in them
+LLAMA_TARGET_AVX2
+inline __m256i round_bf16_bits(__m256 v)
+{
+    const __m256i bits = _mm256_castps_si256(v);
+    const __m256i lsb = _mm256_and_si256(_mm256_srli_epi32(bits, 16), _mm256_set1_epi32(1));
+    return _mm256_srli_epi32(_mm256_add_epi32(bits, _mm256_add_epi32(lsb, _mm256_set1_epi32(0x7FFF))), 16);
+}
+
+
+LLAMA_TARGET_AVX2
+inline void store8(float* p, __m256 v)
+{
+    _mm256_storeu_ps(p, v);
+}
+
+
+LLAMA_TARGET_AVX2
+inline void store8(c10::BFloat16* p, __m256 v)
+{
+    const __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(round_bf16_bits(v), round_bf16_bits(v)), 0x08);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(p), _mm256_castsi256_si128(packed));
+}
+
+
+// the value the store of v into T would read back as
+LLAMA_TARGET_AVX2
+inline __m256 round8(const float*, __m256 v)
+{
+    return v;
+}
+
+
+LLAMA_TARGET_AVX2
+inline __m256 round8(const c10::BFloat16*, __m256 v)
+{
+    return _mm256_castsi256_ps(_mm256_slli_epi32(round_bf16_bits(v), 16));
+}
+
+
+template <typename T>
+LLAMA_TARGET_AVX2
+void silu_mul_row_avx2(T* gate, const T* up, int64_t n)
+{
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    int64_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const __m256 g = load8(gate + i);
+        const __m256 denominator = _mm256_add_ps(one, exp_avx2(_mm256_xor_ps(g, sign)));
+        const __m256 silu = round8(up, _mm256_div_ps(g, denominator));
+        store8(gate + i, _mm256_mul_ps(silu, load8(up + i)));
+    }
+    silu_mul_row(gate + i, up + i, n - i);
+}
+
+
+template <typename T>
+LLAMA_TARGET_AVX2
+void rms_norm_row_avx2(const T* x, const T* weight, T* out, int64_t n, float eps)
+{
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    int64_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const __m256 x0 = load8(x + i);
+        const __m256 x1 = load8(x + i + 8);
+        acc0 = _mm256_fmadd_ps(x0, x0, acc0);
+        acc1 = _mm256_fmadd_ps(x1, x1, acc1);
+    }
+
+    float total = hsum_avx2(_mm256_add_ps(acc0, acc1));
+    for (; i < n; ++i) {
+        const float value = static_cast<float>(x[i]);
+        total += value * value;
+    }
+
+    const float inv_rms = 1.0f / std::sqrt(total / static_cast<float>(n) + eps);
+    const __m256 scale = _mm256_set1_ps(inv_rms);
+    for (i = 0; i + 8 <= n; i += 8) {
+        const __m256 normalised = round8(x, _mm256_mul_ps(load8(x + i), scale));
+        store8(out + i, _mm256_mul_ps(normalised, load8(weight + i)));
+    }
+    for (; i < n; ++i) {
+        const T normalised = static_cast<T>(static_cast<float>(x[i]) * inv_rms);
+        out[i] = static_cast<T>(static_cast<float>(normalised) * static_cast<float>(weight[i]));
+    }
+}
+
+
+template <typename T>
+LLAMA_TARGET_AVX2
+void add_rms_norm_row_avx2(T* x, const T* residual, const T* weight, T* out, int64_t n, float eps)
+{
+    int64_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        store8(x + i, _mm256_add_ps(load8(x + i), load8(residual + i)));
+    }
+    for (; i < n; ++i) {
+        x[i] = static_cast<T>(static_cast<float>(x[i]) + static_cast<float>(residual[i]));
+    }
+    rms_norm_row_avx2(x, weight, out, n, eps);
+}
+#endif
+
+
+// rotates the two halves of one head, cos and sin are the first half of a table row
+// x1' = x1 * cos - x2 * sin, x2' = x2 * cos + x1 * sin, as q * cos + rotate_half(q) * sin
+template <typename T>
+void rotary_row(T* x, const T* cos, const T* sin, int64_t half)
+{
+    T* second = x + half;
+    for (int64_t i = 0; i < half; ++i) {
+        const float x1 = static_cast<float>(x[i]);
+        const float x2 = static_cast<float>(second[i]);
+        const float c = static_cast<float>(cos[i]);
+        const float s = static_cast<float>(sin[i]);
+        x[i] = static_cast<T>(x1 * c - x2 * s);
+        second[i] = static_cast<T>(x2 * c + x1 * s);
+    }
+}
+
+
+#if defined(LLAMA_KERNELS_X86)
+template <typename T>
+LLAMA_TARGET_AVX2
+void rotary_row_avx2(T* x, const T* cos, const T* sin, int64_t half)
+{
+    T* second = x + half;
+    int64_t i = 0;
+    for (; i + 8 <= half; i += 8) {
+        const __m256 x1 = load8(x + i);
+        const __m256 x2 = load8(second + i);
+        const __m256 c = load8(cos + i);
+        const __m256 s = load8(sin + i);
+        store8(x + i, _mm256_fmsub_ps(x1, c, _mm256_mul_ps(x2, s)));
+        store8(second + i, _mm256_fmadd_ps(x2, c, _mm256_mul_ps(x1, s)));
+    }
+    rotary_row(x + i, cos + i, sin + i, half - i);
+}
+#endif
+
+
+// x: [batch, heads, seq_len, head_dim] with a contiguous last dimension, any other strides
+template <typename T>
+void rotary_heads(const torch::Tensor& x, const T* cos, const T* sin, const int64_t* positions, int64_t position_batch_stride)
+{
+    const int64_t batch = x.size(0);
+    const int64_t heads = x.size(1);
+    const int64_t seq_len = x.size(2);
+    const int64_t half = x.size(3) / 2;
+    const int64_t table_stride = x.size(3);
+    const auto strides = x.strides();
+    T* data = x.data_ptr<T>();
+
+    auto row_kernel = rotary_row<T>;
+#if defined(LLAMA_KERNELS_X86)
+    if constexpr (std::is_same_v<T, float> || std::is_same_v<T, c10::BFloat16>) {
+        if (simd_level() != SimdLevel::Scalar) {
+            row_kernel = rotary_row_avx2<T>;
+        }
+    }
+#endif
+
+    at::parallel_for(0, batch * heads * seq_len, 64, [&](int64_t begin, int64_t end) {
+        for (int64_t index = begin; index < end; ++index) {
+            const int64_t b = index / (heads * seq_len);
+            const int64_t h = (index / seq_len) % heads;
+            const int64_t t = index % seq_len;
+            const int64_t position = positions[b * position_batch_stride + t];
+            row_kernel(
+                data + b * strides[0] + h * strides[1] + t * strides[2],
+                cos + position * table_stride,
+                sin + position * table_stride,
+                half);
+        }
+    });
+}
+
+
+// silu(gate) * up over the gate half of every [gate, up] row of width 2 * half
+template <typename T>
+void silu_mul_rows(T* data, int64_t rows, int64_t half)
+{
+    auto row_kernel = silu_mul_row<T>;
+#if defined(LLAMA_KERNELS_X86)
+    if constexpr (std::is_same_v<T, float> || std::is_same_v<T, c10::BFloat16>) {
+        if (simd_level() != SimdLevel::Scalar) {
+            row_kernel = silu_mul_row_avx2<T>;
+        }
+    }
+#endif
+
+    // split columns as well, decoding only has a single row
+    constexpr int64_t kChunk = 1024;
+    const int64_t chunks_per_row = (half + kChunk - 1) / kChunk;
+    at::parallel_for(0, rows * chunks_per_row, 1, [&](int64_t begin, int64_t end) {
+        for (int64_t chunk = begin; chunk < end; ++chunk) {
+            const int64_t row = chunk / chunks_per_row;
+            const int64_t start = (chunk % chunks_per_row) * kChunk;
+            T* row_data = data + row * 2 * half;
+            row_kernel(row_data + start, row_data + half + start, std::min(kChunk, half - start));
+        }
+    });
+}
+
+
+// rows of x normalised into out, residual is added to x first when given
+template <typename T>
+void rms_norm_rows(T* x, const T* residual, const T* weight, T* out, int64_t rows, int64_t n, float eps)
+{
+    auto norm = rms_norm_row<T>;
+    auto add_norm = add_rms_norm_row<T>;
+#if defined(LLAMA_KERNELS_X86)
+    if constexpr (std::is_same_v<T, float> || std::is_same_v<T, c10::BFloat16>) {
+        if (simd_level() != SimdLevel::Scalar) {
+            norm = rms_norm_row_avx2<T>;
+            add_norm = add_rms_norm_row_avx2<T>;
+        }
+    }
+#endif
+
+    at::parallel_for(0, rows, 1, [&](int64_t begin, int64_t end) {
+        for (int64_t row = begin; row < end; ++row) {
+            if (residual) {
+                add_norm(x + row * n, residual + row * n, weight, out + row * n, n, eps);
+            } else {
+                norm(x + row * n, weight, out + row * n, n, eps);
+            }
+        }
+    });
+}
+
+
+bool use_rms_norm_kernel(const torch::Tensor& x, const torch::Tensor& weight)
+{
+    const auto type = x.scalar_type();
+    return x.device().is_cpu() && weight.device().is_cpu() && x.is_contiguous() && weight.is_contiguous()
+        && weight.scalar_type() == type
+        && (type == torch::kFloat32 || type == torch::kBFloat16 || type == torch::kHalf);
+}
+
+
+// the unfused version, for devices and layouts the kernel does not cover
+torch::Tensor rms_norm_reference(const torch::Tensor& x, const torch::Tensor& weight, double eps)
+{
+    auto const input_dtype = x.dtype();
+    auto hidden = x.to(torch::kFloat32);
+    auto const variance = hidden.pow(2).mean(-1, true);
+    hidden = torch::mul(hidden, torch::rsqrt(variance + eps));
+    return torch::mul(hidden.to(input_dtype), weight);
+}
+
+
+// query positions per attention tile, every head of a kv group is taken along
+constexpr int64_t kAttentionQueryBlock = 32;
+
+// keys converted to float32 and kept in cache at once
+constexpr int64_t kAttentionKeyBlock = 64;
+
+
+inline float dot_f32(const float* a, const float* b, int64_t n)
+{
+    float acc0 = 0.0f, acc1 = 0.0f, acc2 = 0.0f, acc3 = 0.0f;
+    int64_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        acc0 += a[i] * b[i];
+        acc1 += a[i + 1] * b[i + 1];
+        acc2 += a[i + 2] * b[i + 2];
+        acc3 += a[i + 3] * b[i + 3];
+    }
+    for (; i < n; ++i) {
+        acc0 += a[i] * b[i];
+    }
+    return (acc0 + acc1) + (acc2 + acc3);
+}
+
+
+// y += alpha * x
+inline void axpy_f32(float alpha, const float* x, float* y, int64_t n)
+{
+    for (int64_t i = 0; i < n; ++i) {
+        y[i] += alpha * x[i];
+    }
+}
+
+
+#if defined(LLAMA_KERNELS_X86)
+LLAMA_TARGET_AVX2
+float dot_f32_avx2(const float* a, const float* b, int64_t n)
+{
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    int64_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+    }
+
+    float total = hsum_avx2(_mm256_add_ps(acc0, acc1));
+    for (; i < n; ++i) {
+        total += a[i] * b[i];
+    }
+    return total;
+}
+
+
+LLAMA_TARGET_AVX2
+void axpy_f32_avx2(float alpha, const float* x, float* y, int64_t n)
+{
+    const __m256 scale = _mm256_set1_ps(alpha);
+    int64_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(y + i, _mm256_fmadd_ps(scale, _mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)));
+    }
+    for (; i < n; ++i) {
+        y[i] += alpha * x[i];
+    }
+}
+#endif
+
+
+// where the key and value rows of tiled_attention_impl are
+// [batch, kv_heads, kv_len, ...] states, or [num_blocks, block_size, kv_heads, ...] pool blocks through a block table
+struct KVLayout {
+    int64_t kv_heads;
+    int64_t kv_len;
+    const int64_t* block_table = nullptr;
+    int64_t table_stride = 0;
+    int64_t block_size = 0;
+
+    // element offset of token j of kv head h in row b, for states or scales with these strides
+    int64_t offset(int64_t b, int64_t h, int64_t j, c10::IntArrayRef strides) const
+    {
+        if (block_table) {
+            return block_table[b * table_stride + j / block_size] * strides[0] + (j % block_size) * strides[1] + h * strides[2];
+        }
+        return b * strides[0] + h * strides[1] + j * strides[2];
+    }
+};
+
+
+// flash attention style, keys and values are visited a block at a time with an online softmax
+// so no [seq_len, kv_seq_len] scores exist, only per row maxima, sums and output accumulators
+// KV is T, or int8_t with float32 scales laid out like the states without head_dim, applied as each block is converted
+// out: [batch, seq_len, heads, head_dim] contiguous
+template <typename T, typename KV>
+void tiled_attention_impl(
+    const torch::Tensor& q,
+    const torch::Tensor& k,
+    const torch::Tensor& v,
+    const torch::Tensor& k_scales,
+    const torch::Tensor& v_scales,
+    const KVLayout& layout,
+    const T* mask_data,
+    c10::IntArrayRef mask_strides,
+    bool causal,
+    float scale,
+    T* out_data)
+{
+    const int64_t batch = q.size(0);
+    const int64_t heads = q.size(1);
+    const int64_t seq_len = q.size(2);
+    const int64_t head_dim = q.size(3);
+    const int64_t kv_heads = layout.kv_heads;
+    const int64_t kv_len = layout.kv_len;
+    const int64_t groups = heads / kv_heads;
+    const int64_t num_query_blocks = (seq_len + kAttentionQueryBlock - 1) / kAttentionQueryBlock;
+
+    // queries sit at the end of the keys, the last query sees every key
+    const int64_t causal_offset = kv_len - seq_len;
+
+    const auto q_strides = q.strides();
+    const auto k_strides = k.strides();
+    const auto v_strides = v.strides();
+    const T* q_base = q.data_ptr<T>();
+    const KV* k_base = k.data_ptr<KV>();
+    const KV* v_base = v.data_ptr<KV>();
+
+    const bool scaled = k_scales.defined();
+    const float* k_scale_base = scaled ? k_scales.data_ptr<float>() : nullptr;
+    const float* v_scale_base = scaled ? v_scales.data_ptr<float>() : nullptr;
+    const auto k_scale_strides = scaled ? k_scales.strides() : c10::IntArrayRef();
+    const auto v_scale_strides = scaled ? v_scales.strides() : c10::IntArrayRef();
+
+    auto dot = dot_f32;
+    auto axpy = axpy_f32;
+#if defined(LLAMA_KERNELS_X86)
+    if (simd_level() != SimdLevel::Scalar) {
+        dot = dot_f32_avx2;
+        axpy = axpy_f32_avx2;
+    }
+#endif
+
+    at::parallel_for(0, batch * kv_heads * num_query_blocks, 1, [&](int64_t begin, int64_t end) {
+        const int64_t max_rows = groups * kAttentionQueryBlock;
+        std::vector<float> queries(max_rows * head_dim);
+        std::vector<float> accumulators(max_rows * head_dim);
+        std::vector<float> row_max(max_rows);
+        std::vector<float> row_sum(max_rows);
+        std::vector<float> keys(kAttentionKeyBlock * head_dim);
+        std::vector<float> values(kAttentionKeyBlock * head_dim);
+        std::vector<float> scores(kAttentionKeyBlock);
+
+        for (int64_t item = begin; item < end; ++item) {
+            const int64_t b = item / (kv_heads * num_query_blocks);
+            const int64_t kv_head = (item / num_query_blocks) % kv_heads;
+            const int64_t t0 = (item % num_query_blocks) * kAttentionQueryBlock;
+            const int64_t tile_len = std::min(kAttentionQueryBlock, seq_len - t0);
+            const int64_t rows = groups * tile_len;
+
+            // row g * tile_len + i is query position t0 + i of head kv_head * groups + g
+            for (int64_t r = 0; r < rows; ++r) {
+                const int64_t head = kv_head * groups + r / tile_len;
+                const T* source = q_base + b * q_strides[0] + head * q_strides[1] + (t0 + r % tile_len) * q_strides[2];
+                float* target = queries.data() + r * head_dim;
+                for (int64_t d = 0; d < head_dim; ++d) {
+                    target[d] = static_cast<float>(source[d]) * scale;
+                }
+            }
+            std::fill(accumulators.begin(), accumulators.begin() + rows * head_dim, 0.0f);
+            std::fill(row_max.begin(), row_max.begin() + rows, -std::numeric_limits<float>::infinity());
+            std::fill(row_sum.begin(), row_sum.begin() + rows, 0.0f);
+
+            // blocks past the last query of the tile are skipped entirely
+            const int64_t key_end = causal ? std::clamp<int64_t>(causal_offset + t0 + tile_len, 0, kv_len) : kv_len;
+
+            for (int64_t j0 = 0; j0 < key_end; j0 += kAttentionKeyBlock) {
+                const int64_t block_len = std::min(kAttentionKeyBlock, key_end - j0);
+
+                for (int64_t j = 0; j < block_len; ++j) {
+                    const KV* key = k_base + layout.offset(b, kv_head, j0 + j, k_strides);
+                    const KV* value = v_base + layout.offset(b, kv_head, j0 + j, v_strides);
+                    float key_scale = 1.0f;
+                    float value_scale = 1.0f;
+                    if (scaled) {
+                        key_scale = k_scale_base[layout.offset(b, kv_head, j0 + j, k_scale_strides)];
+                        value_scale = v_scale_base[layout.offset(b, kv_head, j0 + j, v_scale_strides)];
+                    }
+                    for (int64_t d = 0; d < head_dim; ++d) {
+                        keys[j * head_dim + d] = static_cast<float>(key[d]) * key_scale;
+                        values[j * head_dim + d] = static_cast<float>(value[d]) * value_scale;
+                    }
+                }
+
+                for (int64_t r = 0; r < rows; ++r) {
+                    const int64_t t = t0 + r % tile_len;
+                    const int64_t visible = causal ? std::min(block_len, causal_offset + t + 1 - j0) : block_len;
+                    if (visible <= 0) {
+                        continue;
+                    }
+
+                    const float* query = queries.data() + r * head_dim;
+                    float block_max = -std::numeric_limits<float>::infinity();
+                    for (int64_t j = 0; j < visible; ++j) {
+                        float score = dot(query, keys.data() + j * head_dim, head_dim);
+                        if (mask_data) {
+                            score += static_cast<float>(mask_data[b * mask_strides[0] + t * mask_strides[2] + (j0 + j) * mask_strides[3]]);
+                        }
+                        scores[j] = score;
+                        block_max = std::max(block_max, score);
+                    }
+
+                    // rescale what was accumulated under the previous maximum
+                    float* accumulator = accumulators.data() + r * head_dim;
+                    const float new_max = std::max(row_max[r], block_max);
+                    const float correction = std::exp(row_max[r] - new_max);
+                    if (correction != 1.0f) {
+                        for (int64_t d = 0; d < head_dim; ++d) {
+                            accumulator[d] *= correction;
+                        }
+                        row_sum[r] *= correction;
+                    }
+
+                    for (int64_t j = 0; j < visible; ++j) {
+                        const float p = std::exp(scores[j] - new_max);
+                        row_sum[r] += p;
+                        axpy(p, values.data() + j * head_dim, accumulator, head_dim);
+                    }
+                    row_max[r] = new_max;
+                }
+            }
+
+            for (int64_t r = 0; r < rows; ++r) {
+                const int64_t head = kv_head * groups + r / tile_len;
+                const int64_t t = t0 + r % tile_len;
+                const float inv_sum = row_sum[r] > 0.0f ? 1.0f / row_sum[r] : 0.0f;
+                const float* accumulator = accumulators.data() + r * head_dim;
+                T* target = out_data + ((b * seq_len + t) * heads + head) * head_dim;
+                for (int64_t d = 0; d < head_dim; ++d) {
+                    target[d] = static_cast<T>(accumulator[d] * inv_sum);
+                }
+            }
+        }
+    });
+}
+
+
+// layout of [batch, kv_heads, kv_len, head_dim] states for queries q
+KVLayout dense_layout(const torch::Tensor& q, const torch::Tensor& k)
+{
+    if (k.dim() != 4 || k.size(0) != q.size(0)) {
+        std::stringstream ss;
+        ss << "Tiled attention got queries " << q.sizes() << " and keys " << k.sizes() << ", expected one key batch per query batch";
+        throw std::invalid_argument(ss.str());
+    }
+    return KVLayout{k.size(1), k.size(2)};
+}
+
+
+// dispatch shared by tiled_attention, tiled_attention_int8 and paged_attention, scales are undefined for plain states
+torch::Tensor run_tiled_attention(
+    const torch::Tensor& q,
+    const torch::Tensor& k,
+    const torch::Tensor& v,
+    const torch::Tensor& k_scales,
+    const torch::Tensor& v_scales,
+    const KVLayout& layout,
+    const c10::optional<torch::Tensor>& attention_mask,
+    bool causal,
+    double scale)
+{
+    if (q.dim() != 4 || k.sizes() != v.sizes() || k.size(-1) != q.size(3) || q.size(1) % layout.kv_heads != 0) {
+        std::stringstream ss;
+        ss << "Tiled attention got queries " << q.sizes() << " and keys " << k.sizes()
+           << ", the query heads must be a multiple of the key heads";
+        throw std::invalid_argument(ss.str());
+    }
+
+    // rows are read with the last dimension contiguous, any other layout is made so
+    auto queries = q.stride(-1) == 1 ? q : q.contiguous();
+    auto keys = k.stride(-1) == 1 ? k : k.contiguous();
+    auto values = v.stride(-1) == 1 ? v : v.contiguous();
+
+    const auto type = q.scalar_type();
+    torch::Tensor mask;
+    if (attention_mask.has_value()) {
+        mask = attention_mask->scalar_type() == type ? *attention_mask : attention_mask->to(type);
+        mask = mask.expand({q.size(0), 1, q.size(2), layout.kv_len});
+    }
+
+    const int64_t batch = q.size(0);
+    const int64_t heads = q.size(1);
+    const int64_t seq_len = q.size(2);
+    auto output = torch::empty({batch, seq_len, heads, q.size(3)}, q.options());
+
+    AT_DISPATCH_FLOATING_TYPES_AND2(at::kBFloat16, at::kHalf, type, "tiled_attention", [&] {
+        const scalar_t* mask_data = mask.defined() ? mask.data_ptr<scalar_t>() : nullptr;
+        const auto mask_strides = mask.defined() ? mask.strides() : c10::IntArrayRef();
+        if (k_scales.defined()) {
+            tiled_attention_impl<scalar_t, int8_t>(
+                queries, keys, values, k_scales, v_scales, layout, mask_data, mask_strides, causal, static_cast<float>(scale), output.data_ptr<scalar_t>());
+        } else {
+            tiled_attention_impl<scalar_t, scalar_t>(
+                queries, keys, values, k_scales, v_scales, layout, mask_data, mask_strides, causal, static_cast<float>(scale), output.data_ptr<scalar_t>());
+        }
+    });
+
+    return output.transpose(1, 2);
+}
+
+
+// x @ weight.T with the weight expanded kDequantizeTile output channels at a time into one reused buffer
+// dequantize(begin, tile) fills tile, [count, in_features] in the dtype of x, with channels begin to begin + count
+template <typename Dequantize>
+torch::Tensor dequantized_linear(const torch::Tensor& x, int64_t out_features, const Dequantize& dequantize)
+{
+    const int64_t in_features = x.size(-1);
+    auto input = x.reshape({-1, in_features});
+    auto output = torch::empty({input.size(0), out_features}, x.options());
+    auto buffer = torch::empty({std::min(kDequantizeTile, out_features), in_features}, x.options());
+
+    for (int64_t begin = 0; begin < out_features; begin += kDequantizeTile) {
+        auto tile = buffer.narrow(0, 0, std::min(kDequantizeTile, out_features - begin));
+        dequantize(begin, tile);
+        output.narrow(1, begin, tile.size(0)).copy_(torch::matmul(input, tile.t()));
+    }
+
+    auto output_sizes = x.sizes().vec();
+    output_sizes.back() = out_features;
+    return output.view(output_sizes);
+}
+
+
+void check_input(const torch::Tensor& x, int64_t in_features)
+{
+    if (x.size(-1) != in_features) {
+        std::stringstream ss;
+        ss << "Input has " << x.size(-1) << " features, but the weight expects " << in_features;
+        throw std::invalid_argument(ss.str());
+    }
+}
+
+
+void check_group_size(int64_t in_features, int64_t group_size)
+{
+    if (group_size < 2 || group_size % 2 != 0 || in_features % group_size != 0) {
+        std::stringstream ss;
+        ss << "Group size " << group_size << " must be even and divide " << in_features << " input features";
+        throw std::invalid_argument(ss.str());
+    }
+}
+
+}
+
+
+torch::Tensor int8_linear(const torch::Tensor& x, const torch::Tensor& qweight, const torch::Tensor& scales)
+{
+    const int64_t out_features = qweight.size(0);
+    const int64_t in_features = qweight.size(1);
+    check_input(x, in_features);
+
+    auto output_sizes = x.sizes().vec();
+    output_sizes.back() = out_features;
+
+    auto input = x.reshape({-1, in_features});
+    const int64_t rows = input.size(0);
+
+    if (!x.device().is_cpu() || rows > kMaxDirectRows) {
+        const auto weight_scales = scales.to(x.scalar_type()).unsqueeze(1);
+        return dequantized_linear(x, out_features, [&](int64_t begin, torch::Tensor& tile) {
+            tile.copy_(qweight.narrow(0, begin, tile.size(0))).mul_(weight_scales.narrow(0, begin, tile.size(0)));
+        });
+    }
+
+    input = input.to(torch::kFloat32).contiguous();
+    auto weight = qweight.contiguous();
+    auto weight_scales = scales.to(torch::kFloat32).contiguous();
+    auto output = torch::empty({rows, out_features}, input.options());
+
+    const float* in_data = input.data_ptr<float>();
+    const int8_t* weight_data = weight.data_ptr<int8_t>();
+    const float* scale_data = weight_scales.data_ptr<float>();
+    float* out_data = output.data_ptr<float>();
+
+    auto dot = dot_int8;
+#if defined(LLAMA_KERNELS_X86)
+    if (simd_level() != SimdLevel::Scalar) {
+        dot = dot_int8_avx2;
+    }
+#endif
+
+    // each weight row is streamed from memory once for every input row
+    at::parallel_for(0, out_features, 16, [&](int64_t begin, int64_t end) {
+        for (int64_t n = begin; n < end; ++n) {
+            const int8_t* weight_row = weight_data + n * in_features;
+            for (int64_t m = 0; m < rows; ++m) {
+                out_data[m * out_features + n] = scale_data[n] * dot(in_data + m * in_features, weight_row, in_features);
+            }
+        }
+    });
+
+    return output.to(x.scalar_type()).view(output_sizes);
+}
+
+
+std::tuple<torch::Tensor, torch::Tensor> quantize_int8(const torch::Tensor& weight)
+{
+    auto weight_fp32 = weight.detach().to(torch::kFloat32);
+
+    // [out_features]
+    auto scales = weight_fp32.abs().amax(1).div(127.0f).clamp_min(1e-8f);
+    auto qweight = weight_fp32.div(scales.unsqueeze(1)).round().clamp(-127, 127).to(torch::kInt8);
+
+    return std::make_tuple(qweight.contiguous(), scales.contiguous());
+}
+
+
+torch::Tensor int4_linear(
+    const torch::Tensor& x,
+    const torch::Tensor& qweight,
+    const torch::Tensor& scales,
+    const torch::Tensor& zeros,
+    int64_t group_size)
+{
+    const int64_t out_features = qweight.size(0);
+    const int64_t in_features = qweight.size(1) * 2;
+    check_input(x, in_features);
+    check_group_size(in_features, group_size);
+
+    auto output_sizes = x.sizes().vec();
+    output_sizes.back() = out_features;
+
+    auto input = x.reshape({-1, in_features});
+    const int64_t rows = input.size(0);
+
+    if (!x.device().is_cpu() || rows > kMaxDirectRows) {
+        return dequantized_linear(x, out_features, [&](int64_t begin, torch::Tensor& tile) {
+            const int64_t count = tile.size(0);
+            tile.copy_(dequantize_int4(qweight.narrow(0, begin, count), scales.narrow(0, begin, count), zeros.narrow(0, begin, count), group_size));
+        });
+    }
+
+    const int64_t num_groups = in_features / group_size;
+    input = input.to(torch::kFloat32).contiguous();
+    // [rows, num_groups], shared by every output channel
+    auto group_sums = input.view({rows, num_groups, group_size}).sum(-1).contiguous();
+
+    auto weight = qweight.contiguous();
+    auto weight_scales = scales.to(torch::kHalf).contiguous();
+    auto weight_zeros = zeros.to(torch::kHalf).contiguous();
+    auto output = torch::empty({rows, out_features}, input.options());
+
+    const float* in_data = input.data_ptr<float>();
+    const float* sum_data = group_sums.data_ptr<float>();
+    const uint8_t* weight_data = weight.data_ptr<uint8_t>();
+    const at::Half* scale_data = weight_scales.data_ptr<at::Half>();
+    const at::Half* zero_data = weight_zeros.data_ptr<at::Half>();
+    float* out_data = output.data_ptr<float>();
+
+    auto dot = dot_int4;
+#if defined(LLAMA_KERNELS_X86)
+    if (group_size % 32 == 0) {
+        if (simd_level() == SimdLevel::Avx512) {
+            dot = dot_int4_avx512;
+        } else if (simd_level() == SimdLevel::Avx2) {
+            dot = dot_int4_avx2;
+        }
+    }
+#endif
+
+    at::parallel_for(0, out_features, 16, [&](int64_t begin, int64_t end) {
+        for (int64_t n = begin; n < end; ++n) {
+            const uint8_t* weight_row = weight_data + n * in_features / 2;
+            const at::Half* scale_row = scale_data + n * num_groups;
+            const at::Half* zero_row = zero_data + n * num_groups;
+            for (int64_t m = 0; m < rows; ++m) {
+                out_data[m * out_features + n] = dot(
+                    in_data + m * in_features,
+                    sum_data + m * num_groups,
+                    weight_row,
+                    scale_row,
+                    zero_row,
+                    in_features,
+                    group_size);
+            }
+        }
+    });
+
+    return output.to(x.scalar_type()).view(output_sizes);
+}
+
+
+std::tuple<torch::Tensor, torch::Tensor, torch::Tensor> quantize_int4(const torch::Tensor& weight, int64_t group_size)
+{
+    const int64_t out_features = weight.size(0);
+    const int64_t in_features = weight.size(1);
+    check_group_size(in_features, group_size);
+
+    // [out_features, num_groups, group_size]
+    auto weight_fp32 = weight.detach().to(torch::kFloat32).view({out_features, in_features / group_size, group_size});
+    auto min_values = weight_fp32.amin(-1);
+    auto max_values = weight_fp32.amax(-1);
+
+    // round through fp16 first so the stored scales and zeros are the ones quantized against
+    auto scales = (max_values - min_values).div(15.0f).clamp_min(1e-8f).to(torch::kHalf);
+    auto scales_fp32 = scales.to(torch::kFloat32);
+    auto zeros = min_values.neg().div(scales_fp32).to(torch::kHalf);
+    auto zeros_fp32 = zeros.to(torch::kFloat32);
+
+    auto values = weight_fp32.div(scales_fp32.unsqueeze(-1)).add(zeros_fp32.unsqueeze(-1))
+        .round()
+        .clamp(0, 15)
+        .to(torch::kUInt8)
+        .view({out_features, in_features / 2, 2});
+
+    // low nibble holds the even column
+    auto packed = values.select(-1, 0).bitwise_or(values.select(-1, 1).mul(16));
+
+    return std::make_tuple(packed.contiguous(), scales.contiguous(), zeros.contiguous());
+}
+
+
+torch::Tensor dequantize_int4(
+    const torch::Tensor& qweight,
+    const torch::Tensor& scales,
+    const torch::Tensor& zeros,
+    int64_t group_size)
+{
+    const int64_t out_features = qweight.size(0);
+    const int64_t in_features = qweight.size(1) * 2;
+
+    auto values = torch::stack({qweight.bitwise_and(0x0F), qweight.div(16, "floor")}, -1)
+        .to(torch::kFloat32)
+        .view({out_features, in_features / group_size, group_size});
+
+    auto weight = values.sub(zeros.to(torch::kFloat32).unsqueeze(-1)).mul(scales.to(torch::kFloat32).unsqueeze(-1));
+    return weight.view({out_features, in_features});
+}
+
+
+
+bool requires_autograd(std::initializer_list<torch::Tensor> tensors)
+{
+    if (!torch::GradMode::is_enabled()) {
+        return false;
+    }
+    return std::any_of(tensors.begin(), tensors.end(), [](const torch::Tensor& tensor) {
+        return tensor.defined() && tensor.requires_grad();
+    });
+}
+
+
+torch::Tensor silu_mul_(const torch::Tensor& gate_up)
+{
+    const int64_t width = gate_up.size(-1);
+    if (width % 2 != 0) {
+        std::stringstream ss;
+        ss << "Fused gate and up projection has an odd width of " << width;
+        throw std::invalid_argument(ss.str());
+    }
+
+    const int64_t half = width / 2;
+    auto gate = gate_up.narrow(-1, 0, half);
+
+    // out of place so autograd can still reach the projection
+    if (requires_autograd({ gate_up })) {
+        return torch::silu(gate) * gate_up.narrow(-1, half, half);
+    }
+
+    const auto type = gate_up.scalar_type();
+    if (!gate_up.device().is_cpu() || !gate_up.is_contiguous()
+        || (type != torch::kFloat32 && type != torch::kBFloat16 && type != torch::kHalf)) {
+        // still in place, just one extra pass over the gate
+        torch::NoGradGuard no_grad;
+        return torch::silu_(gate).mul_(gate_up.narrow(-1, half, half));
+    }
+
+    const int64_t rows = gate_up.numel() / std::max<int64_t>(width, 1);
+    AT_DISPATCH_FLOATING_TYPES_AND2(at::kBFloat16, at::kHalf, type, "silu_mul_", [&] {
+        silu_mul_rows<scalar_t>(gate_up.data_ptr<scalar_t>(), rows, half);
+    });
+
+    return gate;
+}
+
+
+torch::Tensor rms_norm(const torch::Tensor& x, const torch::Tensor& weight, double eps)
+{
+    check_input(x, weight.size(0));
+
+    // the kernel output has no grad_fn, so tracked inputs take the differentiable torch ops
+    if (!use_rms_norm_kernel(x, weight) || requires_autograd({ x, weight })) {
+        return rms_norm_reference(x, weight, eps);
+    }
+
+    const int64_t n = x.size(-1);
+    const int64_t rows = x.numel() / std::max<int64_t>(n, 1);
+    auto output = torch::empty_like(x);
+
+    AT_DISPATCH_FLOATING_TYPES_AND2(at::kBFloat16, at::kHalf, x.scalar_type(), "rms_norm", [&] {
+        rms_norm_rows<scalar_t>(
+            x.data_ptr<scalar_t>(),
+            nullptr,
+            weight.data_ptr<scalar_t>(),
+            output.data_ptr<scalar_t>(),
+            rows,
+            n,
+            static_cast<float>(eps));
+    });
+
+    return output;
+}
+
+
+torch::Tensor add_rms_norm_(const torch::Tensor& x, const torch::Tensor& residual, const torch::Tensor& weight, double eps)
+{
+    check_input(x, weight.size(0));
+
+    if (!use_rms_norm_kernel(x, weight) || !residual.is_contiguous() || residual.scalar_type() != x.scalar_type()
+        || !residual.device().is_cpu() || residual.sizes() != x.sizes() || requires_autograd({ x, residual, weight })) {
+        // recorded by autograd like any in-place add, LlamaRMSNorm adds out of place when it tracks the inputs
+        x.add_(residual);
+        return rms_norm_reference(x, weight, eps);
+    }
+
+    const int64_t n = x.size(-1);
+    const int64_t rows = x.numel() / std::max<int64_t>(n, 1);
+    auto output = torch::empty_like(x);
+
+    AT_DISPATCH_FLOATING_TYPES_AND2(at::kBFloat16, at::kHalf, x.scalar_type(), "add_rms_norm_", [&] {
+        rms_norm_rows<scalar_t>(
+            x.data_ptr<scalar_t>(),
+            residual.data_ptr<scalar_t>(),
+            weight.data_ptr<scalar_t>(),
+            output.data_ptr<scalar_t>(),
+            rows,
+            n,
+            static_cast<float>(eps));
+    });
+
+    return output;
+}
+
+
+void rotary_embedding_(
+    const torch::Tensor& q,
+    const torch::Tensor& k,
+    const torch::Tensor& cos,
+    const torch::Tensor& sin,
+    const torch::Tensor& position_ids)
+{
+    if (requires_autograd({ q, k })) {
+        throw std::invalid_argument("Rotary embedding in place would detach q and k from autograd, use apply_rotary_pos_emb");
+    }
+
+    const int64_t head_dim = q.size(-1);
+    if (head_dim % 2 != 0 || k.size(-1) != head_dim || cos.size(-1) != head_dim) {
+        std::stringstream ss;
+        ss << "Rotary embedding needs an even head dim shared by q, k and the tables, got "
+           << head_dim << ", " << k.size(-1) << " and " << cos.size(-1);
+        throw std::invalid_argument(ss.str());
+    }
+
+    const auto type = q.scalar_type();
+    const bool use_kernel = q.device().is_cpu() && k.device().is_cpu() && cos.device().is_cpu()
+        && q.stride(-1) == 1 && k.stride(-1) == 1 && cos.is_contiguous() && sin.is_contiguous()
+        && k.scalar_type() == type && cos.scalar_type() == type && sin.scalar_type() == type
+        && (type == torch::kFloat32 || type == torch::kBFloat16 || type == torch::kHalf);
+
+    if (!use_kernel) {
+        // same rotation with torch ops, still written back into q and k
+        torch::NoGradGuard no_grad;
+        const int64_t half = head_dim / 2;
+        auto cos_half = cos.index({position_ids}).narrow(-1, 0, half).unsqueeze(1).to(type);
+        auto sin_half = sin.index({position_ids}).narrow(-1, 0, half).unsqueeze(1).to(type);
+        for (const auto& x : { q, k }) {
+            auto x1 = x.narrow(-1, 0, half);
+            auto x2 = x.narrow(-1, half, half);
+            auto rotated_first = x1 * cos_half - x2 * sin_half;
+            x2.mul_(cos_half).addcmul_(x1, sin_half);
+            x1.copy_(rotated_first);
+        }
+        return;
+    }
+
+    auto positions = position_ids.to(torch::kInt64).contiguous();
+    if (positions.dim() != 2 || positions.size(1) != q.size(2) || (positions.size(0) != 1 && positions.size(0) != q.size(0))) {
+        throw std::invalid_argument("Position ids must be [batch or 1, seq_len]");
+    }
+
+    // one row of position ids is shared by the whole batch
+    const int64_t position_batch_stride = positions.size(0) == 1 ? 0 : positions.size(1);
+
+    AT_DISPATCH_FLOATING_TYPES_AND2(at::kBFloat16, at::kHalf, type, "rotary_embedding_", [&] {
+        const scalar_t* cos_data = cos.data_ptr<scalar_t>();
+        const scalar_t* sin_data = sin.data_ptr<scalar_t>();
+        rotary_heads<scalar_t>(q, cos_data, sin_data, positions.data_ptr<int64_t>(), position_batch_stride);
+        rotary_heads<scalar_t>(k, cos_data, sin_data, positions.data_ptr<int64_t>(), position_batch_stride);
+    });
+}
+
+
+torch::Tensor tiled_attention(
+    const torch::Tensor& q,
+    const torch::Tensor& k,
+    const torch::Tensor& v,
+    const c10::optional<torch::Tensor>& attention_mask,
+    bool causal,
+    double scale)
+{
+    const auto type = q.scalar_type();
+    if (!supports_tiled_attention(q) || k.scalar_type() != type || v.scalar_type() != type) {
+        throw std::invalid_argument("Tiled attention needs float32, bfloat16 or float16 cpu tensors of one dtype");
+    }
+    return run_tiled_attention(q, k, v, torch::Tensor(), torch::Tensor(), dense_layout(q, k), attention_mask, causal, scale);
+}
+
+
+torch::Tensor tiled_attention_int8(
+    const torch::Tensor& q,
+    const torch::Tensor& k,
+    const torch::Tensor& k_scales,
+    const torch::Tensor& v,
+    const torch::Tensor& v_scales,
+    const c10::optional<torch::Tensor>& attention_mask,
+    bool causal,
+    double scale)
+{
+    if (!supports_tiled_attention(q) || k.scalar_type() != torch::kInt8 || v.scalar_type() != torch::kInt8
+        || k_scales.scalar_type() != torch::kFloat32 || v_scales.scalar_type() != torch::kFloat32) {
+        throw std::invalid_argument("Int8 tiled attention needs float32, bfloat16 or float16 queries, int8 states and float32 scales on the cpu");
+    }
+
+    if (k_scales.sizes() != k.sizes().slice(0, 3) || v_scales.sizes() != v.sizes().slice(0, 3)) {
+        std::stringstream ss;
+        ss << "Int8 tiled attention got keys " << k.sizes() << " with scales " << k_scales.sizes()
+           << ", expected one scale per head and token";
+        throw std::invalid_argument(ss.str());
+    }
+    return run_tiled_attention(q, k, v, k_scales, v_scales, dense_layout(q, k), attention_mask, causal, scale);
+}
+
+
+torch::Tensor paged_attention(
+    const torch::Tensor& q,
+    const torch::Tensor& k_blocks,
+    const torch::Tensor& v_blocks,
+    const torch::Tensor& k_scales,
+    const torch::Tensor& v_scales,
+    const torch::Tensor& block_table,
+    int64_t kv_len,
+    const c10::optional<torch::Tensor>& attention_mask,
+    bool causal,
+    double scale)
+{
+    const bool int8 = k_scales.defined();
+    const auto state_type = int8 ? torch::kInt8 : q.scalar_type();
+    if (!supports_tiled_attention(q) || k_blocks.scalar_type() != state_type || v_blocks.scalar_type() != state_type
+        || (int8 && (k_scales.scalar_type() != torch::kFloat32 || v_scales.scalar_type() != torch::kFloat32))) {
+        throw std::invalid_argument("Paged attention needs float32, bfloat16 or float16 cpu queries with blocks of their dtype, or int8 blocks with float32 scales");
+    }
+
+    if (k_blocks.dim() != 4 || block_table.scalar_type() != torch::kInt64 || !block_table.device().is_cpu()
+        || block_table.dim() != 2 || block_table.size(0) != q.size(0) || block_table.size(1) * k_blocks.size(1) < kv_len
+        || (int8 && (k_scales.sizes() != k_blocks.sizes().slice(0, 3) || v_scales.sizes() != v_blocks.sizes().slice(0, 3)))) {
+        std::stringstream ss;
+        ss << "Paged attention got queries " << q.sizes() << ", blocks " << k_blocks.sizes() << " and a block table "
+           << block_table.sizes() << " for " << kv_len << " tokens";
+        throw std::invalid_argument(ss.str());
+    }
+
+    const auto table = block_table.contiguous();
+    const KVLayout layout{k_blocks.size(2), kv_len, table.data_ptr<int64_t>(), table.size(1), k_blocks.size(1)};
+    return run_tiled_attention(q, k_blocks, v_blocks, k_scales, v_scales, layout, attention_mask, causal, scale);
+}
+
+
+std::tuple<torch::Tensor, torch::Tensor> quantize_kv_int8(const torch::Tensor& states)
+{
+    auto states_fp32 = states.detach().to(torch::kFloat32);
+
+    // [..., head_dim] -> [...]
+    auto scales = states_fp32.abs().amax(-1).div(127.0f).clamp_min(1e-8f);
+    auto qstates = states_fp32.div(scales.unsqueeze(-1)).round().clamp(-127, 127).to(torch::kInt8);
+
+    return std::make_tuple(qstates, scales);
+}
+
+
+torch::Tensor dequantize_kv_int8(const torch::Tensor& states, const torch::Tensor& scales, torch::Dtype dtype)
+{
+    return states.to(torch::kFloat32).mul(scales.unsqueeze(-1)).to(dtype);
+}
+
+
+bool supports_tiled_attention(const torch::Tensor& x)
+{
+    // the output is written through raw pointers, q, k and v would get no gradient
+    if (torch::GradMode::is_enabled()) {
+        return false;
+    }
+
+    const auto type = x.scalar_type();
+    return x.device().is_cpu() && (type == torch::kFloat32 || type == torch::kBFloat16 || type == torch::kHalf);
+}
\ No newline at end of file
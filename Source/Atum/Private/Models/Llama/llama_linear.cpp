@@ -0,0 +1,196 @@
+#include "Models/Llama/llama_linear.h"
+#include "Models/Llama/llama_kernels.h"
+#include <cmath>
+#include <stdexcept>
+
+
+LlamaLinearImpl::LlamaLinearImpl(
+    int64_t in_features,
+    int64_t out_features,
+    LlamaQuantization quantization,
+    int64_t group_size,
+    torch::Dtype dtype,
+    bool init_weights)
+    : in_features(in_features),
+    out_features(out_features),
+    quantization(quantization),
+    group_size(group_size)
+{
+    if (quantization == LlamaQuantization::None) {
+        weight = register_parameter("weight", torch::empty({out_features, in_features}, torch::TensorOptions().dtype(dtype)));
+
+        // same initialisation as torch::nn::Linear
+        if (init_weights) {
+            torch::nn::init::kaiming_uniform_(weight, std::sqrt(5.0));
+        }
+        return;
+    }
+
+    // filled by loading an archive saved after quantize
+    weight = register_parameter("weight", torch::empty({0}, torch::TensorOptions().dtype(dtype)));
+    if (quantization == LlamaQuantization::Int4) {
+        register_quantized(torch::empty({0}, torch::kUInt8), torch::empty({0}, torch::kHalf), torch::empty({0}, torch::kHalf));
+    } else {
+        register_quantized(torch::empty({0}, torch::kInt8), torch::empty({0}, torch::kFloat32));
+    }
+}
+
+
+torch::Tensor LlamaLinearImpl::forward(const torch::Tensor& x)
+{
+    switch (quantization) {
+    case LlamaQuantization::Int8:
+        return int8_linear(x, qweight, scales);
+    case LlamaQuantization::Int4:
+        return int4_linear(x, qweight, scales, zeros, group_size);
+    default:
+        return torch::nn::functional::linear(x, weight);
+    }
+}
+
+
+void LlamaLinearImpl::quantize(LlamaQuantization format, int64_t new_group_size)
+{
+    if (format == quantization) {
+        return;
+    }
+
+    if (quantization != LlamaQuantization::None || format == LlamaQuantization::None) {
+        throw std::invalid_argument("Only plain weights can be quantized");
+    }
+
+    torch::NoGradGuard no_grad;
+
+    if (format == LlamaQuantization::Int4) {
+        auto [new_qweight, new_scales, new_zeros] = quantize_int4(weight, new_group_size);
+        register_quantized(new_qweight, new_scales, new_zeros);
+        group_size = new_group_size;
+    } else {
+        auto [new_qweight, new_scales] = quantize_int8(weight);
+        register_quantized(new_qweight, new_scales);
+    }
+
+    // the plain weight is no longer needed
+    weight.set_data(torch::empty({0}, weight.options()));
+    quantization = format;
+}
+
+
+void LlamaLinearImpl::register_quantized(
+    const torch::Tensor& new_qweight,
+    const torch::Tensor& new_scales,
+    const torch::Tensor& new_zeros)
+{
+    qweight = register_buffer("qweight", new_qweight);
+    scales = register_buffer("scales", new_scales);
+    if (new_zeros.defined()) {
+        zeros = register_buffer("zeros", new_zeros);
+    }
+}
+
+
+std::shared_ptr<LlamaLinearImpl> LlamaLinearImpl::fuse(const std::vector<std::shared_ptr<LlamaLinearImpl>>& parts)
+{
+    if (parts.empty()) {
+        throw std::invalid_argument("Nothing to fuse");
+    }
+
+    const auto& first = *parts.front();
+    int64_t out_features = 0;
+    for (const auto& part : parts) {
+        if (part->in_features != first.in_features || part->quantization != first.quantization || part->group_size != first.group_size) {
+            throw std::invalid_argument("Fused projections must share input size and quantization");
+        }
+        out_features += part->out_features;
+    }
+
+    torch::NoGradGuard no_grad;
+
+    // every tensor of the fused module is replaced below
+    auto fused = std::make_shared<LlamaLinearImpl>(
+        first.in_features,
+        out_features,
+        first.quantization,
+        first.group_size,
+        first.weight.scalar_type(),
+        false);
+
+    // every quantized tensor is laid out by output channel, so all of them concatenate along dim 0
+    auto fuse_tensor = [&parts](torch::Tensor LlamaLinearImpl::* member, torch::Tensor& target) {
+        std::vector<torch::Tensor> tensors;
+        tensors.reserve(parts.size());
+        for (const auto& part : parts) {
+            tensors.push_back((*part).*member);
+        }
+        target.set_data(torch::cat(tensors, 0));
+
+        int64_t offset = 0;
+        for (const auto& part : parts) {
+            auto& tensor = (*part).*member;
+            const int64_t rows = tensor.size(0);
+            tensor.set_data(target.narrow(0, offset, rows));
+            offset += rows;
+        }
+    };
+
+    if (first.quantization == LlamaQuantization::None) {
+        fuse_tensor(&LlamaLinearImpl::weight, fused->weight);
+        return fused;
+    }
+
+    fuse_tensor(&LlamaLinearImpl::qweight, fused->qweight);
+    fuse_tensor(&LlamaLinearImpl::scales, fused->scales);
+    if (first.quantization == LlamaQuantization::Int4) {
+        fuse_tensor(&LlamaLinearImpl::zeros, fused->zeros);
+    }
+    return fused;
+}
+
+
+bool LlamaLinearImpl::is_part_of(const LlamaLinearImpl& fused) const
+{
+    if (quantization != fused.quantization) {
+        return false;
+    }
+
+    const auto& own = quantization == LlamaQuantization::None ? weight : qweight;
+    const auto& shared = quantization == LlamaQuantization::None ? fused.weight : fused.qweight;
+    return own.numel() > 0 && own.is_alias_of(shared);
+}
+
+
+LlamaQuantization LlamaLinearImpl::get_quantization() const
+{
+    return quantization;
+}
+
+
+int64_t LlamaLinearImpl::get_in_features() const
+{
+    return in_features;
+}
+
+
+int64_t LlamaLinearImpl::get_out_features() const
+{
+    return out_features;
+}
+
+
+void LlamaLinearImpl::to(torch::Device device, torch::Dtype dtype, bool non_blocking)
+{
+    torch::nn::Module::to(device, non_blocking);
+    weight.set_data(weight.to(dtype, non_blocking));
+}
+
+
+void LlamaLinearImpl::to(torch::Dtype dtype, bool non_blocking)
+{
+    weight.set_data(weight.to(dtype, non_blocking));
+}
+
+
+void LlamaLinearImpl::to(torch::Device device, bool non_blocking)
+{
+    torch::nn::Module::to(device, non_blocking);
+}
@@ -1,12 +1,13 @@
 #include <Models/Llama/llama_mlp.h>
+#include <Models/Llama/llama_kernels.h>
 
 
 
 LlamaMLPImpl::LlamaMLPImpl(const LlamaConfig& config) 
     : hidden_size(config.hidden_size), intermediate_size(config.intermediate_size),
-    gate_proj(torch::nn::Linear(torch::nn::LinearOptions(hidden_size, intermediate_size).bias(false))),
-    up_proj(torch::nn::Linear(torch::nn::LinearOptions(hidden_size, intermediate_size).bias(false))),
-    down_proj(torch::nn::Linear(torch::nn::LinearOptions(intermediate_size, hidden_size).bias(false)))
+    gate_proj(LlamaLinear(hidden_size, intermediate_size, config.quantization, config.quantization_group_size, config.dtype, config.init_weights)),
+    up_proj(LlamaLinear(hidden_size, intermediate_size, config.quantization, config.quantization_group_size, config.dtype, config.init_weights)),
+    down_proj(LlamaLinear(intermediate_size, hidden_size, config.quantization, config.quantization_group_size, config.dtype, config.init_weights))
 
 {
     register_module("gate_proj", gate_proj);
@@ -16,7 +17,27 @@ LlamaMLPImpl::LlamaMLPImpl(const LlamaConfig& config)
 }
 
 torch::Tensor LlamaMLPImpl::forward(const torch::Tensor& x) {
+    // the fused weight is not registered, gradients only reach the parameters through the separate projections
+    if (gate_up_proj && gate_proj->is_part_of(*gate_up_proj) && up_proj->is_part_of(*gate_up_proj) && !torch::GradMode::is_enabled()) {
+        // one projection, then silu(gate) * up is written over the gate half
+        return down_proj->forward(silu_mul_(gate_up_proj->forward(x)));
+    }
+
     auto gate = torch::silu(gate_proj->forward(x));
     auto up = up_proj->forward(x); 
     return down_proj->forward(gate * up);
+}
+
+
+void LlamaMLPImpl::fuse_projections()
+{
+    gate_up_proj = LlamaLinear(LlamaLinearImpl::fuse({gate_proj.ptr(), up_proj.ptr()}));
+}
+
+
+bool LlamaMLPImpl::unfuse_projections()
+{
+    const bool fused = static_cast<bool>(gate_up_proj);
+    gate_up_proj = nullptr;
+    return fused;
 }
\ No newline at end of file
@@ -3,6 +3,7 @@
 #include "Models/Llama/llama_model.h"
 #include "Models/Llama/llama_decoder_lay.h"
 #include "Models/Llama/llama_utils.h"
+#include "Models/Llama/llama_kernels.h"
 
 
 LlamaModelImpl::LlamaModelImpl(const LlamaConfig& config) 
@@ -16,6 +17,10 @@ LlamaModelImpl::LlamaModelImpl(const LlamaConfig& config)
     if (config.pad_token_id.has_value()) {
         options = options.padding_idx(config.pad_token_id.value());
     }
+    if (!config.init_weights) {
+        // a given weight is taken as is, skipping the normal initialisation
+        options = options._weight(torch::empty({config.vocab_size, config.hidden_size}, torch::TensorOptions().dtype(config.dtype)));
+    }
     word_embeddings = torch::nn::Embedding(options);
     word_embeddings->to(config.dtype);
 
@@ -24,13 +29,18 @@ LlamaModelImpl::LlamaModelImpl(const LlamaConfig& config)
 
     register_module("layers", layers);
     for (int i = 0; i < config.num_hidden_layers; ++i) {
-        auto layer = LlamaDecoderLayer(config);
+        auto layer = LlamaDecoderLayer(config, i);
         layer->to(config.dtype);
         layers->push_back(layer);
     }
 }
 
 
+const torch::Tensor& LlamaModelImpl::get_input_embeddings() const
+{
+    return word_embeddings->weight;
+}
+
 
 std::tuple<torch::Tensor, std::vector<std::tuple<torch::Tensor, torch::Tensor>>, std::vector<torch::Tensor>, std::vector<c10::optional<torch::Tensor>>>
 LlamaModelImpl::forward(
@@ -41,7 +51,8 @@ LlamaModelImpl::forward(
     const std::vector<std::tuple<torch::Tensor, torch::Tensor>>& past_key_values,
     c10::optional<bool> output_attentions,
     c10::optional<bool> output_hidden_states,
-    c10::optional<bool> use_cache)
+    c10::optional<bool> use_cache,
+    LlamaCache* cache)
 {
     // check output atts
     bool resolved_output_attentions; 
@@ -85,11 +96,11 @@ LlamaModelImpl::forward(
         throw std::invalid_argument("You have to specify either input_ids or inputs_embeds");
     }
 
-    // print seq_length
-    std::cout << "seq_length: " << seq_length << std::endl;
-
-    int past_key_values_length = 0;
-    if (past_key_values.size() > 0) {
+    int64_t past_key_values_length = 0;
+    if (cache) {
+        // a cache that evicts for the new tokens hands back fewer states than it held
+        past_key_values_length = cache->get_past_length(seq_length);
+    } else if (past_key_values.size() > 0) {
         // get shape of dim 2 of the first tuple
         auto past_key_values_shape = std::get<0>(past_key_values[0]).sizes();
         past_key_values_length = past_key_values_shape[2];
@@ -104,6 +115,14 @@ LlamaModelImpl::forward(
             options = options.device(inputs_embeds->device());
         }
         position_ids = torch::arange(past_key_values_length, seq_length + past_key_values_length, options).unsqueeze(0);
+    } else if (position_ids->numel() > 0) {
+        // checked once per step, every layer then indexes its rotary tables with them unchecked
+        const auto [min_position, max_position] = torch::aminmax(position_ids.value());
+        if (min_position.item<int64_t>() < 0 || max_position.item<int64_t>() >= past_key_values_length + seq_length) {
+            std::stringstream ss;
+            ss << "Position ids must lie within the " << past_key_values_length + seq_length << " cached and new tokens";
+            throw std::out_of_range(ss.str());
+        }
     }
 
     if (!inputs_embeds.has_value()) {
@@ -115,7 +134,19 @@ LlamaModelImpl::forward(
     auto input_shape = std::make_tuple(batch_size, seq_length);
     auto scalar_type = inputs_embeds->scalar_type();
 
-    attention_mask = prepare4DCausalMask(attention_mask, input_shape, past_key_values_length, scalar_type, inputs_embeds->device());
+    // a mask of only ones adds nothing to causal attention
+    if (attention_mask.has_value() && attention_mask->all().item<bool>()) {
+        attention_mask = c10::nullopt;
+    }
+
+    if (attention_mask.has_value()) {
+        // padding still needs the expanded mask
+        attention_mask = prepare4DCausalMask(attention_mask, input_shape, past_key_values_length, scalar_type, inputs_embeds->device());
+    } else if (seq_length > 1 && (resolved_output_attentions || !supports_tiled_attention(inputs_embeds.value()))) {
+        // the dense attention path applies causality from a tensor, reused across steps
+        attention_mask = causal_mask(batch_size, seq_length, past_key_values_length + seq_length, scalar_type, inputs_embeds->device());
+    }
+    // otherwise tiled attention masks the future keys implicitly and no mask is built
 
     torch::Tensor hidden_states = inputs_embeds.value();
 
@@ -152,12 +183,14 @@ LlamaModelImpl::forward(
             position_ids,
             past_key_value,
             resolved_output_attentions,
-            resolved_use_cache
+            resolved_use_cache,
+            cache
         );
 
         hidden_states = std::get<0>(layer_outputs);
 
-        if (resolved_use_cache) {
+        // an external cache already holds the new states
+        if (resolved_use_cache && !cache) {
             // check if resolved outputs attentions to know which key to use
             auto present_key_value = std::get<2>(layer_outputs);
             next_decoder_cache.push_back(present_key_value.value());
@@ -187,4 +220,32 @@ LlamaModelImpl::forward(
     
 
     
-        
\ No newline at end of file
+        
+
+
+torch::Tensor LlamaModelImpl::causal_mask(
+    int64_t batch_size,
+    int64_t query_length,
+    int64_t key_value_length,
+    const at::ScalarType& dtype,
+    const torch::Device& device)
+{
+    if (!causal_mask_cache.defined() || causal_mask_cache.size(0) < key_value_length ||
+        causal_mask_cache.scalar_type() != dtype || causal_mask_cache.device() != device) {
+        // doubled so growing prompts rebuild it only a few times
+        int64_t size = 64;
+        while (size < key_value_length) {
+            size *= 2;
+        }
+        auto options = torch::TensorOptions().dtype(dtype).device(device);
+        causal_mask_cache = torch::full({size, size}, getMinValue(dtype), options).triu(1);
+    }
+
+    // the queries are the last query_length of the key_value_length positions
+    const int64_t past_key_values_length = key_value_length - query_length;
+    return causal_mask_cache.narrow(0, past_key_values_length, query_length)
+        .narrow(1, 0, key_value_length)
+        .unsqueeze(0)
+        .unsqueeze(0)
+        .expand({batch_size, 1, query_length, key_value_length});
+}
\ No newline at end of file
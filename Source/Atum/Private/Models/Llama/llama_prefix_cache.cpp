@@ -0,0 +1,234 @@
+#include "Models/Llama/llama_prefix_cache.h"
+#include <algorithm>
+#include <stdexcept>
+
+
+LlamaPrefixCache::LlamaPrefixCache(const LlamaConfig& config, int64_t max_bytes, int64_t block_size)
+    : num_layers(config.num_hidden_layers),
+    max_bytes(max_bytes),
+    block_size(block_size)
+{
+    if (block_size < 1) {
+        throw std::invalid_argument("Prefix cache block size must be at least 1");
+    }
+}
+
+
+uint64_t LlamaPrefixCache::hash_block(uint64_t parent_hash, const int64_t* tokens, int64_t count)
+{
+    // fnv-1a over the parent hash and the token ids
+    uint64_t hash = 14695981039346656037ull;
+    auto mix = [&hash](uint64_t value) {
+        for (int i = 0; i < 8; ++i) {
+            hash ^= (value >> (i * 8)) & 0xff;
+            hash *= 1099511628211ull;
+        }
+    };
+
+    mix(parent_hash);
+    for (int64_t i = 0; i < count; ++i) {
+        mix(static_cast<uint64_t>(tokens[i]));
+    }
+    return hash;
+}
+
+
+std::list<LlamaPrefixCache::Block>::iterator LlamaPrefixCache::find(uint64_t hash, uint64_t parent_hash, const int64_t* tokens)
+{
+    auto it = index.find(hash);
+    if (it == index.end()) {
+        return blocks.end();
+    }
+
+    const auto& block = *it->second;
+    if (block.parent_hash != parent_hash || !std::equal(block.tokens.begin(), block.tokens.end(), tokens)) {
+        return blocks.end();
+    }
+    return it->second;
+}
+
+
+int64_t LlamaPrefixCache::load(const int64_t* tokens, int64_t num_tokens, LlamaCache& cache)
+{
+    if (cache.get_seq_length() != 0) {
+        return 0;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    std::vector<std::list<Block>::iterator> matched;
+    uint64_t parent_hash = 0;
+    for (int64_t start = 0; start + block_size < num_tokens; start += block_size) {
+        const uint64_t hash = hash_block(parent_hash, tokens + start, block_size);
+        auto it = find(hash, parent_hash, tokens + start);
+        if (it == blocks.end()) {
+            break;
+        }
+        matched.push_back(it);
+        parent_hash = hash;
+    }
+
+    if (matched.empty()) {
+        return 0;
+    }
+
+    // [1, num_key_value_heads, num_matched * block_size, head_dim] per layer
+    std::vector<torch::Tensor> layer_keys(matched.size());
+    std::vector<torch::Tensor> layer_values(matched.size());
+    for (int64_t layer = 0; layer < num_layers; ++layer) {
+        for (size_t i = 0; i < matched.size(); ++i) {
+            layer_keys[i] = matched[i]->keys[layer];
+            layer_values[i] = matched[i]->values[layer];
+        }
+        cache.update(torch::cat(layer_keys, 2), torch::cat(layer_values, 2), layer);
+    }
+
+    touch(matched);
+
+    return static_cast<int64_t>(matched.size()) * block_size;
+}
+
+
+void LlamaPrefixCache::store(const int64_t* tokens, int64_t num_tokens, LlamaCache& cache)
+{
+    if (max_bytes <= 0) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    const int64_t num_blocks = std::min(num_tokens, cache.get_seq_length()) / block_size;
+
+    // read back lazily, most prompts only add blocks that are already known
+    std::vector<torch::Tensor> layer_keys;
+    std::vector<torch::Tensor> layer_values;
+
+    // every block of the prompt, known or new, root first
+    std::vector<std::list<Block>::iterator> chain;
+
+    uint64_t parent_hash = 0;
+    for (int64_t b = 0; b < num_blocks; ++b) {
+        const int64_t* block_tokens = tokens + b * block_size;
+        const uint64_t hash = hash_block(parent_hash, block_tokens, block_size);
+
+        auto it = find(hash, parent_hash, block_tokens);
+        if (it != blocks.end()) {
+            chain.push_back(it);
+            parent_hash = hash;
+            continue;
+        }
+
+        // a colliding block of another prefix gives way to the new one, along with the blocks behind it
+        auto stale = index.find(hash);
+        if (stale != index.end()) {
+            if (std::find(chain.begin(), chain.end(), stale->second) != chain.end()) {
+                break;
+            }
+            remove(stale->second);
+        }
+
+        if (layer_keys.empty()) {
+            for (int64_t layer = 0; layer < num_layers; ++layer) {
+                auto [k, v] = cache.get_states(layer);
+                layer_keys.push_back(k.narrow(0, 0, 1));
+                layer_values.push_back(v.narrow(0, 0, 1));
+            }
+        }
+
+        Block block;
+        block.hash = hash;
+        block.parent_hash = parent_hash;
+        block.tokens.assign(block_tokens, block_tokens + block_size);
+        for (int64_t layer = 0; layer < num_layers; ++layer) {
+            block.keys.push_back(layer_keys[layer].narrow(2, b * block_size, block_size).clone());
+            block.values.push_back(layer_values[layer].narrow(2, b * block_size, block_size).clone());
+            block.bytes += block.keys.back().nbytes() + block.values.back().nbytes();
+        }
+
+        used_bytes += block.bytes;
+        blocks.push_front(std::move(block));
+        index[hash] = blocks.begin();
+        if (!chain.empty()) {
+            chain.back()->children.push_back(hash);
+        }
+        chain.push_back(blocks.begin());
+        parent_hash = hash;
+    }
+
+    touch(chain);
+    evict();
+}
+
+
+void LlamaPrefixCache::touch(const std::vector<std::list<Block>::iterator>& chain)
+{
+    // deeper blocks go in first so the shared root ends up the most recent and is evicted last
+    for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+        blocks.splice(blocks.begin(), blocks, *it);
+    }
+}
+
+
+void LlamaPrefixCache::remove(std::list<Block>::iterator it)
+{
+    auto parent = index.find(it->parent_hash);
+    if (parent != index.end()) {
+        auto& siblings = parent->second->children;
+        siblings.erase(std::remove(siblings.begin(), siblings.end(), it->hash), siblings.end());
+    }
+
+    std::vector<std::list<Block>::iterator> pending = { it };
+    while (!pending.empty()) {
+        auto block = pending.back();
+        pending.pop_back();
+
+        // a child hash may since have been taken by a block of another prefix
+        for (const uint64_t child_hash : block->children) {
+            auto child = index.find(child_hash);
+            if (child != index.end() && child->second->parent_hash == block->hash) {
+                pending.push_back(child->second);
+            }
+        }
+
+        used_bytes -= block->bytes;
+        index.erase(block->hash);
+        blocks.erase(block);
+    }
+}
+
+
+void LlamaPrefixCache::evict()
+{
+    while (used_bytes > max_bytes && !blocks.empty()) {
+        remove(std::prev(blocks.end()));
+    }
+}
+
+
+void LlamaPrefixCache::clear()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    blocks.clear();
+    index.clear();
+    used_bytes = 0;
+}
+
+
+int64_t LlamaPrefixCache::memory_bytes() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return used_bytes;
+}
+
+
+int64_t LlamaPrefixCache::get_num_blocks() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return static_cast<int64_t>(blocks.size());
+}
+
+
+int64_t LlamaPrefixCache::get_block_size() const
+{
+    return block_size;
+}
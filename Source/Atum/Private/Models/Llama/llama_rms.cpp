@@ -1,4 +1,5 @@
 #include <Models/Llama/llama_rms.h>
+#include <Models/Llama/llama_kernels.h>
 
 LlamaRMSNormImpl::LlamaRMSNormImpl(int hidden_size, double eps) : variance_epsilon(eps) {
     weight = torch::ones({hidden_size});
@@ -7,10 +8,15 @@ LlamaRMSNormImpl::LlamaRMSNormImpl(int hidden_size, double eps) : variance_epsil
 }
 
 torch::Tensor LlamaRMSNormImpl::forward(torch::Tensor& x) {
-    // dtype
-    auto const input_dtype = x.dtype();
-    x = x.to(torch::kFloat32);
-    auto const variance = x.pow(2).mean(-1, true);
-    x = torch::mul(x, torch::rsqrt(variance + variance_epsilon));
-    return torch::mul(x.to(input_dtype), weight);
+    // float32 accumulation, output in the input dtype
+    return rms_norm(x, weight, variance_epsilon);
+}
+
+torch::Tensor LlamaRMSNormImpl::forward_residual(torch::Tensor& x, const torch::Tensor& residual) {
+    // out of place while training, x is rebound to the sum instead
+    if (requires_autograd({ x, residual, weight })) {
+        x = x + residual;
+        return rms_norm(x, weight, variance_epsilon);
+    }
+    return add_rms_norm_(x, residual, weight, variance_epsilon);
 }
\ No newline at end of file
@@ -0,0 +1,437 @@
+#include "Models/Llama/llama_safetensors.h"
+
+#include "Async/MappedFileHandle.h"
+#include "Dom/JsonObject.h"
+#include "HAL/PlatformFileManager.h"
+#include "Serialization/JsonReader.h"
+#include "Serialization/JsonSerializer.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+
+
+// the region is declared last so it is unmapped before the file is closed
+struct LlamaMappedFile {
+    TUniquePtr<IMappedFileHandle> handle;
+    TUniquePtr<IMappedFileRegion> region;
+};
+
+
+namespace {
+
+torch::ScalarType parse_dtype(const std::string& name)
+{
+    static const std::unordered_map<std::string, torch::ScalarType> dtypes = {
+        {"F64", torch::kFloat64},
+        {"F32", torch::kFloat32},
+        {"F16", torch::kHalf},
+        {"BF16", torch::kBFloat16},
+        {"I64", torch::kInt64},
+        {"I32", torch::kInt32},
+        {"I16", torch::kInt16},
+        {"I8", torch::kInt8},
+        {"U8", torch::kByte},
+        {"BOOL", torch::kBool}
+    };
+
+    auto it = dtypes.find(name);
+    if (it == dtypes.end()) {
+        std::stringstream ss;
+        ss << "Unsupported safetensors dtype " << name;
+        throw std::runtime_error(ss.str());
+    }
+    return it->second;
+}
+
+
+// "model.layers.12." for the tensors of a decoder layer, empty for the rest
+std::string layer_prefix(const std::string& name)
+{
+    static const std::string marker = "layers.";
+    const size_t start = name.find(marker);
+    if (start == std::string::npos) {
+        return std::string();
+    }
+
+    size_t end = start + marker.size();
+    while (end < name.size() && std::isdigit(static_cast<unsigned char>(name[end]))) {
+        ++end;
+    }
+    return name.substr(0, end + 1);
+}
+
+
+std::string dtype_name(torch::ScalarType dtype)
+{
+    switch (dtype) {
+    case torch::kFloat64: return "F64";
+    case torch::kFloat32: return "F32";
+    case torch::kHalf: return "F16";
+    case torch::kBFloat16: return "BF16";
+    case torch::kInt64: return "I64";
+    case torch::kInt32: return "I32";
+    case torch::kInt16: return "I16";
+    case torch::kInt8: return "I8";
+    case torch::kByte: return "U8";
+    case torch::kBool: return "BOOL";
+    default: {
+        std::stringstream ss;
+        ss << "Safetensors cannot store " << dtype;
+        throw std::runtime_error(ss.str());
+    }
+    }
+}
+
+
+std::vector<int64_t> read_integers(const FJsonObject& object, const TCHAR* field)
+{
+    const TArray<TSharedPtr<FJsonValue>>* values = nullptr;
+    if (!object.TryGetArrayField(field, values)) {
+        std::stringstream ss;
+        ss << "Safetensors entry without " << TCHAR_TO_UTF8(field);
+        throw std::runtime_error(ss.str());
+    }
+
+    std::vector<int64_t> result;
+    result.reserve(values->Num());
+    for (const auto& value : *values) {
+        result.push_back(static_cast<int64_t>(value->AsNumber()));
+    }
+    return result;
+}
+
+}
+
+
+LlamaSafetensors::LlamaSafetensors(const std::string& path)
+    : file(std::make_shared<LlamaMappedFile>())
+{
+    IPlatformFile& platform_file = FPlatformFileManager::Get().GetPlatformFile();
+    file->handle.Reset(platform_file.OpenMapped(UTF8_TO_TCHAR(path.c_str())));
+    if (!file->handle.IsValid()) {
+        std::stringstream ss;
+        ss << "Could not map " << path;
+        throw std::runtime_error(ss.str());
+    }
+
+    const int64_t file_size = file->handle->GetFileSize();
+    if (file_size < 8) {
+        std::stringstream ss;
+        ss << path << " is too small to be a safetensors file";
+        throw std::runtime_error(ss.str());
+    }
+
+    file->region.Reset(file->handle->MapRegion(0, file_size));
+    if (!file->region.IsValid()) {
+        std::stringstream ss;
+        ss << "Could not map " << path;
+        throw std::runtime_error(ss.str());
+    }
+    const uint8_t* bytes = file->region->GetMappedPtr();
+
+    // little endian header size, then the json header, then the tensor data
+    uint64_t header_size = 0;
+    std::memcpy(&header_size, bytes, sizeof(header_size));
+    if (header_size > static_cast<uint64_t>(file_size - 8)) {
+        std::stringstream ss;
+        ss << path << " declares a header of " << header_size << " bytes, larger than the file";
+        throw std::runtime_error(ss.str());
+    }
+    data = bytes + 8 + header_size;
+    data_size = file_size - 8 - static_cast<int64_t>(header_size);
+
+    const FUTF8ToTCHAR converter(reinterpret_cast<const ANSICHAR*>(bytes + 8), static_cast<int32>(header_size));
+    const FString header(converter.Length(), converter.Get());
+
+    TSharedPtr<FJsonObject> root;
+    const auto reader = TJsonReaderFactory<>::Create(header);
+    if (!FJsonSerializer::Deserialize(reader, root) || !root.IsValid()) {
+        std::stringstream ss;
+        ss << "Could not parse the header of " << path;
+        throw std::runtime_error(ss.str());
+    }
+
+    for (const auto& pair : root->Values) {
+        if (pair.Key == TEXT("__metadata__")) {
+            continue;
+        }
+
+        const std::string key = TCHAR_TO_UTF8(*pair.Key);
+        const TSharedPtr<FJsonObject>* object = nullptr;
+        FString dtype;
+        if (!pair.Value->TryGetObject(object) || !(*object)->TryGetStringField(TEXT("dtype"), dtype)) {
+            std::stringstream ss;
+            ss << "Malformed safetensors entry " << key;
+            throw std::runtime_error(ss.str());
+        }
+
+        Entry entry;
+        entry.dtype = parse_dtype(TCHAR_TO_UTF8(*dtype));
+        entry.shape = read_integers(**object, TEXT("shape"));
+
+        const auto offsets = read_integers(**object, TEXT("data_offsets"));
+        if (offsets.size() != 2) {
+            std::stringstream ss;
+            ss << "Safetensors entry " << key << " needs two data offsets";
+            throw std::runtime_error(ss.str());
+        }
+        entry.begin = offsets[0];
+        entry.end = offsets[1];
+
+        int64_t numel = 1;
+        for (const int64_t size : entry.shape) {
+            numel *= size;
+        }
+        const int64_t expected = numel * static_cast<int64_t>(c10::elementSize(entry.dtype));
+        if (entry.begin < 0 || entry.end > data_size || entry.end - entry.begin != expected) {
+            std::stringstream ss;
+            ss << "Safetensors entry " << key << " spans bytes [" << entry.begin << ", " << entry.end
+               << "), expected " << expected << " bytes within " << data_size;
+            throw std::runtime_error(ss.str());
+        }
+
+        entries.emplace(key, std::move(entry));
+    }
+}
+
+
+std::vector<std::string> LlamaSafetensors::keys() const
+{
+    std::vector<std::string> result;
+    result.reserve(entries.size());
+    for (const auto& [key, entry] : entries) {
+        result.push_back(key);
+    }
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
+
+bool LlamaSafetensors::contains(const std::string& key) const
+{
+    return entries.find(key) != entries.end();
+}
+
+
+torch::Tensor LlamaSafetensors::get(const std::string& key, c10::optional<torch::ScalarType> dtype) const
+{
+    auto it = entries.find(key);
+    if (it == entries.end()) {
+        std::stringstream ss;
+        ss << "No tensor " << key << " in the safetensors file";
+        throw std::out_of_range(ss.str());
+    }
+
+    const Entry& entry = it->second;
+    const uint8_t* source = data + entry.begin;
+    auto options = torch::TensorOptions().dtype(entry.dtype);
+
+    torch::Tensor tensor;
+    if (reinterpret_cast<uintptr_t>(source) % c10::elementSize(entry.dtype) == 0) {
+        // the tensor keeps the mapping alive
+        auto keep_alive = file;
+        tensor = torch::from_blob(const_cast<uint8_t*>(source), entry.shape, [keep_alive](void*) {}, options);
+    } else {
+        tensor = torch::empty(entry.shape, options);
+        std::memcpy(tensor.data_ptr(), source, entry.end - entry.begin);
+    }
+
+    if (dtype.has_value() && *dtype != entry.dtype) {
+        tensor = tensor.to(*dtype);
+    }
+    return tensor;
+}
+
+
+std::vector<std::string> LlamaSafetensors::load_into(torch::nn::Module& module, bool parallel) const
+{
+    torch::NoGradGuard no_grad;
+
+    // the mapped pages are read only, writing to them through a parameter would crash instead of throwing
+    const bool training = module.is_training();
+
+    // in registration order, so the tensors of a decoder layer sit next to each other
+    std::vector<std::pair<std::string, torch::Tensor>> targets;
+    for (auto& item : module.named_parameters(true)) {
+        targets.emplace_back(item.key(), item.value());
+    }
+    for (auto& item : module.named_buffers(true)) {
+        targets.emplace_back(item.key(), item.value());
+    }
+
+    std::vector<std::string> missing;
+
+    // one decoder layer at a time, conversions and device copies never hold more than a layer in flight
+    size_t begin = 0;
+    while (begin < targets.size()) {
+        const std::string group = layer_prefix(targets[begin].first);
+        size_t end = begin + 1;
+        while (end < targets.size() && layer_prefix(targets[end].first) == group) {
+            ++end;
+        }
+
+        std::vector<torch::Tensor> loaded(end - begin);
+        auto read = [&](int64_t first, int64_t last) {
+            for (int64_t i = first; i < last; ++i) {
+                const auto& [name, target] = targets[i];
+                if (contains(name)) {
+                    loaded[i - begin] = read_into(name, target);
+                    if (training && is_mapped(loaded[i - begin])) {
+                        loaded[i - begin] = loaded[i - begin].clone();
+                    }
+                }
+            }
+        };
+
+        // the tensors of a layer are independent, so their reads and conversions overlap
+        if (parallel) {
+            at::parallel_for(static_cast<int64_t>(begin), static_cast<int64_t>(end), 1, read);
+        } else {
+            read(static_cast<int64_t>(begin), static_cast<int64_t>(end));
+        }
+
+        for (size_t i = begin; i < end; ++i) {
+            if (loaded[i - begin].defined()) {
+                targets[i].second.set_data(loaded[i - begin]);
+                if (is_mapped(loaded[i - begin])) {
+                    targets[i].second.requires_grad_(false);
+                }
+            } else {
+                missing.push_back(targets[i].first);
+            }
+        }
+        begin = end;
+    }
+
+    return missing;
+}
+
+
+torch::Tensor LlamaSafetensors::read_into(const std::string& name, const torch::Tensor& target) const
+{
+    auto tensor = get(name, target.scalar_type());
+
+    // empty placeholders take whatever shape is stored
+    if (target.numel() != 0 && target.sizes() != tensor.sizes()) {
+        std::stringstream ss;
+        ss << "Tensor " << name << " is stored as " << tensor.sizes() << " but the module expects " << target.sizes();
+        throw std::runtime_error(ss.str());
+    }
+
+    if (tensor.device() != target.device()) {
+        tensor = tensor.to(target.device());
+    }
+    return tensor;
+}
+
+
+bool LlamaSafetensors::is_mapped(const torch::Tensor& tensor) const
+{
+    const auto* ptr = static_cast<const uint8_t*>(tensor.data_ptr());
+    return ptr >= data && ptr < data + data_size;
+}
+
+
+void load_safetensors(torch::nn::Module& module, const std::string& path, bool parallel)
+{
+    std::vector<std::filesystem::path> files;
+    const std::filesystem::path root(path);
+    if (std::filesystem::is_directory(root)) {
+        for (const auto& item : std::filesystem::directory_iterator(root)) {
+            if (item.is_regular_file() && item.path().extension() == ".safetensors") {
+                files.push_back(item.path());
+            }
+        }
+        std::sort(files.begin(), files.end());
+    } else {
+        files.push_back(root);
+    }
+
+    if (files.empty()) {
+        std::stringstream ss;
+        ss << "No .safetensors files in " << path;
+        throw std::invalid_argument(ss.str());
+    }
+
+    // a tensor is missing only if no shard holds it
+    std::set<std::string> missing;
+    bool first = true;
+    for (const auto& file : files) {
+        auto file_missing = LlamaSafetensors(file.string()).load_into(module, parallel);
+        std::set<std::string> file_set(file_missing.begin(), file_missing.end());
+        if (first) {
+            missing = std::move(file_set);
+            first = false;
+        } else {
+            std::set<std::string> still_missing;
+            std::set_intersection(
+                missing.begin(), missing.end(),
+                file_set.begin(), file_set.end(),
+                std::inserter(still_missing, still_missing.begin()));
+            missing = std::move(still_missing);
+        }
+    }
+
+    if (!missing.empty()) {
+        std::stringstream ss;
+        ss << missing.size() << " tensors are missing from " << path << ", the first is " << *missing.begin();
+        throw std::runtime_error(ss.str());
+    }
+}
+
+
+
+void save_safetensors(const torch::nn::Module& module, const std::string& path)
+{
+    std::vector<std::pair<std::string, torch::Tensor>> tensors;
+    for (const auto& item : module.named_parameters(true)) {
+        tensors.emplace_back(item.key(), item.value());
+    }
+    for (const auto& item : module.named_buffers(true)) {
+        tensors.emplace_back(item.key(), item.value());
+    }
+
+    // module names are plain identifiers, nothing in them needs escaping
+    std::stringstream header;
+    header << "{";
+    int64_t offset = 0;
+    for (size_t i = 0; i < tensors.size(); ++i) {
+        const auto& [name, tensor] = tensors[i];
+        const int64_t bytes = tensor.numel() * static_cast<int64_t>(tensor.element_size());
+        header << (i == 0 ? "" : ",") << "\"" << name << "\":{\"dtype\":\"" << dtype_name(tensor.scalar_type()) << "\",\"shape\":[";
+        for (int64_t d = 0; d < tensor.dim(); ++d) {
+            header << (d == 0 ? "" : ",") << tensor.size(d);
+        }
+        header << "],\"data_offsets\":[" << offset << "," << offset + bytes << "]}";
+        offset += bytes;
+    }
+    header << "}";
+
+    // padded so the data starts 8 byte aligned
+    std::string header_text = header.str();
+    header_text.append((8 - header_text.size() % 8) % 8, ' ');
+
+    std::ofstream output(path, std::ios::binary);
+    const uint64_t header_size = header_text.size();
+    output.write(reinterpret_cast<const char*>(&header_size), sizeof(header_size));
+    output.write(header_text.data(), static_cast<std::streamsize>(header_text.size()));
+
+    // one tensor at a time, so only one is ever copied off the device
+    for (const auto& [name, tensor] : tensors) {
+        auto data = tensor.detach().to(torch::kCPU).contiguous();
+        output.write(static_cast<const char*>(data.data_ptr()), static_cast<std::streamsize>(data.nbytes()));
+    }
+
+    if (!output) {
+        std::stringstream ss;
+        ss << "Could not write " << path;
+        throw std::runtime_error(ss.str());
+    }
+}
\ No newline at end of file
@@ -0,0 +1,243 @@
+#include "Models/Llama/llama_sampling.h"
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <stdexcept>
+#include <unordered_map>
+
+
+LlamaSampler::LlamaSampler(const LlamaSamplingOptions& options, int64_t eos_token_id)
+    : options(options),
+    stop_tokens(options.stop_token_ids),
+    generator(options.seed.has_value() ? options.seed.value() : std::random_device{}())
+{
+    if (!options.ignore_eos) {
+        stop_tokens.push_back(eos_token_id);
+    }
+}
+
+
+int64_t LlamaSampler::sample(const torch::Tensor& logits, const std::vector<int64_t>& history)
+{
+    return sample(logits, history.data(), static_cast<int64_t>(history.size()));
+}
+
+
+int64_t LlamaSampler::sample(const torch::Tensor& logits, const int64_t* history, int64_t history_length)
+{
+    load_scores(logits);
+    apply_penalties(history, history_length);
+
+    if (!options.do_sample || options.temperature <= 0.0) {
+        return argmax();
+    }
+
+    if (options.temperature != 1.0) {
+        const float inv_temperature = static_cast<float>(1.0 / options.temperature);
+        for (auto& score : scores) {
+            score *= inv_temperature;
+        }
+    }
+
+    select_candidates();
+    return draw();
+}
+
+
+std::vector<float> LlamaSampler::distribution(const torch::Tensor& logits, const int64_t* history, int64_t history_length)
+{
+    load_scores(logits);
+    apply_penalties(history, history_length);
+
+    std::vector<float> dense(scores.size(), 0.0f);
+    if (!options.do_sample || options.temperature <= 0.0) {
+        dense[argmax()] = 1.0f;
+        return dense;
+    }
+
+    if (options.temperature != 1.0) {
+        const float inv_temperature = static_cast<float>(1.0 / options.temperature);
+        for (auto& score : scores) {
+            score *= inv_temperature;
+        }
+    }
+
+    select_candidates();
+    const double total = std::accumulate(probs.begin(), probs.end(), 0.0);
+    for (size_t i = 0; i < candidates.size(); ++i) {
+        dense[candidates[i]] = static_cast<float>(probs[i] / total);
+    }
+    return dense;
+}
+
+
+int64_t LlamaSampler::draw(const std::vector<float>& weights)
+{
+    const double total = std::accumulate(weights.begin(), weights.end(), 0.0);
+    double threshold = uniform() * total;
+
+    int64_t last = 0;
+    for (size_t i = 0; i < weights.size(); ++i) {
+        if (weights[i] <= 0.0f) {
+            continue;
+        }
+        last = static_cast<int64_t>(i);
+        threshold -= weights[i];
+        if (threshold <= 0.0) {
+            return last;
+        }
+    }
+    return last;
+}
+
+
+double LlamaSampler::uniform()
+{
+    return std::uniform_real_distribution<double>(0.0, 1.0)(generator);
+}
+
+
+bool LlamaSampler::is_stop_token(int64_t token) const
+{
+    return std::find(stop_tokens.begin(), stop_tokens.end(), token) != stop_tokens.end();
+}
+
+
+const LlamaSamplingOptions& LlamaSampler::get_options() const
+{
+    return options;
+}
+
+
+void LlamaSampler::load_scores(const torch::Tensor& logits)
+{
+    auto row = logits.detach().to(torch::kCPU, torch::kFloat32).contiguous().view(-1);
+    const float* data = row.data_ptr<float>();
+    scores.assign(data, data + row.numel());
+}
+
+
+void LlamaSampler::apply_penalties(const int64_t* history, int64_t history_length)
+{
+    const bool repetition = options.repetition_penalty != 1.0;
+    const bool frequency = options.frequency_penalty != 0.0 || options.presence_penalty != 0.0;
+    if (history_length == 0 || (!repetition && !frequency)) {
+        return;
+    }
+
+    std::unordered_map<int64_t, int64_t> counts;
+    counts.reserve(static_cast<size_t>(history_length));
+    for (int64_t i = 0; i < history_length; ++i) {
+        ++counts[history[i]];
+    }
+
+    const auto vocab = static_cast<int64_t>(scores.size());
+    const auto penalty = static_cast<float>(options.repetition_penalty);
+    for (const auto& [token, count] : counts) {
+        if (token < 0 || token >= vocab) {
+            continue;
+        }
+
+        float& score = scores[token];
+        if (repetition) {
+            score = score > 0.0f ? score / penalty : score * penalty;
+        }
+        score -= static_cast<float>(options.frequency_penalty * count + options.presence_penalty);
+    }
+}
+
+
+int64_t LlamaSampler::argmax() const
+{
+    return std::distance(scores.begin(), std::max_element(scores.begin(), scores.end()));
+}
+
+
+void LlamaSampler::select_candidates()
+{
+    const auto vocab = static_cast<int64_t>(scores.size());
+    const float max_score = *std::max_element(scores.begin(), scores.end());
+
+    candidates.resize(vocab);
+    std::iota(candidates.begin(), candidates.end(), 0);
+
+    const int64_t top_k = options.top_k > 0 ? std::min(options.top_k, vocab) : vocab;
+    const bool use_top_p = options.top_p < 1.0;
+
+    // plain multinomial over the whole vocabulary
+    if (top_k == vocab && !use_top_p) {
+        probs.resize(vocab);
+        for (int64_t i = 0; i < vocab; ++i) {
+            probs[i] = std::exp(scores[i] - max_score);
+        }
+        return;
+    }
+
+    auto by_score = [this](int64_t a, int64_t b) { return scores[a] > scores[b]; };
+
+    // without top_k, grow the sorted head until it covers top_p of the mass
+    double total = 0.0;
+    int64_t num_sorted = 0;
+    int64_t num_wanted = top_k;
+    if (use_top_p && options.top_k <= 0) {
+        for (const float score : scores) {
+            total += std::exp(score - max_score);
+        }
+        num_wanted = std::min<int64_t>(64, vocab);
+    }
+
+    double head_mass = 0.0;
+    while (true) {
+        if (num_wanted < vocab) {
+            std::nth_element(candidates.begin() + num_sorted, candidates.begin() + num_wanted, candidates.end(), by_score);
+        }
+        std::sort(candidates.begin() + num_sorted, candidates.begin() + num_wanted, by_score);
+
+        for (int64_t i = num_sorted; i < num_wanted; ++i) {
+            head_mass += std::exp(scores[candidates[i]] - max_score);
+        }
+        num_sorted = num_wanted;
+
+        if (total == 0.0 || num_sorted == vocab || head_mass >= options.top_p * total) {
+            break;
+        }
+        num_wanted = std::min(vocab, num_wanted * 2);
+    }
+    candidates.resize(num_sorted);
+
+    // top_p alone is measured against the whole vocabulary, after top_k against the kept head
+    const double norm = total > 0.0 ? total : head_mass;
+    probs.resize(num_sorted);
+    for (int64_t i = 0; i < num_sorted; ++i) {
+        probs[i] = static_cast<float>(std::exp(scores[candidates[i]] - max_score) / norm);
+    }
+
+    if (use_top_p) {
+        double cumulative = 0.0;
+        int64_t keep = 0;
+        while (keep < num_sorted) {
+            cumulative += probs[keep++];
+            if (cumulative >= options.top_p) {
+                break;
+            }
+        }
+        candidates.resize(keep);
+        probs.resize(keep);
+    }
+}
+
+
+int64_t LlamaSampler::draw()
+{
+    const double total = std::accumulate(probs.begin(), probs.end(), 0.0);
+    std::uniform_real_distribution<double> uniform(0.0, total);
+    double threshold = uniform(generator);
+
+    for (size_t i = 0; i < probs.size(); ++i) {
+        threshold -= probs[i];
+        if (threshold <= 0.0) {
+            return candidates[i];
+        }
+    }
+    return candidates.back();
+}
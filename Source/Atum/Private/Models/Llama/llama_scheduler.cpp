@@ -0,0 +1,288 @@
+#include "Models/Llama/llama_scheduler.h"
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+
+
+LlamaScheduler::LlamaScheduler(
+    std::shared_ptr<LlamaCausalLMImpl> model,
+    std::shared_ptr<LlamaBlockPool> pool,
+    int64_t max_batch_size)
+    : model(std::move(model)),
+    pool(std::move(pool)),
+    max_batch_size(max_batch_size)
+{
+}
+
+
+int64_t LlamaScheduler::submit(
+    const torch::Tensor& input_ids,
+    int64_t max_new_tokens,
+    const LlamaSamplingOptions& sampling)
+{
+    auto ids = input_ids.to(torch::kCPU, torch::kInt64).contiguous().view(-1);
+    if (ids.numel() == 0) {
+        throw std::invalid_argument("Cannot schedule an empty prompt");
+    }
+
+    // even an empty pool could not hold it, it would wait forever
+    const int64_t needed = blocks_for(ids.numel()) + 1;
+    if (needed > pool->get_num_blocks()) {
+        std::stringstream ss;
+        ss << "A prompt of " << ids.numel() << " tokens needs " << needed << " kv blocks, but the pool only has " << pool->get_num_blocks();
+        throw std::invalid_argument(ss.str());
+    }
+
+    auto sequence = std::make_unique<LlamaSequence>();
+    sequence->id = next_id++;
+    sequence->tokens.assign(ids.data_ptr<int64_t>(), ids.data_ptr<int64_t>() + ids.numel());
+    sequence->prompt_length = ids.numel();
+    sequence->max_new_tokens = max_new_tokens;
+    sequence->cache = std::make_unique<LlamaPagedCache>(model->config, pool);
+    sequence->sampler = std::make_unique<LlamaSampler>(sampling, model->config.eos_token_id);
+
+    const int64_t id = sequence->id;
+    waiting.push_back(std::move(sequence));
+    return id;
+}
+
+
+void LlamaScheduler::step()
+{
+    torch::NoGradGuard no_grad;
+
+    admit();
+    decode();
+    retire_finished();
+}
+
+
+bool LlamaScheduler::has_unfinished() const
+{
+    return !waiting.empty() || !running.empty();
+}
+
+
+bool LlamaScheduler::is_finished(int64_t id) const
+{
+    return finished.count(id) > 0;
+}
+
+
+torch::Tensor LlamaScheduler::take_result(int64_t id)
+{
+    auto it = finished.find(id);
+    if (it == finished.end()) {
+        throw std::invalid_argument("Request has not finished");
+    }
+
+    if (!it->second->error.empty()) {
+        const std::string error = it->second->error;
+        finished.erase(it);
+        throw std::runtime_error(error);
+    }
+
+    const auto& tokens = it->second->tokens;
+    auto result = torch::tensor(tokens, torch::TensorOptions().dtype(torch::kInt64)).unsqueeze(0);
+    finished.erase(it);
+    return result;
+}
+
+
+void LlamaScheduler::cancel(int64_t id)
+{
+    auto matches = [id](const std::unique_ptr<LlamaSequence>& sequence) { return sequence->id == id; };
+    waiting.erase(std::remove_if(waiting.begin(), waiting.end(), matches), waiting.end());
+    running.erase(std::remove_if(running.begin(), running.end(), matches), running.end());
+    finished.erase(id);
+}
+
+
+int64_t LlamaScheduler::get_num_running() const
+{
+    return static_cast<int64_t>(running.size());
+}
+
+
+int64_t LlamaScheduler::get_num_waiting() const
+{
+    return static_cast<int64_t>(waiting.size());
+}
+
+
+int64_t LlamaScheduler::blocks_for(int64_t num_tokens) const
+{
+    const int64_t block_size = pool->get_block_size();
+    return (num_tokens + block_size - 1) / block_size;
+}
+
+
+void LlamaScheduler::admit()
+{
+    while (!waiting.empty() && static_cast<int64_t>(running.size()) < max_batch_size) {
+        auto& candidate = waiting.front();
+
+        // keep a block of headroom for the first decode steps, submit made sure the whole pool has it
+        const int64_t needed = blocks_for(static_cast<int64_t>(candidate->tokens.size())) + 1;
+
+        // wait until running sequences or sessions hand back enough blocks
+        if (pool->get_num_free_blocks() < needed) {
+            break;
+        }
+
+        auto sequence = std::move(candidate);
+        waiting.pop_front();
+
+        try {
+            prefill(*sequence);
+        } catch (const std::exception& exception) {
+            // the request fails on its own, the running sequences still decode this step
+            sequence->cache->reset();
+            sequence->error = exception.what();
+            finished[sequence->id] = std::move(sequence);
+            continue;
+        }
+
+        if (should_stop(*sequence)) {
+            sequence->cache->reset();
+            finished[sequence->id] = std::move(sequence);
+        } else {
+            running.push_back(std::move(sequence));
+        }
+    }
+}
+
+
+void LlamaScheduler::prefill(LlamaSequence& sequence)
+{
+    const auto device = pool->key_blocks(0).device();
+    auto input_ids = torch::tensor(sequence.tokens, torch::TensorOptions().dtype(torch::kInt64))
+        .unsqueeze(0)
+        .to(device);
+
+    auto outputs = model->forward(
+        input_ids,
+        {},
+        {},
+        {},
+        {},
+        {},
+        false,
+        false,
+        true,
+        sequence.cache.get(),
+        1);
+
+    auto next_logits = std::get<0>(outputs).index({0, -1});
+    sequence.tokens.push_back(sequence.sampler->sample(next_logits, sequence.tokens));
+}
+
+
+void LlamaScheduler::decode()
+{
+    preempt_until_fits();
+    if (running.empty()) {
+        return;
+    }
+
+    const int64_t batch_size = static_cast<int64_t>(running.size());
+    const auto device = pool->key_blocks(0).device();
+
+    // every running sequence feeds its last token, which is not cached yet
+    std::vector<LlamaCache*> caches;
+    std::vector<int64_t> last_tokens;
+    std::vector<int64_t> lengths;
+    caches.reserve(batch_size);
+    last_tokens.reserve(batch_size);
+    lengths.reserve(batch_size);
+
+    for (auto& sequence : running) {
+        caches.push_back(sequence->cache.get());
+        last_tokens.push_back(sequence->tokens.back());
+        lengths.push_back(sequence->cache->get_seq_length());
+    }
+
+    auto options = torch::TensorOptions().dtype(torch::kInt64);
+    auto input_ids = torch::tensor(last_tokens, options).unsqueeze(1).to(device);
+    auto length_tensor = torch::tensor(lengths, options).to(device);
+
+    // rows hold different lengths, so positions and padding are given explicitly
+    // [bsz, 1]
+    auto position_ids = length_tensor.unsqueeze(1);
+
+    // [bsz, longest + 1], ones over the cached tokens and the new one
+    const int64_t max_length = *std::max_element(lengths.begin(), lengths.end());
+    auto attention_mask = (torch::arange(max_length + 1, options.device(device)).unsqueeze(0)
+        <= length_tensor.unsqueeze(1)).to(torch::kInt64);
+
+    LlamaBatchCache batch_cache(caches);
+    auto outputs = model->forward(
+        input_ids,
+        attention_mask,
+        position_ids,
+        {},
+        {},
+        {},
+        false,
+        false,
+        true,
+        &batch_cache);
+
+    // [bsz, 1, vocab] -> [bsz, vocab]
+    auto next_logits = std::get<0>(outputs).select(1, 0).to(torch::kCPU);
+    for (int64_t i = 0; i < batch_size; ++i) {
+        auto& sequence = *running[i];
+        sequence.tokens.push_back(sequence.sampler->sample(next_logits[i], sequence.tokens));
+    }
+}
+
+
+void LlamaScheduler::preempt_until_fits()
+{
+    while (!running.empty()) {
+        int64_t needed = 0;
+        for (const auto& sequence : running) {
+            const int64_t length = sequence->cache->get_seq_length() + 1;
+            needed += blocks_for(length) - static_cast<int64_t>(sequence->cache->get_block_table().size());
+        }
+        if (needed <= pool->get_num_free_blocks()) {
+            return;
+        }
+
+        // recompute the newest sequence later, prompt and generated tokens included
+        auto sequence = std::move(running.back());
+        running.pop_back();
+        sequence->cache->reset();
+        waiting.push_front(std::move(sequence));
+    }
+}
+
+
+void LlamaScheduler::retire_finished()
+{
+    for (auto& sequence : running) {
+        if (should_stop(*sequence)) {
+            sequence->cache->reset();
+            const int64_t id = sequence->id;
+            finished[id] = std::move(sequence);
+        }
+    }
+    running.erase(
+        std::remove_if(running.begin(), running.end(), [](const std::unique_ptr<LlamaSequence>& sequence) { return !sequence; }),
+        running.end());
+}
+
+
+bool LlamaScheduler::should_stop(const LlamaSequence& sequence) const
+{
+    if (sequence.num_generated() >= sequence.max_new_tokens) {
+        return true;
+    }
+
+    if (sequence.num_generated() > 0 && sequence.sampler->is_stop_token(sequence.tokens.back())) {
+        return true;
+    }
+
+    // the last token still has to fit into the cache
+    return static_cast<int64_t>(sequence.tokens.size()) >= sequence.cache->get_max_length();
+}
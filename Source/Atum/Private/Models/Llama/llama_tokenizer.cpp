@@ -0,0 +1,800 @@
+#include "Models/Llama/llama_tokenizer.h"
+
+#include "Dom/JsonObject.h"
+#include "Misc/FileHelper.h"
+#include "Serialization/JsonReader.h"
+#include "Serialization/JsonSerializer.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <numeric>
+#include <queue>
+#include <sstream>
+#include <stdexcept>
+
+
+namespace {
+
+// "▁", what sentencepiece writes spaces as
+constexpr std::string_view space_piece = "\xE2\x96\x81";
+
+int64_t utf8_length(unsigned char lead)
+{
+    if (lead < 0x80) return 1;
+    if ((lead >> 5) == 0x6) return 2;
+    if ((lead >> 4) == 0xE) return 3;
+    if ((lead >> 3) == 0x1E) return 4;
+
+    // stray continuation or invalid byte, taken on its own
+    return 1;
+}
+
+
+// length of the longest prefix of text that does not end inside a utf-8 character
+size_t complete_utf8_prefix(const std::string& text)
+{
+    const size_t size = text.size();
+    for (size_t back = 1; back <= 4 && back <= size; ++back) {
+        const auto byte = static_cast<unsigned char>(text[size - back]);
+        if ((byte & 0xC0) == 0x80) {
+            continue;
+        }
+        return static_cast<int64_t>(back) < utf8_length(byte) ? size - back : size;
+    }
+    return size;
+}
+
+
+uint64_t pair_key(int32_t left, int32_t right)
+{
+    return (static_cast<uint64_t>(static_cast<uint32_t>(left)) << 32) | static_cast<uint32_t>(right);
+}
+
+
+// value of a "<0xXX>" byte piece, -1 for anything else
+int32_t byte_piece_value(const std::string& piece)
+{
+    if (piece.size() != 6 || piece.compare(0, 3, "<0x") != 0 || piece[5] != '>') {
+        return -1;
+    }
+
+    int32_t value = 0;
+    for (size_t i = 3; i < 5; ++i) {
+        const char c = piece[i];
+        value <<= 4;
+        if (c >= '0' && c <= '9') value |= c - '0';
+        else if (c >= 'A' && c <= 'F') value |= c - 'A' + 10;
+        else if (c >= 'a' && c <= 'f') value |= c - 'a' + 10;
+        else return -1;
+    }
+    return value;
+}
+
+
+// just enough of the protobuf wire format for sentencepiece models
+struct ProtoReader {
+    const uint8_t* position;
+    const uint8_t* end;
+
+    bool done() const
+    {
+        return position >= end;
+    }
+
+    uint64_t varint()
+    {
+        uint64_t value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            if (position >= end) {
+                throw std::runtime_error("Truncated sentencepiece model");
+            }
+            const uint8_t byte = *position++;
+            value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+            if ((byte & 0x80) == 0) {
+                return value;
+            }
+        }
+        throw std::runtime_error("Malformed varint in sentencepiece model");
+    }
+
+    ProtoReader bytes()
+    {
+        const uint64_t size = varint();
+        if (size > static_cast<uint64_t>(end - position)) {
+            throw std::runtime_error("Truncated sentencepiece model");
+        }
+        ProtoReader field{position, position + size};
+        position += size;
+        return field;
+    }
+
+    float fixed32()
+    {
+        float value = 0.0f;
+        const uint8_t* source = position;
+        advance(sizeof(value));
+        std::memcpy(&value, source, sizeof(value));
+        return value;
+    }
+
+    void skip(uint64_t wire_type)
+    {
+        switch (wire_type) {
+        case 0: varint(); break;
+        case 1: advance(8); break;
+        case 2: bytes(); break;
+        case 5: advance(4); break;
+        default: throw std::runtime_error("Unsupported wire type in sentencepiece model");
+        }
+    }
+
+    void advance(int64_t size)
+    {
+        if (end - position < size) {
+            throw std::runtime_error("Truncated sentencepiece model");
+        }
+        position += size;
+    }
+};
+
+
+std::string to_utf8(const FString& text)
+{
+    return std::string(TCHAR_TO_UTF8(*text));
+}
+
+
+// object itself when it has the given "type", otherwise the first such entry of its sequences
+const FJsonObject* find_component(const TSharedPtr<FJsonObject>& object, const TCHAR* type)
+{
+    if (!object.IsValid()) {
+        return nullptr;
+    }
+
+    FString name;
+    if (object->TryGetStringField(TEXT("type"), name) && name == type) {
+        return object.Get();
+    }
+
+    static const TCHAR* const sequences[] = {TEXT("normalizers"), TEXT("pretokenizers")};
+    for (const TCHAR* field : sequences) {
+        const TArray<TSharedPtr<FJsonValue>>* children = nullptr;
+        if (!object->TryGetArrayField(field, children)) {
+            continue;
+        }
+        for (const auto& child : *children) {
+            const TSharedPtr<FJsonObject>* child_object = nullptr;
+            if (child->TryGetObject(child_object)) {
+                if (const FJsonObject* found = find_component(*child_object, type)) {
+                    return found;
+                }
+            }
+        }
+    }
+    return nullptr;
+}
+
+
+TSharedPtr<FJsonObject> object_field(const FJsonObject& object, const TCHAR* field)
+{
+    const TSharedPtr<FJsonObject>* child = nullptr;
+    return object.TryGetObjectField(field, child) ? *child : TSharedPtr<FJsonObject>();
+}
+
+}
+
+
+LlamaTokenizer::LlamaTokenizer(const std::string& path)
+{
+    const bool json = path.size() >= 5 && path.compare(path.size() - 5, 5, ".json") == 0;
+    if (json) {
+        read_json(path);
+    } else {
+        read_model(path);
+    }
+}
+
+
+void LlamaTokenizer::read_model(const std::string& path)
+{
+    std::ifstream input(path, std::ios::binary);
+    if (!input) {
+        std::stringstream ss;
+        ss << "Could not open " << path;
+        throw std::runtime_error(ss.str());
+    }
+    const std::vector<uint8_t> file((std::istreambuf_iterator<char>(input)), std::istreambuf_iterator<char>());
+
+    std::vector<float> scores;
+    int64_t model_type = 1;
+    bos_id = 1;
+    eos_id = 2;
+    unk_id = 0;
+    add_dummy_prefix = true;
+    remove_extra_whitespaces = true;
+
+    ProtoReader model{file.data(), file.data() + file.size()};
+    while (!model.done()) {
+        const uint64_t tag = model.varint();
+        const uint64_t field = tag >> 3;
+        const uint64_t wire_type = tag & 7;
+
+        // repeated SentencePiece pieces = 1
+        if (field == 1 && wire_type == 2) {
+            ProtoReader entry = model.bytes();
+            std::string piece;
+            float score = 0.0f;
+            PieceType type = PieceType::Normal;
+            while (!entry.done()) {
+                const uint64_t entry_tag = entry.varint();
+                if (entry_tag == (1 << 3 | 2)) {
+                    ProtoReader text = entry.bytes();
+                    piece.assign(text.position, text.end);
+                } else if (entry_tag == (2 << 3 | 5)) {
+                    score = entry.fixed32();
+                } else if (entry_tag == (3 << 3 | 0)) {
+                    // NORMAL = 1, UNKNOWN = 2, CONTROL = 3, USER_DEFINED = 4, UNUSED = 5, BYTE = 6
+                    switch (entry.varint()) {
+                    case 2: type = PieceType::Unknown; break;
+                    case 3: type = PieceType::Control; break;
+                    case 4: type = PieceType::UserDefined; break;
+                    case 5: type = PieceType::Unused; break;
+                    case 6: type = PieceType::Byte; break;
+                    default: type = PieceType::Normal; break;
+                    }
+                } else {
+                    entry.skip(entry_tag & 7);
+                }
+            }
+            pieces.push_back(std::move(piece));
+            scores.push_back(score);
+            types.push_back(type);
+
+        // TrainerSpec trainer_spec = 2
+        } else if (field == 2 && wire_type == 2) {
+            ProtoReader spec = model.bytes();
+            while (!spec.done()) {
+                const uint64_t spec_tag = spec.varint();
+                if ((spec_tag & 7) != 0) {
+                    spec.skip(spec_tag & 7);
+                    continue;
+                }
+
+                // ids are int32, -1 arrives sign extended to 64 bits
+                const auto value = static_cast<int64_t>(spec.varint());
+                switch (spec_tag >> 3) {
+                case 3: model_type = value; break;
+                case 35: byte_fallback = value != 0; break;
+                case 40: unk_id = static_cast<int32_t>(value); break;
+                case 41: bos_id = static_cast<int32_t>(value); break;
+                case 42: eos_id = static_cast<int32_t>(value); break;
+                default: break;
+                }
+            }
+
+        // NormalizerSpec normalizer_spec = 3
+        } else if (field == 3 && wire_type == 2) {
+            ProtoReader spec = model.bytes();
+            while (!spec.done()) {
+                const uint64_t spec_tag = spec.varint();
+                if (spec_tag == (3 << 3 | 0)) {
+                    add_dummy_prefix = spec.varint() != 0;
+                } else if (spec_tag == (4 << 3 | 0)) {
+                    remove_extra_whitespaces = spec.varint() != 0;
+                } else {
+                    spec.skip(spec_tag & 7);
+                }
+            }
+        } else {
+            model.skip(wire_type);
+        }
+    }
+
+    // UNIGRAM = 1, BPE = 2
+    if (model_type != 2) {
+        std::stringstream ss;
+        ss << path << " is not a BPE sentencepiece model";
+        throw std::invalid_argument(ss.str());
+    }
+    if (pieces.empty()) {
+        std::stringstream ss;
+        ss << path << " holds no pieces";
+        throw std::runtime_error(ss.str());
+    }
+
+    index_pieces();
+
+    // pairs merge in the order of the score of the piece they form
+    std::vector<int32_t> order(pieces.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&scores](int32_t a, int32_t b) { return scores[a] > scores[b]; });
+
+    for (size_t rank = 0; rank < order.size(); ++rank) {
+        const int32_t id = order[rank];
+        if (types[id] != PieceType::Normal && types[id] != PieceType::UserDefined) {
+            continue;
+        }
+
+        const std::string_view piece = pieces[id];
+        for (size_t split = utf8_length(piece[0]); split < piece.size(); split += utf8_length(piece[split])) {
+            const auto left = piece_ids.find(piece.substr(0, split));
+            const auto right = piece_ids.find(piece.substr(split));
+            if (left != piece_ids.end() && right != piece_ids.end()) {
+                add_merge(left->second, right->second, id, static_cast<int32_t>(rank));
+            }
+        }
+    }
+}
+
+
+void LlamaTokenizer::read_json(const std::string& path)
+{
+    FString text;
+    if (!FFileHelper::LoadFileToString(text, UTF8_TO_TCHAR(path.c_str()))) {
+        std::stringstream ss;
+        ss << "Could not read " << path;
+        throw std::runtime_error(ss.str());
+    }
+
+    TSharedPtr<FJsonObject> root;
+    const auto reader = TJsonReaderFactory<>::Create(text);
+    if (!FJsonSerializer::Deserialize(reader, root) || !root.IsValid()) {
+        std::stringstream ss;
+        ss << "Could not parse " << path;
+        throw std::runtime_error(ss.str());
+    }
+
+    const TSharedPtr<FJsonObject> model = object_field(*root, TEXT("model"));
+    FString model_type;
+    if (!model.IsValid() || (model->TryGetStringField(TEXT("type"), model_type) && model_type != TEXT("BPE"))) {
+        std::stringstream ss;
+        ss << path << " does not hold a BPE model";
+        throw std::invalid_argument(ss.str());
+    }
+
+    const TSharedPtr<FJsonObject> pre_tokenizer = object_field(*root, TEXT("pre_tokenizer"));
+    if (find_component(pre_tokenizer, TEXT("ByteLevel"))) {
+        std::stringstream ss;
+        ss << path << " is a byte level tokenizer, only sentencepiece style ones are supported";
+        throw std::invalid_argument(ss.str());
+    }
+
+    // older files prepend "▁" in the normalizer, newer ones through a Metaspace pre tokenizer
+    add_dummy_prefix = find_component(object_field(*root, TEXT("normalizer")), TEXT("Prepend")) != nullptr;
+    if (const FJsonObject* metaspace = find_component(pre_tokenizer, TEXT("Metaspace"))) {
+        FString scheme;
+        bool add_prefix_space = false;
+        add_dummy_prefix = (metaspace->TryGetStringField(TEXT("prepend_scheme"), scheme) && scheme != TEXT("never"))
+            || (metaspace->TryGetBoolField(TEXT("add_prefix_space"), add_prefix_space) && add_prefix_space);
+    }
+    remove_extra_whitespaces = false;
+    model->TryGetBoolField(TEXT("byte_fallback"), byte_fallback);
+
+    const TSharedPtr<FJsonObject> vocab = object_field(*model, TEXT("vocab"));
+    if (!vocab.IsValid()) {
+        std::stringstream ss;
+        ss << path << " has no vocabulary";
+        throw std::runtime_error(ss.str());
+    }
+
+    auto set_piece = [this](int64_t id, std::string piece, PieceType type) {
+        if (id < 0) {
+            return;
+        }
+        if (id >= static_cast<int64_t>(pieces.size())) {
+            pieces.resize(id + 1);
+            types.resize(id + 1, PieceType::Unused);
+        }
+        pieces[id] = std::move(piece);
+        types[id] = type;
+    };
+
+    for (const auto& pair : vocab->Values) {
+        std::string piece = to_utf8(pair.Key);
+        const PieceType type = byte_piece_value(piece) >= 0 ? PieceType::Byte : PieceType::Normal;
+        set_piece(static_cast<int64_t>(pair.Value->AsNumber()), std::move(piece), type);
+    }
+
+    // "<s>", "</s>" and the like, added tokens may also extend the vocabulary
+    const TArray<TSharedPtr<FJsonValue>>* added_tokens = nullptr;
+    if (root->TryGetArrayField(TEXT("added_tokens"), added_tokens)) {
+        for (const auto& value : *added_tokens) {
+            const TSharedPtr<FJsonObject>* token = nullptr;
+            int32 id = -1;
+            FString content;
+            bool special = false;
+            if (value->TryGetObject(token) && (*token)->TryGetNumberField(TEXT("id"), id) && (*token)->TryGetStringField(TEXT("content"), content)) {
+                (*token)->TryGetBoolField(TEXT("special"), special);
+                set_piece(id, to_utf8(content), special ? PieceType::Control : PieceType::UserDefined);
+            }
+        }
+    }
+
+    FString unk_token;
+    if (model->TryGetStringField(TEXT("unk_token"), unk_token)) {
+        const std::string unk_piece = to_utf8(unk_token);
+        for (size_t id = 0; id < pieces.size(); ++id) {
+            if (pieces[id] == unk_piece) {
+                types[id] = PieceType::Unknown;
+                unk_id = static_cast<int64_t>(id);
+                break;
+            }
+        }
+    }
+
+    index_pieces();
+    bos_id = token_to_id("<s>");
+    eos_id = token_to_id("</s>");
+
+    // merges are "left right" strings, or [left, right] pairs in newer files
+    const TArray<TSharedPtr<FJsonValue>>* merge_list = nullptr;
+    if (!model->TryGetArrayField(TEXT("merges"), merge_list)) {
+        return;
+    }
+
+    int32_t rank = 0;
+    for (const auto& value : *merge_list) {
+        std::string left;
+        std::string right;
+        FString merge;
+        const TArray<TSharedPtr<FJsonValue>>* parts = nullptr;
+        if (value->TryGetString(merge)) {
+            const std::string text_merge = to_utf8(merge);
+            const size_t split = text_merge.find(' ');
+            if (split == std::string::npos) {
+                continue;
+            }
+            left = text_merge.substr(0, split);
+            right = text_merge.substr(split + 1);
+        } else if (value->TryGetArray(parts) && parts->Num() == 2) {
+            left = to_utf8((*parts)[0]->AsString());
+            right = to_utf8((*parts)[1]->AsString());
+        } else {
+            continue;
+        }
+
+        const int64_t left_id = token_to_id(left);
+        const int64_t right_id = token_to_id(right);
+        const int64_t id = token_to_id(left + right);
+        if (left_id >= 0 && right_id >= 0 && id >= 0) {
+            add_merge(static_cast<int32_t>(left_id), static_cast<int32_t>(right_id), static_cast<int32_t>(id), rank);
+        }
+        ++rank;
+    }
+}
+
+
+void LlamaTokenizer::index_pieces()
+{
+    std::fill(std::begin(byte_ids), std::end(byte_ids), -1);
+    piece_ids.clear();
+    piece_ids.reserve(pieces.size());
+    bytes.assign(pieces.size(), std::string());
+
+    for (size_t id = 0; id < pieces.size(); ++id) {
+        const std::string& piece = pieces[id];
+        if (piece.empty() || types[id] == PieceType::Unused) {
+            continue;
+        }
+        piece_ids.emplace(piece, static_cast<int32_t>(id));
+
+        switch (types[id]) {
+        case PieceType::Byte: {
+            const int32_t value = byte_piece_value(piece);
+            if (value >= 0) {
+                byte_ids[value] = static_cast<int32_t>(id);
+                bytes[id] = std::string(1, static_cast<char>(value));
+            }
+            break;
+        }
+        case PieceType::Normal:
+        case PieceType::UserDefined: {
+            std::string& text = bytes[id];
+            text.reserve(piece.size());
+            for (size_t i = 0; i < piece.size();) {
+                if (piece.compare(i, space_piece.size(), space_piece) == 0) {
+                    text += ' ';
+                    i += space_piece.size();
+                } else {
+                    text += piece[i++];
+                }
+            }
+            break;
+        }
+        default:
+            break;
+        }
+    }
+}
+
+
+void LlamaTokenizer::add_merge(int32_t left, int32_t right, int32_t id, int32_t rank)
+{
+    // the first, best ranked way to form a pair wins
+    merges.emplace(pair_key(left, right), Merge{rank, id});
+}
+
+
+std::string LlamaTokenizer::normalize(const std::string& text) const
+{
+    std::string_view source = text;
+    if (remove_extra_whitespaces) {
+        const size_t first = source.find_first_not_of(' ');
+        source = first == std::string_view::npos ? std::string_view() : source.substr(first, source.find_last_not_of(' ') - first + 1);
+    }
+
+    std::string result;
+    if (source.empty()) {
+        return result;
+    }
+    result.reserve(source.size() + source.size() / 2 + space_piece.size());
+
+    if (add_dummy_prefix) {
+        result += space_piece;
+    }
+    for (size_t i = 0; i < source.size(); ++i) {
+        if (source[i] != ' ') {
+            result += source[i];
+        } else if (!remove_extra_whitespaces || source[i - 1] != ' ') {
+            result += space_piece;
+        }
+    }
+    return result;
+}
+
+
+std::vector<int64_t> LlamaTokenizer::encode(const std::string& text, bool add_bos) const
+{
+    std::vector<int64_t> ids;
+    if (add_bos && bos_id >= 0) {
+        ids.push_back(bos_id);
+    }
+
+    const std::string normalized = normalize(text);
+    if (normalized.empty()) {
+        return ids;
+    }
+
+    // one symbol per character to start with, merged ones are emptied and unlinked
+    struct Symbol {
+        int32_t id;
+        int32_t prev;
+        int32_t next;
+        uint32_t start;
+        uint32_t size;
+    };
+    std::vector<Symbol> symbols;
+
+    // best ranked pair first, leftmost among equals
+    struct Candidate {
+        int32_t rank;
+        int32_t left;
+        int32_t right;
+        int32_t left_id;
+        int32_t right_id;
+        int32_t id;
+
+        bool operator<(const Candidate& other) const
+        {
+            return rank != other.rank ? rank > other.rank : left > other.left;
+        }
+    };
+    std::priority_queue<Candidate> queue;
+
+    auto try_pair = [&](int32_t left) {
+        if (left < 0) {
+            return;
+        }
+        const int32_t right = symbols[left].next;
+        if (right < 0 || symbols[left].id < 0 || symbols[right].id < 0) {
+            return;
+        }
+        const auto found = merges.find(pair_key(symbols[left].id, symbols[right].id));
+        if (found != merges.end()) {
+            queue.push({found->second.rank, left, right, symbols[left].id, symbols[right].id, found->second.id});
+        }
+    };
+
+    ids.reserve(ids.size() + normalized.size() / 3);
+    const std::string_view view = normalized;
+
+    // words start at every "▁" behind something else, as sentencepiece splits them
+    // no piece spans two words, so each is merged on its own and the queue stays short
+    size_t word_start = 0;
+    while (word_start < view.size()) {
+        symbols.clear();
+
+        bool after_space = false;
+        size_t start = word_start;
+        while (start < view.size()) {
+            const bool space = view.compare(start, space_piece.size(), space_piece) == 0;
+            if (space && start > word_start && !after_space) {
+                break;
+            }
+            after_space = space;
+
+            const size_t size = std::min<size_t>(utf8_length(view[start]), view.size() - start);
+            const auto found = piece_ids.find(view.substr(start, size));
+            int32_t id = -1;
+            if (found != piece_ids.end() && (types[found->second] == PieceType::Normal || types[found->second] == PieceType::UserDefined)) {
+                id = found->second;
+            }
+
+            const auto index = static_cast<int32_t>(symbols.size());
+            symbols.push_back({id, index - 1, index + 1, static_cast<uint32_t>(start), static_cast<uint32_t>(size)});
+            start += size;
+        }
+        symbols.back().next = -1;
+        word_start = start;
+
+        for (int32_t i = 0; i + 1 < static_cast<int32_t>(symbols.size()); ++i) {
+            try_pair(i);
+        }
+
+        while (!queue.empty()) {
+            const Candidate candidate = queue.top();
+            queue.pop();
+
+            // skip pairs one of whose symbols has been merged since
+            Symbol& left = symbols[candidate.left];
+            Symbol& right = symbols[candidate.right];
+            if (left.size == 0 || right.size == 0 || left.next != candidate.right || left.id != candidate.left_id || right.id != candidate.right_id) {
+                continue;
+            }
+
+            left.id = candidate.id;
+            left.size += right.size;
+            left.next = right.next;
+            if (right.next >= 0) {
+                symbols[right.next].prev = candidate.left;
+            }
+            right.size = 0;
+
+            try_pair(left.prev);
+            try_pair(candidate.left);
+        }
+
+        for (int32_t i = 0; i >= 0; i = symbols[i].next) {
+            const Symbol& symbol = symbols[i];
+            if (symbol.id >= 0) {
+                ids.push_back(symbol.id);
+                continue;
+            }
+
+            // characters without a piece are spelled out in bytes, or become one unknown token
+            bool spelled = byte_fallback;
+            for (uint32_t b = 0; spelled && b < symbol.size; ++b) {
+                spelled = byte_ids[static_cast<uint8_t>(view[symbol.start + b])] >= 0;
+            }
+            if (spelled) {
+                for (uint32_t b = 0; b < symbol.size; ++b) {
+                    ids.push_back(byte_ids[static_cast<uint8_t>(view[symbol.start + b])]);
+                }
+            } else if (unk_id >= 0) {
+                ids.push_back(unk_id);
+            }
+        }
+    }
+    return ids;
+}
+
+
+std::vector<std::vector<int64_t>> LlamaTokenizer::encode_batch(const std::vector<std::string>& texts, bool add_bos) const
+{
+    std::vector<std::vector<int64_t>> result(texts.size());
+    at::parallel_for(0, static_cast<int64_t>(texts.size()), 1, [&](int64_t begin, int64_t end) {
+        for (int64_t i = begin; i < end; ++i) {
+            result[i] = encode(texts[i], add_bos);
+        }
+    });
+    return result;
+}
+
+
+std::string LlamaTokenizer::decode(const int64_t* ids, int64_t num_ids) const
+{
+    std::string result;
+    for (int64_t i = 0; i < num_ids; ++i) {
+        result += token_bytes(ids[i]);
+    }
+
+    if (add_dummy_prefix && !result.empty() && result[0] == ' ') {
+        result.erase(0, 1);
+    }
+    return result;
+}
+
+
+std::string LlamaTokenizer::decode(const std::vector<int64_t>& ids) const
+{
+    return decode(ids.data(), static_cast<int64_t>(ids.size()));
+}
+
+
+const std::string& LlamaTokenizer::token_bytes(int64_t id) const
+{
+    static const std::string none;
+    return id >= 0 && id < static_cast<int64_t>(bytes.size()) ? bytes[id] : none;
+}
+
+
+int64_t LlamaTokenizer::token_to_id(const std::string& piece) const
+{
+    const auto found = piece_ids.find(piece);
+    return found == piece_ids.end() ? -1 : found->second;
+}
+
+
+int64_t LlamaTokenizer::vocab_size() const
+{
+    return static_cast<int64_t>(pieces.size());
+}
+
+
+int64_t LlamaTokenizer::get_bos_id() const
+{
+    return bos_id;
+}
+
+
+int64_t LlamaTokenizer::get_eos_id() const
+{
+    return eos_id;
+}
+
+
+int64_t LlamaTokenizer::get_unk_id() const
+{
+    return unk_id;
+}
+
+
+bool LlamaTokenizer::get_add_dummy_prefix() const
+{
+    return add_dummy_prefix;
+}
+
+
+LlamaDetokenizer::LlamaDetokenizer(const LlamaTokenizer& tokenizer, bool strip_leading_space)
+    : tokenizer(tokenizer),
+    strip_leading_space(strip_leading_space)
+{
+}
+
+
+std::string LlamaDetokenizer::push(int64_t id)
+{
+    const std::string& bytes = tokenizer.token_bytes(id);
+    if (bytes.empty()) {
+        return std::string();
+    }
+
+    if (at_start && strip_leading_space && bytes[0] == ' ') {
+        pending.append(bytes, 1, std::string::npos);
+    } else {
+        pending += bytes;
+    }
+    at_start = false;
+
+    const size_t complete = complete_utf8_prefix(pending);
+    std::string result = pending.substr(0, complete);
+    pending.erase(0, complete);
+    return result;
+}
+
+
+std::string LlamaDetokenizer::flush()
+{
+    std::string result;
+    result.swap(pending);
+    return result;
+}
+
+
+void LlamaDetokenizer::reset()
+{
+    pending.clear();
+    at_start = true;
+}
@@ -1,7 +1,9 @@
 #pragma once
 #include "Models/Llama/llama_utils.h"
+#include "Models/Llama/llama_kernels.h"
 #include <limits>
 #include <fstream> 
+#include <map>
 
 torch::Tensor rotate_half(const torch::Tensor& x) {
     auto x1 = x.slice(/*dim=*/-1, /*start=*/0, /*end=*/x.size(-1) / 2);
@@ -117,7 +119,7 @@ torch::Tensor to4D(
         if (!key_value_length.has_value()) {
             throw std::invalid_argument("key_value_length must be provided when is_causal is true");
         }
-        expanded_4d_mask = makeCausalMask(input_shape, dtype, attention_mask_2d.device(), key_value_length.value());
+        expanded_4d_mask = makeCausalMask(input_shape, dtype, attention_mask_2d.device(), key_value_length.value() - query_length);
     } else {
         expanded_4d_mask = expanded_attn_mask;
     }
@@ -159,7 +161,7 @@ c10::optional<torch::Tensor> prepare4DCausalMask(
 
     if (attention_mask.has_value()) {
         auto attention_mask_2d = attention_mask.value();
-        auto expanded_4d_mask = to4D(attention_mask_2d, std::get<1>(input_shape), key_value_length, dtype, true);
+        auto expanded_4d_mask = to4D(attention_mask_2d, std::get<1>(input_shape), true, dtype, key_value_length);
         return expanded_4d_mask;
     } else {
         auto causal_4d_mask = toCausal4D(std::get<0>(input_shape), std::get<1>(input_shape), key_value_length, dtype, device);
@@ -222,4 +224,80 @@ void ArchiveConverter::toOutputArchive(const std::string& in_path, const std::st
     
     archive.save_to(out_path);
     
+}
+
+
+bool QuantizedArchiveConverter::isQuantized(const std::string& key) const
+{
+    auto endsWith = [&key](const std::string& suffix) {
+        return key.size() >= suffix.size() && key.compare(key.size() - suffix.size(), suffix.size(), suffix) == 0;
+    };
+
+    if (endsWith("_proj.weight")) {
+        return true;
+    }
+    return quantize_lm_head && key == "lm_head.weight";
+}
+
+
+void QuantizedArchiveConverter::toOutputArchive(const std::string& in_path, const std::string& out_path) {
+
+    auto weights = torch::pickle_load(GetTheBytes(in_path)).toGenericDict();
+
+    // nested archives are keyed by their whole path so sibling layers stay apart
+    torch::serialize::OutputArchive archive;
+    std::map<std::string, torch::serialize::OutputArchive> nestedArchives;
+
+    auto write = [&](const std::string& key, const torch::Tensor& tensor) {
+        torch::serialize::OutputArchive* currentArchive = &archive;
+        std::string path;
+
+        size_t start = 0;
+        size_t dot = key.find('.');
+        while (dot != std::string::npos) {
+            const std::string part = key.substr(start, dot - start);
+            path += part + ".";
+
+            auto it = nestedArchives.find(path);
+            if (it == nestedArchives.end()) {
+                it = nestedArchives.emplace(path, torch::serialize::OutputArchive()).first;
+                currentArchive->write(part, it->second);
+            }
+            currentArchive = &it->second;
+
+            start = dot + 1;
+            dot = key.find('.', start);
+        }
+
+        currentArchive->write(key.substr(start), tensor);
+    };
+
+    torch::NoGradGuard no_grad;
+
+    for (auto& item : weights) {
+        const std::string key = item.key().toStringRef();
+        const torch::Tensor tensor = item.value().toTensor();
+
+        if (quantization == LlamaQuantization::None || !isQuantized(key)) {
+            write(key, tensor);
+            continue;
+        }
+
+        // LlamaLinear keeps an empty weight next to the quantized buffers
+        const std::string prefix = key.substr(0, key.size() - std::string("weight").size());
+        write(key, torch::empty({0}, tensor.options()));
+
+        if (quantization == LlamaQuantization::Int4) {
+            auto [qweight, scales, zeros] = quantize_int4(tensor, group_size);
+            write(prefix + "qweight", qweight);
+            write(prefix + "scales", scales);
+            write(prefix + "zeros", zeros);
+        } else {
+            auto [qweight, scales] = quantize_int8(tensor);
+            write(prefix + "qweight", qweight);
+            write(prefix + "scales", scales);
+        }
+    }
+
+    archive.save_to(out_path);
 }
\ No newline at end of file
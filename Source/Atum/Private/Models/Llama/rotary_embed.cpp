@@ -20,6 +20,10 @@ void LlamaRotaryEmbeddingImpl::_set_cos_sin_cache(int64_t seq_len) {
   torch::Tensor emb = torch::cat({freqs, freqs}, -1);
   cos_cached_ = register_buffer("cos_cached", emb.cos().to(torch::kFloat32));
   sin_cached_ = register_buffer("sin_cached", emb.sin().to(torch::kFloat32));
+
+  // rebuilt on the next call to tables
+  cos_typed_ = torch::Tensor();
+  sin_typed_ = torch::Tensor();
 }
 
 std::tuple<torch::Tensor, torch::Tensor> LlamaRotaryEmbeddingImpl::forward(torch::Tensor x, int64_t seq_len) {
@@ -30,6 +34,19 @@ std::tuple<torch::Tensor, torch::Tensor> LlamaRotaryEmbeddingImpl::forward(torch
     _set_cos_sin_cache(seq_len);
   }
 
-  return std::make_tuple(cos_cached_.slice(0, 0, seq_len).to(x.dtype()),
-                         sin_cached_.slice(0, 0, seq_len).to(x.dtype()));
+  auto [cos, sin] = tables(x.scalar_type(), x.device(), seq_len);
+  return std::make_tuple(cos.slice(0, 0, seq_len), sin.slice(0, 0, seq_len));
+}
+
+std::tuple<torch::Tensor, torch::Tensor> LlamaRotaryEmbeddingImpl::tables(torch::ScalarType dtype, const torch::Device& device, int64_t seq_len) {
+  if (seq_len > max_seq_len_cached_) {
+    _set_cos_sin_cache(seq_len);
+  }
+
+  if (!cos_typed_.defined() || cos_typed_.scalar_type() != dtype || cos_typed_.device() != device) {
+    cos_typed_ = cos_cached_.to(device, dtype).contiguous();
+    sin_typed_ = sin_cached_.to(device, dtype).contiguous();
+  }
+
+  return std::make_tuple(cos_typed_, sin_typed_);
 }
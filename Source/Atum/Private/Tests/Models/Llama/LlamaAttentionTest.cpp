@@ -0,0 +1,211 @@
+// © 2023 Kaya Adrian.
+
+#include "Misc/AutomationTest.h"
+#include "Models/Llama/llama_kernels.h"
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+namespace
+{
+	constexpr int64 Batch = 2;
+	constexpr int64 Heads = 4;
+	constexpr int64 HeadDim = 64;
+
+	// large enough to hide a key in every dtype without turning into infinity
+	constexpr double Hidden = -1e9;
+
+	// dense grouped attention in float32 as LlamaAttention ran it before the tiled kernels
+	torch::Tensor AttentionBaseline(
+		const torch::Tensor& Q,
+		const torch::Tensor& K,
+		const torch::Tensor& V,
+		const c10::optional<torch::Tensor>& Mask,
+		const bool bCausal,
+		const double Scale
+	)
+	{
+		const int64 Groups = Q.size(1) / K.size(1);
+		const torch::Tensor Keys = K.to(torch::kFloat32).repeat_interleave(Groups, 1);
+		const torch::Tensor Values = V.to(torch::kFloat32).repeat_interleave(Groups, 1);
+
+		torch::Tensor Scores = torch::matmul(Q.to(torch::kFloat32), Keys.transpose(2, 3)) * Scale;
+		if (Mask.has_value())
+		{
+			Scores = Scores + Mask->to(torch::kFloat32);
+		}
+		if (bCausal)
+		{
+			// the queries are the last positions of the keys
+			const int64 SeqLen = Q.size(2);
+			const int64 KvLen = K.size(2);
+			Scores.masked_fill_(torch::ones({SeqLen, KvLen}, torch::kBool).triu(KvLen - SeqLen + 1), -std::numeric_limits<float>::infinity());
+		}
+		return torch::matmul(torch::softmax(Scores, -1), Values);
+	}
+
+	// the second row is shorter and hides its last keys, as a batch of unequal sequences does
+	torch::Tensor PaddingMask(const int64 KvLen)
+	{
+		torch::Tensor Mask = torch::zeros({Batch, 1, 1, KvLen});
+		Mask[1].narrow(-1, KvLen - 3, 3).fill_(Hidden);
+		return Mask;
+	}
+
+	bool AllClose(const torch::Tensor& Actual, const torch::Tensor& Expected, const double Tolerance)
+	{
+		return torch::allclose(Actual.to(torch::kFloat32), Expected.to(torch::kFloat32), Tolerance, Tolerance);
+	}
+
+	const std::pair<torch::ScalarType, double> Types[] = {
+		{torch::kFloat32, 1e-4},
+		{torch::kBFloat16, 3e-2}
+	};
+
+	// a decode step, a chunk after a prefix and a whole prompt, each longer than one key block
+	const std::pair<int64, int64> Lengths[] = {{1, 37}, {5, 70}, {64, 64}};
+}
+
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(
+	FAtumLlamaAttentionTiledTest,
+	"Atum.Models.Llama.Attention.Tiled",
+	EAutomationTestFlags::EngineFilter | EAutomationTestFlags::ApplicationContextMask
+)
+
+bool FAtumLlamaAttentionTiledTest::RunTest(const FString& Parameters)
+{
+	torch::NoGradGuard NoGrad;
+	torch::manual_seed(0);
+
+	const double Scale = 1.0 / std::sqrt(static_cast<double>(HeadDim));
+
+	// one and four query heads per kv head
+	for (const int64 KvHeads : {4, 1})
+	{
+		for (const auto& [SeqLen, KvLen] : Lengths)
+		{
+			for (const auto& [Type, Tolerance] : Types)
+			{
+				const torch::Tensor Q = torch::randn({Batch, Heads, SeqLen, HeadDim}).to(Type);
+				const torch::Tensor K = torch::randn({Batch, KvHeads, KvLen, HeadDim}).to(Type);
+				const torch::Tensor V = torch::randn({Batch, KvHeads, KvLen, HeadDim}).to(Type);
+				const torch::Tensor Mask = PaddingMask(KvLen).to(Type);
+
+				const auto [KInt8, KScales] = quantize_kv_int8(K);
+				const auto [VInt8, VScales] = quantize_kv_int8(V);
+				const torch::Tensor KDequantized = dequantize_kv_int8(KInt8, KScales, Type);
+				const torch::Tensor VDequantized = dequantize_kv_int8(VInt8, VScales, Type);
+
+				for (const bool bCausal : {true, false})
+				{
+					for (const bool bMasked : {false, true})
+					{
+						const c10::optional<torch::Tensor> AttentionMask = bMasked ? c10::optional<torch::Tensor>(Mask) : c10::nullopt;
+						const FString Case = FString::Printf(
+							TEXT("%lld kv heads, %lld queries over %lld keys in %hs%s%s"),
+							KvHeads, SeqLen, KvLen, c10::toString(Type), bCausal ? TEXT(", causal") : TEXT(""), bMasked ? TEXT(", padded") : TEXT("")
+						);
+
+						TestTrue(
+							FString::Printf(TEXT("tiled_attention matches dense attention for %s"), *Case),
+							AllClose(
+								tiled_attention(Q, K, V, AttentionMask, bCausal, Scale),
+								AttentionBaseline(Q, K, V, AttentionMask, bCausal, Scale),
+								Tolerance
+							)
+						);
+						TestTrue(
+							FString::Printf(TEXT("tiled_attention_int8 matches dense attention on the dequantized states for %s"), *Case),
+							AllClose(
+								tiled_attention_int8(Q, KInt8, KScales, VInt8, VScales, AttentionMask, bCausal, Scale),
+								AttentionBaseline(Q, KDequantized, VDequantized, AttentionMask, bCausal, Scale),
+								Tolerance
+							)
+						);
+					}
+				}
+			}
+		}
+	}
+
+	return true;
+}
+
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(
+	FAtumLlamaAttentionPagedTest,
+	"Atum.Models.Llama.Attention.Paged",
+	EAutomationTestFlags::EngineFilter | EAutomationTestFlags::ApplicationContextMask
+)
+
+bool FAtumLlamaAttentionPagedTest::RunTest(const FString& Parameters)
+{
+	torch::NoGradGuard NoGrad;
+	torch::manual_seed(0);
+
+	constexpr int64 KvHeads = 2;
+	constexpr int64 BlockSize = 16;
+	const double Scale = 1.0 / std::sqrt(static_cast<double>(HeadDim));
+
+	// [batch, kv_heads, kv_len, head_dim] states scattered over the pool blocks the table names
+	const auto ToBlocks = [&](const torch::Tensor& States, const torch::Tensor& BlockTable, const int64 NumBlocks)
+	{
+		const int64 MaxBlocks = BlockTable.size(1);
+		const torch::Tensor Padded = torch::constant_pad_nd(States, {0, 0, 0, MaxBlocks * BlockSize - States.size(2)});
+		const torch::Tensor Rows = Padded.view({Batch, KvHeads, MaxBlocks, BlockSize, -1}).permute({0, 2, 3, 1, 4});
+
+		auto BlockSizes = Rows.sizes().slice(1).vec();
+		BlockSizes[0] = NumBlocks;
+		return torch::zeros(BlockSizes, States.options()).index_copy_(0, BlockTable.flatten(), Rows.reshape({-1, BlockSize, KvHeads, States.size(3)}));
+	};
+
+	for (const auto& [SeqLen, KvLen] : Lengths)
+	{
+		// block 0 stays unused, the rest are handed out out of order
+		const int64 MaxBlocks = (KvLen + BlockSize - 1) / BlockSize;
+		const int64 NumBlocks = Batch * MaxBlocks + 1;
+		const torch::Tensor BlockTable = (torch::randperm(NumBlocks - 1) + 1).view({Batch, MaxBlocks});
+
+		for (const auto& [Type, Tolerance] : Types)
+		{
+			const torch::Tensor Q = torch::randn({Batch, Heads, SeqLen, HeadDim}).to(Type);
+			const torch::Tensor K = torch::randn({Batch, KvHeads, KvLen, HeadDim}).to(Type);
+			const torch::Tensor V = torch::randn({Batch, KvHeads, KvLen, HeadDim}).to(Type);
+			const c10::optional<torch::Tensor> Mask = PaddingMask(KvLen).to(Type);
+
+			const auto [KInt8, KScales] = quantize_kv_int8(K);
+			const auto [VInt8, VScales] = quantize_kv_int8(V);
+
+			const FString Case = FString::Printf(TEXT("%lld queries over %lld keys in %hs"), SeqLen, KvLen, c10::toString(Type));
+
+			TestTrue(
+				FString::Printf(TEXT("paged_attention matches dense attention for %s"), *Case),
+				AllClose(
+					paged_attention(
+						Q, ToBlocks(K, BlockTable, NumBlocks), ToBlocks(V, BlockTable, NumBlocks), torch::Tensor(), torch::Tensor(),
+						BlockTable, KvLen, Mask, true, Scale
+					),
+					AttentionBaseline(Q, K, V, Mask, true, Scale),
+					Tolerance
+				)
+			);
+			TestTrue(
+				FString::Printf(TEXT("int8 paged_attention matches dense attention on the dequantized states for %s"), *Case),
+				AllClose(
+					paged_attention(
+						Q, ToBlocks(KInt8, BlockTable, NumBlocks), ToBlocks(VInt8, BlockTable, NumBlocks),
+						ToBlocks(KScales.unsqueeze(-1), BlockTable, NumBlocks).squeeze(-1),
+						ToBlocks(VScales.unsqueeze(-1), BlockTable, NumBlocks).squeeze(-1),
+						BlockTable, KvLen, Mask, true, Scale
+					),
+					AttentionBaseline(Q, dequantize_kv_int8(KInt8, KScales, Type), dequantize_kv_int8(VInt8, VScales, Type), Mask, true, Scale),
+					Tolerance
+				)
+			);
+		}
+	}
+
+	return true;
+}
+
+#endif
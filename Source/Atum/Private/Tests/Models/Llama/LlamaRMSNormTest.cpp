@@ -0,0 +1,128 @@
+// © 2023 Kaya Adrian.
+
+#include "Misc/AutomationTest.h"
+#include "Models/Llama/llama_kernels.h"
+#include "Models/Llama/llama_rms.h"
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+namespace
+{
+	constexpr double Eps = 1e-5;
+
+	// LlamaRMSNormImpl::forward as it was before the fused kernels
+	torch::Tensor RmsNormBaseline(torch::Tensor X, const torch::Tensor& Weight)
+	{
+		auto const InputDtype = X.dtype();
+		X = X.to(torch::kFloat32);
+		auto const Variance = X.pow(2).mean(-1, true);
+		X = torch::mul(X, torch::rsqrt(Variance + Eps));
+		return torch::mul(X.to(InputDtype), Weight);
+	}
+
+	bool AllClose(const torch::Tensor& Actual, const torch::Tensor& Expected, const double Tolerance)
+	{
+		return torch::allclose(Actual.to(torch::kFloat32), Expected.to(torch::kFloat32), Tolerance, Tolerance);
+	}
+}
+
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(
+	FAtumLlamaRMSNormKernelTest,
+	"Atum.Models.Llama.RMSNorm.Kernel",
+	EAutomationTestFlags::EngineFilter | EAutomationTestFlags::ApplicationContextMask
+)
+
+bool FAtumLlamaRMSNormKernelTest::RunTest(const FString& Parameters)
+{
+	torch::NoGradGuard NoGrad;
+	torch::manual_seed(0);
+
+	const std::pair<torch::ScalarType, double> Types[] = {
+		{torch::kFloat32, 1e-5},
+		{torch::kBFloat16, 2e-2},
+		{torch::kHalf, 2e-3}
+	};
+
+	// odd widths run the scalar tail after the vector loop
+	for (const int64 Width : {64, 4096, 4099})
+	{
+		for (const auto& [Type, Tolerance] : Types)
+		{
+			const FString Case = FString::Printf(TEXT("width %lld in %hs"), Width, c10::toString(Type));
+
+			const torch::Tensor X = torch::randn({3, 5, Width}).to(Type);
+			const torch::Tensor Residual = torch::randn({3, 5, Width}).to(Type);
+			const torch::Tensor Weight = (torch::rand({Width}) + 0.5).to(Type);
+
+			TestTrue(
+				FString::Printf(TEXT("rms_norm matches the unfused norm for %s"), *Case),
+				AllClose(rms_norm(X, Weight, Eps), RmsNormBaseline(X, Weight), Tolerance)
+			);
+
+			const torch::Tensor Sum = X.clone();
+			const torch::Tensor Normed = add_rms_norm_(Sum, Residual, Weight, Eps);
+			const torch::Tensor ExpectedSum = X + Residual;
+
+			TestTrue(FString::Printf(TEXT("add_rms_norm_ leaves the residual sum for %s"), *Case), AllClose(Sum, ExpectedSum, Tolerance));
+			TestTrue(
+				FString::Printf(TEXT("add_rms_norm_ matches the unfused norm of the sum for %s"), *Case),
+				AllClose(Normed, RmsNormBaseline(ExpectedSum, Weight), Tolerance)
+			);
+		}
+	}
+
+	return true;
+}
+
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(
+	FAtumLlamaRMSNormGradientTest,
+	"Atum.Models.Llama.RMSNorm.Gradient",
+	EAutomationTestFlags::EngineFilter | EAutomationTestFlags::ApplicationContextMask
+)
+
+bool FAtumLlamaRMSNormGradientTest::RunTest(const FString& Parameters)
+{
+	torch::manual_seed(0);
+	constexpr int64 Width = 64;
+
+	LlamaRMSNorm Norm(Width, Eps);
+	torch::Tensor Weight = Norm->named_parameters()["weight"];
+	{
+		torch::NoGradGuard NoGrad;
+		Weight.copy_(torch::rand({Width}) + 0.5);
+	}
+
+	const torch::Tensor Probe = torch::randn({2, 4, Width});
+	const torch::Tensor X = torch::randn({2, 4, Width}, torch::requires_grad());
+	const torch::Tensor Residual = torch::randn({2, 4, Width}, torch::requires_grad());
+
+	// same leaves run through the baseline
+	const torch::Tensor BaselineX = X.detach().clone().requires_grad_();
+	const torch::Tensor BaselineResidual = Residual.detach().clone().requires_grad_();
+	const torch::Tensor BaselineWeight = Weight.detach().clone().requires_grad_();
+
+	// the decoder layer feeds forward_residual a fresh attention output
+	torch::Tensor Sum = X * 1;
+	const torch::Tensor Normed = Norm->forward_residual(Sum, Residual);
+	torch::Tensor Input = Sum * 1;
+	const torch::Tensor Output = Norm->forward(Input);
+	((Normed + Output) * Probe).sum().backward();
+
+	const torch::Tensor BaselineSum = BaselineX + BaselineResidual;
+	((RmsNormBaseline(BaselineSum, BaselineWeight) * 2) * Probe).sum().backward();
+
+	if (!TestTrue(TEXT("every input gets a gradient"), X.grad().defined() && Residual.grad().defined() && Weight.grad().defined()))
+	{
+		return false;
+	}
+
+	TestTrue(TEXT("the input gradient matches the unfused norm"), AllClose(X.grad(), BaselineX.grad(), 1e-5));
+	TestTrue(TEXT("the residual gradient matches the unfused norm"), AllClose(Residual.grad(), BaselineResidual.grad(), 1e-5));
+	TestTrue(TEXT("the weight gradient matches the unfused norm"), AllClose(Weight.grad(), BaselineWeight.grad(), 1e-5));
+
+	return true;
+}
+
+#endif
@@ -0,0 +1,161 @@
+// © 2023 Kaya Adrian.
+
+#include "IAtumModule.h"
+#include "HAL/FileManager.h"
+#include "HAL/PlatformTime.h"
+#include "Math/RandomStream.h"
+#include "Misc/AutomationTest.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Paths.h"
+#include "Models/Llama/LlamaTokenizer.h"
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+namespace
+{
+	const TCHAR* const Words[] = {
+		TEXT("the"), TEXT("of"), TEXT("and"), TEXT("to"), TEXT("in"), TEXT("is"), TEXT("that"), TEXT("it"),
+		TEXT("was"), TEXT("for"), TEXT("on"), TEXT("with"), TEXT("as"), TEXT("by"), TEXT("model"), TEXT("token"),
+		TEXT("layer"), TEXT("weight"), TEXT("attention"), TEXT("generation"), TEXT("sequence"), TEXT("cache")
+	};
+
+	// words the vocabulary cannot spell, they fall back to byte tokens and split characters across tokens
+	const TCHAR* const FallbackWords[] = {TEXT("Llama"), TEXT("caf\u00e9"), TEXT("na\u00efve"), TEXT("\u65e5\u672c\u8a9e"), TEXT("2023")};
+
+	// sentencepiece style tokenizer.json whose merges build every word of Words after a "▁"
+	FString MakeTokenizerJson()
+	{
+		const FString Space = FString::Chr(0x2581);
+
+		TArray<FString> Vocab = {TEXT("<unk>"), TEXT("<s>"), TEXT("</s>")};
+		for (int32 Byte = 0; Byte < 256; ++Byte)
+		{
+			Vocab.Add(FString::Printf(TEXT("<0x%02X>"), Byte));
+		}
+		Vocab.Add(Space);
+		for (TCHAR Letter = TEXT('a'); Letter <= TEXT('z'); ++Letter)
+		{
+			Vocab.Add(FString::Chr(Letter));
+		}
+
+		TArray<FString> Merges;
+		for (const TCHAR* const Word : Words)
+		{
+			FString Piece = Space;
+			for (const TCHAR* Letter = Word; *Letter; ++Letter)
+			{
+				FString Merged = Piece;
+				Merged.AppendChar(*Letter);
+				if (!Vocab.Contains(Merged))
+				{
+					Merges.Add(FString::Printf(TEXT("\"%s %c\""), *Piece, *Letter));
+					Vocab.Add(Merged);
+				}
+				Piece = MoveTemp(Merged);
+			}
+		}
+
+		TArray<FString> VocabEntries;
+		for (int32 Id = 0; Id < Vocab.Num(); ++Id)
+		{
+			VocabEntries.Add(FString::Printf(TEXT("\"%s\": %d"), *Vocab[Id], Id));
+		}
+
+		return FString::Printf(
+			TEXT("{\"added_tokens\": [")
+			TEXT("{\"id\": 0, \"content\": \"<unk>\", \"special\": true}, ")
+			TEXT("{\"id\": 1, \"content\": \"<s>\", \"special\": true}, ")
+			TEXT("{\"id\": 2, \"content\": \"</s>\", \"special\": true}], ")
+			TEXT("\"normalizer\": {\"type\": \"Sequence\", \"normalizers\": [{\"type\": \"Prepend\", \"prepend\": \"%s\"}]}, ")
+			TEXT("\"model\": {\"type\": \"BPE\", \"byte_fallback\": true, \"unk_token\": \"<unk>\", \"vocab\": {%s}, \"merges\": [%s]}}"),
+			*Space,
+			*FString::Join(VocabEntries, TEXT(", ")),
+			*FString::Join(Merges, TEXT(", "))
+		);
+	}
+
+	FString MakeText(const int32 NumWords)
+	{
+		FRandomStream Random(0);
+
+		TArray<FString> Text;
+		Text.Reserve(NumWords);
+		for (int32 Index = 0; Index < NumWords; ++Index)
+		{
+			Text.Add(
+				Random.RandRange(0, 15) == 0
+					? FallbackWords[Random.RandRange(0, static_cast<int32>(UE_ARRAY_COUNT(FallbackWords)) - 1)]
+					: Words[Random.RandRange(0, static_cast<int32>(UE_ARRAY_COUNT(Words)) - 1)]
+			);
+		}
+		return FString::Join(Text, TEXT(" "));
+	}
+}
+
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(
+	FAtumLlamaTokenizerBenchmark,
+	"Atum.Models.Llama.Tokenizer.Benchmark",
+	EAutomationTestFlags::PerfFilter | EAutomationTestFlags::ApplicationContextMask
+)
+
+bool FAtumLlamaTokenizerBenchmark::RunTest(const FString& Parameters)
+{
+	constexpr int32 NumWords = 200000;
+
+	const FString FilePath = FPaths::ConvertRelativePathToFull(FPaths::AutomationTransientDir() / TEXT("LlamaTokenizerBenchmark.json"));
+	if (!TestTrue(TEXT("the benchmark tokenizer is written"), FFileHelper::SaveStringToFile(MakeTokenizerJson(), *FilePath, FFileHelper::EEncodingOptions::ForceUTF8WithoutBOM)))
+	{
+		return false;
+	}
+
+	// LoadFromFile takes paths relative to the content directory
+	FString ContentDirectory = FPaths::ConvertRelativePathToFull(IAtumModule::GetContentDirectory());
+	if (!ContentDirectory.EndsWith(TEXT("/")))
+	{
+		ContentDirectory += TEXT("/");
+	}
+	FString RelativePath = FilePath;
+	FPaths::MakePathRelativeTo(RelativePath, *ContentDirectory);
+
+	ULlamaTokenizer* const Tokenizer = NewObject<ULlamaTokenizer>();
+	const bool bLoaded = Tokenizer->LoadFromFile(RelativePath);
+	IFileManager::Get().Delete(*FilePath);
+	if (!TestTrue(TEXT("the benchmark tokenizer loads"), bLoaded))
+	{
+		return false;
+	}
+
+	const FString Text = MakeText(NumWords);
+
+	const double EncodeStart = FPlatformTime::Seconds();
+	const TArray<int64> Tokens = Tokenizer->Encode(Text, false);
+	const double EncodeSeconds = FPlatformTime::Seconds() - EncodeStart;
+
+	// one token per call, as generation streams them
+	const double DecodeStart = FPlatformTime::Seconds();
+	const int32 StreamId = Tokenizer->BeginDecodeStream();
+	FString Streamed;
+	for (const int64 Token : Tokens)
+	{
+		Streamed += Tokenizer->DecodeStream(StreamId, {Token});
+	}
+	Streamed += Tokenizer->EndDecodeStream(StreamId);
+	const double DecodeSeconds = FPlatformTime::Seconds() - DecodeStart;
+
+	TestEqual(TEXT("decoding the tokens gives back the text"), Tokenizer->Decode(Tokens), Text);
+	TestEqual(TEXT("streaming the tokens gives back the text"), Streamed, Text);
+
+	AddInfo(FString::Printf(
+		TEXT("encode: %d tokens in %.3f s, %.0f tokens/s"),
+		Tokens.Num(), EncodeSeconds, Tokens.Num() / FMath::Max(EncodeSeconds, 1e-9)
+	));
+	AddInfo(FString::Printf(
+		TEXT("decode stream: %d tokens in %.3f s, %.0f tokens/s"),
+		Tokens.Num(), DecodeSeconds, Tokens.Num() / FMath::Max(DecodeSeconds, 1e-9)
+	));
+
+	return true;
+}
+
+#endif
@@ -2,6 +2,7 @@
 
 
 #include "Models/Llama/llama_config.h"
+#include "Models/Llama/AtumLlamaQuantization.h"
 #include "Layers/AtumLayerBaseOptions.h"
 #include "Tensors/AtumTensorScalarType.h"
 #include "AtumLlamaOptions.generated.h"
@@ -76,6 +77,21 @@ struct ATUM_API FAtumLlamaOptions : public FAtumLayerBaseOptions
 	UPROPERTY(EditAnywhere, BlueprintReadWrite, meta = (AllowPrivateAccess = "true"))
 	EAtumTensorScalarType ScalarType = EAtumTensorScalarType::Float;
 
+	// format of the linear weights in the archive being loaded
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, meta = (AllowPrivateAccess = "true"))
+	EAtumLlamaQuantization Quantization = EAtumLlamaQuantization::None;
+
+	// input features sharing one scale and zero point in Int4
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, meta = (AllowPrivateAccess = "true", ClampMin = "2"))
+	int QuantizationGroupSize = 64;
+
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, meta = (AllowPrivateAccess = "true"))
+	bool QuantizeLmHead = false;
+
+	// Int8 stores the kv caches with one scale per head and token, about half the memory of bfloat16 states
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, meta = (AllowPrivateAccess = "true"))
+	EAtumLlamaQuantization KVCacheQuantization = EAtumLlamaQuantization::None;
+
 
 	UE_NODISCARD_CTOR
 	FAtumLlamaOptions() noexcept;
@@ -107,6 +123,10 @@ struct ATUM_API FAtumLlamaOptions : public FAtumLayerBaseOptions
 		config.output_hidden_states = OutputHiddenStates;
 		config.output_attentions = OutputAttentions;
 		config.dtype = AtumEnums::Cast(ScalarType);
+		config.quantization = AtumEnums::Cast(Quantization);
+		config.quantization_group_size = QuantizationGroupSize;
+		config.quantize_lm_head = QuantizeLmHead;
+		config.kv_cache_quantization = AtumEnums::Cast(KVCacheQuantization);
 		return config;
 		
 	}
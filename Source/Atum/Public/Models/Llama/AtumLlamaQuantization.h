@@ -0,0 +1,81 @@
+#pragma once
+
+#include "Macros/AtumMacrosGuards.h"
+#include "Macros/AtumMacrosLog.h"
+#include "Models/Llama/llama_config.h"
+
+#include "AtumLlamaQuantization.generated.h"
+
+
+#define LOCTEXT_NAMESPACE "AtumLlamaQuantization"
+
+/**
+ * Represents the storage formats available for the Llama linear weights
+ */
+UENUM(BlueprintType, Category = "ATUM|Llama", DisplayName = "ATUM Llama Quantization", meta = (
+	Keywords = "ATUM Llama Quantization"
+))
+enum class EAtumLlamaQuantization : uint8
+{
+	None UMETA(DisplayName = "None"), // LlamaQuantization::None
+	Int8 UMETA(DisplayName = "Int8"), // LlamaQuantization::Int8
+	Int4 UMETA(DisplayName = "Int4") // LlamaQuantization::Int4
+};
+
+
+namespace AtumEnums
+{
+	/**
+	 * Transforms an ATUM enum value into a Llama enum value
+	 * 
+	 * @param Quantization ATUM-equivalent quantization
+	 * @return Llama-equivalent quantization
+	 */
+	UE_NODISCARD
+	static LlamaQuantization Cast(const EAtumLlamaQuantization Quantization) noexcept
+	{
+		switch (Quantization)
+		{
+		case EAtumLlamaQuantization::None:
+			return LlamaQuantization::None;
+			
+		case EAtumLlamaQuantization::Int8:
+			return LlamaQuantization::Int8;
+			
+		case EAtumLlamaQuantization::Int4:
+			return LlamaQuantization::Int4;
+			
+		default:
+			ATUM_LOG(Error, TEXT("Unknown Quantization: %hhd"), Quantization)
+			return LlamaQuantization::None;
+		}
+	}
+	
+	/**
+	 * Transforms a Llama enum value into an ATUM enum value
+	 * 
+	 * @param Quantization Llama-equivalent quantization
+	 * @return ATUM-equivalent quantization
+	 */
+	UE_NODISCARD
+	static EAtumLlamaQuantization Cast(const LlamaQuantization Quantization) noexcept
+	{
+		switch (Quantization)
+		{
+		case LlamaQuantization::None:
+			return EAtumLlamaQuantization::None;
+			
+		case LlamaQuantization::Int8:
+			return EAtumLlamaQuantization::Int8;
+			
+		case LlamaQuantization::Int4:
+			return EAtumLlamaQuantization::Int4;
+			
+		default:
+			ATUM_LOG(Error, TEXT("Unknown Quantization: %d"), static_cast<int32>(Quantization))
+			return EAtumLlamaQuantization::None;
+		}
+	}
+}
+
+#undef LOCTEXT_NAMESPACE
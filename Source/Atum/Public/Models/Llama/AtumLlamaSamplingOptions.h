@@ -0,0 +1,73 @@
+#pragma once
+
+
+#include "Models/Llama/llama_sampling.h"
+#include "AtumLlamaSamplingOptions.generated.h"
+
+#define LOCTEXT_NAMESPACE "AtumLlamaSamplingOptions"
+
+USTRUCT(BlueprintType, DisplayName = "ATUM Llama Sampling Options")
+struct ATUM_API FAtumLlamaSamplingOptions
+{
+	GENERATED_BODY()
+
+	// greedy decoding when false
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, meta = (AllowPrivateAccess = "true"))
+	bool bDoSample = false;
+
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, meta = (AllowPrivateAccess = "true", ClampMin = "0.0"))
+	double Temperature = 1.0;
+
+	// 0 keeps every token
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, meta = (AllowPrivateAccess = "true", ClampMin = "0"))
+	int TopK = 0;
+
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, meta = (AllowPrivateAccess = "true", ClampMin = "0.0", ClampMax = "1.0"))
+	double TopP = 1.0;
+
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, meta = (AllowPrivateAccess = "true", ClampMin = "0.0"))
+	double RepetitionPenalty = 1.0;
+
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, meta = (AllowPrivateAccess = "true"))
+	double FrequencyPenalty = 0.0;
+
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, meta = (AllowPrivateAccess = "true"))
+	double PresencePenalty = 0.0;
+
+	// -1 picks a random seed
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, meta = (AllowPrivateAccess = "true"))
+	int64 Seed = -1;
+
+	// generation stops at any of these, EosTokenId included unless bIgnoreEos
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, meta = (AllowPrivateAccess = "true"))
+	TArray<int64> StopTokenIds;
+
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, meta = (AllowPrivateAccess = "true"))
+	bool bIgnoreEos = false;
+
+
+	UE_NODISCARD_CTOR
+	FAtumLlamaSamplingOptions() noexcept;
+
+	UE_NODISCARD
+	explicit operator LlamaSamplingOptions() const noexcept
+	{
+		LlamaSamplingOptions options = LlamaSamplingOptions();
+		options.do_sample = bDoSample;
+		options.temperature = Temperature;
+		options.top_k = TopK;
+		options.top_p = TopP;
+		options.repetition_penalty = RepetitionPenalty;
+		options.frequency_penalty = FrequencyPenalty;
+		options.presence_penalty = PresencePenalty;
+		if (Seed >= 0)
+			options.seed = static_cast<uint64_t>(Seed);
+
+		options.stop_token_ids.assign(StopTokenIds.GetData(), StopTokenIds.GetData() + StopTokenIds.Num());
+		options.ignore_eos = bIgnoreEos;
+		return options;
+	}
+};
+
+
+#undef LOCTEXT_NAMESPACE
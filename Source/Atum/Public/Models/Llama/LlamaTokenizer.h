@@ -0,0 +1,89 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "UObject/NoExportTypes.h"
+#include "Models/Llama/llama_tokenizer.h"
+#include "Tensors/IAtumTensor.h"
+
+#include "LlamaTokenizer.generated.h"
+
+#define LOCTEXT_NAMESPACE "AtumLlamaTokenizer"
+
+
+// the tokens of one text, so batches of them fit in a blueprint array
+USTRUCT(BlueprintType, DisplayName = "ATUM Llama Token Ids")
+struct ATUM_API FAtumLlamaTokenIds
+{
+	GENERATED_BODY()
+
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, meta = (AllowPrivateAccess = "true"))
+	TArray<int64> Ids;
+};
+
+
+/**
+ * Turns text into the token tensors ULlamaUnreal takes and its outputs back into text
+ */
+UCLASS(BlueprintType, Blueprintable)
+class ATUM_API ULlamaTokenizer : public UObject
+{
+	GENERATED_BODY()
+
+public:
+	// a tokenizer.model or tokenizer.json in the content directory
+	UFUNCTION(BlueprintCallable, Category = "ATUM|Tokenizer")
+	bool LoadFromFile(const FString& Path);
+
+	UFUNCTION(BlueprintPure, Category = "ATUM|Tokenizer")
+	bool IsLoaded() const;
+
+	UFUNCTION(BlueprintCallable, Category = "ATUM|Tokenizer")
+	TArray<int64> Encode(const FString& Text, bool bAddBos = true) const;
+
+	// every text is encoded on a worker thread of its own
+	UFUNCTION(BlueprintCallable, Category = "ATUM|Tokenizer")
+	TArray<FAtumLlamaTokenIds> EncodeBatch(const TArray<FString>& Texts, bool bAddBos = true) const;
+
+	// a [1, seq_len] long tensor, the input of ULlamaUnreal::Generate
+	UFUNCTION(BlueprintCallable, Category = "ATUM|Tokenizer")
+	bool EncodeToTensor(const FString& Text, TScriptInterface<IAtumTensor>& Output, bool bAddBos = true) const;
+
+	UFUNCTION(BlueprintCallable, Category = "ATUM|Tokenizer")
+	FString Decode(const TArray<int64>& Tokens) const;
+
+	// the first row of a [batch, seq_len] tensor such as the output of ULlamaUnreal::Generate
+	UFUNCTION(BlueprintCallable, Category = "ATUM|Tokenizer")
+	FString DecodeTensor(const TScriptInterface<IAtumTensor>& Input) const;
+
+	// streams decode the tokens of FAtumLlamaOnTokens as they arrive
+	// characters split across tokens are held back until they are complete
+	UFUNCTION(BlueprintCallable, Category = "ATUM|Tokenizer")
+	int32 BeginDecodeStream();
+
+	UFUNCTION(BlueprintCallable, Category = "ATUM|Tokenizer")
+	FString DecodeStream(int32 StreamId, const TArray<int64>& Tokens);
+
+	// returns whatever the stream still held back
+	UFUNCTION(BlueprintCallable, Category = "ATUM|Tokenizer")
+	FString EndDecodeStream(int32 StreamId);
+
+	UFUNCTION(BlueprintPure, Category = "ATUM|Tokenizer")
+	int64 GetVocabSize() const;
+
+	UFUNCTION(BlueprintPure, Category = "ATUM|Tokenizer")
+	int64 GetBosId() const;
+
+	UFUNCTION(BlueprintPure, Category = "ATUM|Tokenizer")
+	int64 GetEosId() const;
+
+private:
+	TSharedPtr<LlamaTokenizer> Tokenizer = nullptr;
+
+	// refer to Tokenizer, dropped whenever it is replaced
+	TMap<int32, TSharedPtr<LlamaDetokenizer>> DecodeStreams;
+	int32 NextDecodeStreamId = 0;
+};
+
+#undef LOCTEXT_NAMESPACE
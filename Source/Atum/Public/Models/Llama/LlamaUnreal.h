@@ -7,16 +7,28 @@
 #include "Layers/IAtumLayer.h"
 #include "Macros/AtumMacrosLayer.h"
 #include "Models/Llama/llama_causal_lm.h"
+#include "Models/Llama/llama_cache.h"
+#include "Models/Llama/llama_prefix_cache.h"
+#include "Models/Llama/llama_scheduler.h"
 #include "Models/Llama/AtumLlamaOptions.h"
+#include "Models/Llama/AtumLlamaSamplingOptions.h"
 TORCH_INCLUDES_START
 #include <torch/torch.h>
 TORCH_INCLUDES_END
+#include <atomic>
+#include <mutex>
 
 #include "LlamaUnreal.generated.h"
 
 #define LOCTEXT_NAMESPACE "AtumLlamaUnreal"
 
 
+// fired on the game thread with the tokens decoded since the previous call
+DECLARE_DYNAMIC_DELEGATE_TwoParams(FAtumLlamaOnTokens, int32, RequestId, const TArray<int64>&, Tokens);
+
+// fired on the game thread once with the prompt followed by every generated token
+DECLARE_DYNAMIC_DELEGATE_ThreeParams(FAtumLlamaOnGenerationComplete, int32, RequestId, bool, bSuccess, const TArray<int64>&, Tokens);
+
 
 /**
  * 
@@ -33,19 +45,216 @@ public:
 	UFUNCTION(BlueprintNativeEvent, BlueprintCallable, Category = "ATUM|Layer")
 	bool Generate(const TScriptInterface<IAtumTensor>& Input, TScriptInterface<IAtumTensor>& Output, const int32& NumNewTokens);
 
+	// a .safetensors file, or a directory of them, is memory mapped and used in place without ToArchive
+	// anything else is read as an archive written by ToArchive
 	UFUNCTION(BlueprintNativeEvent, BlueprintCallable, Category = "ATUM|Layer")
 	bool LoadParams(const FString& Path);
 
 	UFUNCTION(BlueprintNativeEvent, BlueprintCallable, Category = "ATUM|Layer")
 	bool ToArchive(const FString& InPath, const FString& OutPath);
 
+	// like ToArchive, with the projections stored in the given format
+	// the archive loads once Options use the same Quantization, QuantizationGroupSize and QuantizeLmHead
+	UFUNCTION(BlueprintCallable, Category = "ATUM|Layer")
+	bool ToQuantizedArchive(const FString& InPath, const FString& OutPath, EAtumLlamaQuantization Quantization);
+
+	// writes the loaded weights as a .safetensors file, which later LoadParams calls map and stream layer by layer
+	// converting an archive once this way avoids deserialising all of it on every load
+	UFUNCTION(BlueprintCallable, Category = "ATUM|Layer")
+	bool ToSafetensors(const FString& OutPath);
+
 	UFUNCTION(BlueprintCallable, Category = "ATUM|Layer")
 	void SetOptions(const FAtumLlamaOptions& NewOptions);
 
+	UFUNCTION(BlueprintCallable, Category = "ATUM|Layer")
+	void SetSamplingOptions(const FAtumLlamaSamplingOptions& NewSamplingOptions);
+
+	UFUNCTION(BlueprintCallable, Category = "ATUM|Layer")
+	void SetDraftModel(ULlamaUnreal* NewDraftModel, int32 NewNumDraftTokens = 4);
+
+	UFUNCTION(BlueprintCallable, Category = "ATUM|Layer")
+	void ReleaseKVCache();
+
+	UFUNCTION(BlueprintCallable, Category = "ATUM|Layer")
+	int64 GetKVCacheMemoryBytes() const;
+
+	// forgets every remembered prompt prefix
+	UFUNCTION(BlueprintCallable, Category = "ATUM|Layer")
+	void ClearPrefixCache();
+
+	UFUNCTION(BlueprintCallable, Category = "ATUM|Layer")
+	int64 GetPrefixCacheMemoryBytes() const;
+
+	// conversations keep their kv states in blocks of a pool shared by every session
+	// or, with SessionWindowTokens above 0, in a sink cache of their own that never fills up
+	UFUNCTION(BlueprintCallable, Category = "ATUM|Layer")
+	int32 BeginSession();
+
+	// Input only holds the tokens added since the previous call of the session
+	UFUNCTION(BlueprintCallable, Category = "ATUM|Layer")
+	bool GenerateInSession(int32 SessionId, const TScriptInterface<IAtumTensor>& Input, TScriptInterface<IAtumTensor>& Output, const int32& NumNewTokens);
+
+	UFUNCTION(BlueprintCallable, Category = "ATUM|Layer")
+	bool EndSession(int32 SessionId);
+
+	// fraction of the shared kv blocks in use
+	UFUNCTION(BlueprintCallable, Category = "ATUM|Layer")
+	float GetKVCacheOccupancy() const;
+
+	// queues a [1, seq_len] prompt for batched generation, returns its request id
+	// INDEX_NONE for empty prompts and prompts the kv block pool could never hold
+	UFUNCTION(BlueprintCallable, Category = "ATUM|Layer")
+	int32 SubmitGeneration(const TScriptInterface<IAtumTensor>& Input, int32 NumNewTokens);
+
+	// runs one batched decode step over every queued request, returns whether any is still unfinished
+	UFUNCTION(BlueprintCallable, Category = "ATUM|Layer")
+	bool StepGeneration();
+
+	// outputs the tokens of a finished request and forgets it
+	// false for a request that failed, which is forgotten all the same
+	UFUNCTION(BlueprintCallable, Category = "ATUM|Layer")
+	bool GetGenerationResult(int32 RequestId, TScriptInterface<IAtumTensor>& Output);
+
+	UFUNCTION(BlueprintCallable, Category = "ATUM|Layer")
+	void CancelGeneration(int32 RequestId);
+
+	// generates from a [1, seq_len] prompt on a worker thread, the game thread never waits on it
+	UFUNCTION(BlueprintCallable, Category = "ATUM|Layer")
+	int32 GenerateAsync(
+		const TScriptInterface<IAtumTensor>& Input,
+		int32 NumNewTokens,
+		FAtumLlamaOnTokens OnTokens,
+		FAtumLlamaOnGenerationComplete OnComplete
+	);
+
+	// the completion event still fires, with bSuccess set to false
+	UFUNCTION(BlueprintCallable, Category = "ATUM|Layer")
+	void CancelAsyncGeneration(int32 RequestId);
+
+	virtual void BeginDestroy() override;
+
 protected:
 	UPROPERTY(EditAnywhere, BlueprintReadWrite, meta = (AllowPrivateAccess, ShowOnlyInnerProperties, ExposeOnSpawn))
 	FAtumLlamaOptions Options;
 
+	// how Generate, GenerateInSession and SubmitGeneration pick the next token
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, meta = (AllowPrivateAccess, ExposeOnSpawn))
+	FAtumLlamaSamplingOptions SamplingOptions;
+
+	// tokens per kv block of the session pool
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "ATUM|Layer", meta = (ClampMin = "1"))
+	int32 KVCacheBlockSize = 16;
+
+	// blocks in the session pool, bounds the memory of all sessions together
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "ATUM|Layer", meta = (ClampMin = "1"))
+	int32 KVCacheNumBlocks = 1024;
+
+	// recent tokens every session keeps attending to, 0 keeps the whole conversation in the session pool
+	// above 0 sessions run indefinitely with SessionSinkTokens + SessionWindowTokens tokens of kv memory each
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "ATUM|Layer", meta = (ClampMin = "0"))
+	int32 SessionWindowTokens = 0;
+
+	// first tokens of a conversation that stay cached next to the window, attention leans on them
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "ATUM|Layer", meta = (ClampMin = "0"))
+	int32 SessionSinkTokens = 4;
+
+	// tokens gathered before OnTokens fires during GenerateAsync
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "ATUM|Layer", meta = (ClampMin = "1"))
+	int32 TokensPerCallback = 1;
+
+	// sequences decoded together by one StepGeneration call
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "ATUM|Layer", meta = (ClampMin = "1"))
+	int32 MaxBatchSize = 16;
+
+	// smaller model sharing the vocabulary, single sequence Generate calls decode speculatively with it
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "ATUM|Layer")
+	TObjectPtr<ULlamaUnreal> DraftModel = nullptr;
+
+	// tokens the draft model proposes per verification forward
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "ATUM|Layer", meta = (ClampMin = "1"))
+	int32 NumDraftTokens = 4;
+
+	// fill the weights randomly on initialisation, off only allocates them in the dtype of Options
+	// LoadParams and LoadFromFile initialise a layer that is not initialised yet without filling them either way
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "ATUM|Layer")
+	bool bInitializeWeights = true;
+
+	// read the tensors of each decoder layer of a .safetensors checkpoint on the intra-op threads
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "ATUM|Layer")
+	bool bParallelLoad = true;
+
+	// keep the weights of a .safetensors checkpoint on its read only mapping, they cannot require grad then
+	// off, they are copied so an optimizer can train the loaded model
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "ATUM|Layer")
+	bool bMapWeights = true;
+
+	// run the q/k/v and the gate/up projections of each layer as one matmul each after loading
+	// skipped for weights LoadParams leaves mapped, fusing would copy them off the shared mapping
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "ATUM|Layer")
+	bool bFuseProjections = true;
+
+	// format plain weights are converted to right after LoadParams
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "ATUM|Layer")
+	EAtumLlamaQuantization QuantizeOnLoad = EAtumLlamaQuantization::None;
+
+	// memory kept for the kv states of shared prompt prefixes, 0 disables prefix reuse
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "ATUM|Layer", meta = (ClampMin = "0"))
+	int32 PrefixCacheMaxMegabytes = 256;
+
+	// prefixes are matched in whole blocks of this many tokens
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "ATUM|Layer", meta = (ClampMin = "1"))
+	int32 PrefixCacheBlockSize = 64;
+
+	// allocated once with room for MaxPositionEmbeddings tokens and reused by every Generate call
+	TSharedPtr<LlamaStaticCache> KVCache = nullptr;
+
+	struct FLlamaSession
+	{
+		// paged, or a sink cache with SessionWindowTokens
+		TSharedPtr<LlamaCache> Cache;
+
+		// last sampled token, not yet run through the model
+		torch::Tensor PendingTokens;
+
+		// tokens already run through the model, the penalties look back over them
+		std::vector<int64_t> History;
+	};
+
+	std::shared_ptr<LlamaBlockPool> KVBlockPool = nullptr;
+	TMap<int32, FLlamaSession> Sessions;
+	int32 NextSessionId = 0;
+
+	// batches the requests of SubmitGeneration, shares KVBlockPool with the sessions
+	TSharedPtr<LlamaScheduler> Scheduler = nullptr;
+
+	UE_NODISCARD
+	std::shared_ptr<LlamaBlockPool> GetKVBlockPool();
+
+	// kv states of prompt prefixes shared by Generate, GenerateInSession and GenerateAsync
+	std::shared_ptr<LlamaPrefixCache> PrefixCache = nullptr;
+
+	// nullptr while prefix reuse is disabled
+	UE_NODISCARD
+	std::shared_ptr<LlamaPrefixCache> GetPrefixCache();
+
+	// cancellation flags of running GenerateAsync calls, only touched on the game thread
+	TMap<int32, TSharedPtr<std::atomic<bool>>> AsyncGenerations;
+	int32 NextAsyncGenerationId = 0;
+
+	// held by GenerateAsync workers while they use the module, so async generations run one after another
+	// game thread entry points that touch the module only try to take it and refuse to run while a worker holds it
+	std::shared_ptr<std::mutex> AsyncGenerationMutex = std::make_shared<std::mutex>();
+
+	// does not own the lock, and logs why, while an async generation uses the module
+	UE_NODISCARD
+	std::unique_lock<std::mutex> TryLockModule() const;
+
+	// set while a load initialises the layer, the weights it loads replace any initialisation
+	bool bInitializingForLoad = false;
+
+	// initialises the layer unless it already is, skipping the weight initialisation
+	bool InitializeForLoad();
+
 };
 
 #undef LOCTEXT_NAMESPACE
\ No newline at end of file
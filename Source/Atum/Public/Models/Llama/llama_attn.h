@@ -16,13 +16,15 @@ TORCH_INCLUDES_START
 TORCH_INCLUDES_END
 #include "llama_config.h"
 #include "rotary_embed.h"
+#include "llama_cache.h"
+#include "llama_linear.h"
 
 #ifndef LLAMA_ATTENTION_H
 #define LLAMA_ATTENTION_H
 
 class LlamaAttentionImpl : public torch::nn::Module {
 public:
-    LlamaAttentionImpl(const LlamaConfig& config);
+    LlamaAttentionImpl(const LlamaConfig& config, int64_t layer_idx = 0);
 
     std::tuple<torch::Tensor,  c10::optional<torch::Tensor>, c10::optional<std::tuple<torch::Tensor, torch::Tensor>>> forward(
         const torch::Tensor& hidden_states,
@@ -30,10 +32,18 @@ public:
         const c10::optional<torch::Tensor>& position_ids,
         c10::optional<std::tuple<torch::Tensor, torch::Tensor>>& past_key_value,
         bool output_attentions = false,
-        bool use_cache = false);
+        bool use_cache = false,
+        LlamaCache* cache = nullptr);
+
+    // runs q_proj, k_proj and v_proj as one projection from now on, call after loading the weights
+    void fuse_projections();
+
+    // drops the fused projection, returns whether there was one
+    bool unfuse_projections();
 
 private:
     LlamaConfig config;
+    int64_t layer_idx;
     int hidden_size;
     int num_heads;
     int head_dim;
@@ -42,7 +52,10 @@ private:
     double rope_theta;
     bool is_causal;
 
-    torch::nn::Linear q_proj, k_proj, v_proj, o_proj;
+    LlamaLinear q_proj, k_proj, v_proj, o_proj;
+
+    // concatenation of q_proj, k_proj and v_proj, not registered so checkpoints keep the separate keys
+    LlamaLinear qkv_proj = nullptr;
 
     // rotary embedding
     std::shared_ptr<LlamaRotaryEmbeddingImpl> rotary;
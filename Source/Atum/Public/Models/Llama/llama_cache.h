@@ -0,0 +1,363 @@
+#pragma once
+#include "GenericPlatform/GenericPlatformCompilerPreSetup.h"
+#include "Macros/AtumMacrosGuards.h"
+
+TORCH_INCLUDES_START
+#include <torch/torch.h>
+TORCH_INCLUDES_END
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <vector>
+#include "llama_config.h"
+
+#ifndef LLAMA_CACHE_H
+#define LLAMA_CACHE_H
+
+// the pool blocks a layer of a paged cache lives in and how its rows map onto them
+struct LlamaPagedStates {
+    // [num_blocks, block_size, num_key_value_heads, head_dim]
+    torch::Tensor keys;
+    torch::Tensor values;
+
+    // float32 [num_blocks, block_size, num_key_value_heads] for int8 pools, undefined otherwise
+    torch::Tensor key_scales;
+    torch::Tensor value_scales;
+
+    // int64 [bsz, max_blocks], token j of row i is in block block_table[i][j / block_size]
+    torch::Tensor block_table;
+
+    // cached tokens after the update, of the longest row
+    int64_t length = 0;
+};
+
+// key/value cache owned outside of the modules so it can be reset, reused and measured
+// the attention layers write into it and read back the states to attend over
+class LlamaCache {
+public:
+    virtual ~LlamaCache() = default;
+
+    // store the new key/value states of a layer and return every cached state of that layer
+    // key_states, value_states: [bsz, num_key_value_heads, seq_len, head_dim]
+    virtual std::tuple<torch::Tensor, torch::Tensor> update(
+        const torch::Tensor& key_states,
+        const torch::Tensor& value_states,
+        int64_t layer_idx) = 0;
+
+    // every cached state of a layer without storing anything, [bsz, num_key_value_heads, seq_len, head_dim]
+    virtual std::tuple<torch::Tensor, torch::Tensor> get_states(int64_t layer_idx) = 0;
+
+    // number of tokens already cached for a layer
+    virtual int64_t get_seq_length(int64_t layer_idx = 0) const = 0;
+
+    // max number of tokens the cache can hold, -1 if unbounded
+    virtual int64_t get_max_length() const = 0;
+
+    // cached tokens the next num_new_tokens tokens are appended after, they take the positions following them
+    // get_seq_length unless the cache evicts states to make room
+    virtual int64_t get_past_length(int64_t num_new_tokens, int64_t layer_idx = 0) const;
+
+    // most tokens one forward may add, -1 if any number fits
+    virtual int64_t get_max_step_length() const;
+
+    // drop every cached token, keeping the allocation
+    virtual void reset() = 0;
+
+    // roll back to the first max_length tokens
+    virtual void crop(int64_t max_length) = 0;
+
+    // bytes of memory held by the cache
+    virtual int64_t memory_bytes() const = 0;
+
+    // whether the states are stored as int8 and update_int8 can hand them out without dequantizing
+    virtual bool is_int8() const;
+
+    // like update for int8 caches, update itself returns the states dequantized
+    // returns keys, key scales, values, value scales
+    // int8 [bsz, num_key_value_heads, seq_len, head_dim] states and float32 [bsz, num_key_value_heads, seq_len] scales
+    virtual std::tuple<torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor> update_int8(
+        const torch::Tensor& key_states,
+        const torch::Tensor& value_states,
+        int64_t layer_idx);
+
+    // whether the states stay in pool blocks that update_paged hands out instead of gathering them
+    virtual bool is_paged() const;
+
+    // like update for paged caches, the tiled kernel reads the keys through the block table
+    virtual LlamaPagedStates update_paged(
+        const torch::Tensor& key_states,
+        const torch::Tensor& value_states,
+        int64_t layer_idx);
+};
+
+// the storage dtype of kv states for config, throws for formats the caches cannot hold
+torch::Dtype kv_cache_dtype(const LlamaConfig& config);
+
+
+// contiguous cache allocated once with room for max_cache_len tokens
+// new states are copied in place at the current offset, attention reads a narrowed view
+// with config.kv_cache_quantization set to Int8 the states are quantized as they are written
+class LlamaStaticCache : public LlamaCache {
+public:
+    LlamaStaticCache(
+        const LlamaConfig& config,
+        int64_t batch_size = 1,
+        int64_t max_cache_len = -1,
+        const torch::Device& device = torch::kCPU);
+
+    std::tuple<torch::Tensor, torch::Tensor> update(
+        const torch::Tensor& key_states,
+        const torch::Tensor& value_states,
+        int64_t layer_idx) override;
+
+    std::tuple<torch::Tensor, torch::Tensor> get_states(int64_t layer_idx) override;
+
+    int64_t get_seq_length(int64_t layer_idx = 0) const override;
+    int64_t get_max_length() const override;
+    void reset() override;
+    void crop(int64_t max_length) override;
+    int64_t memory_bytes() const override;
+
+    bool is_int8() const override;
+    std::tuple<torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor> update_int8(
+        const torch::Tensor& key_states,
+        const torch::Tensor& value_states,
+        int64_t layer_idx) override;
+
+    int64_t get_batch_size() const;
+
+private:
+    int64_t batch_size;
+    int64_t max_cache_len;
+
+    // dtype states are handed out in, the model dtype
+    torch::Dtype dtype;
+
+    // [batch_size, num_key_value_heads, max_cache_len, head_dim] per layer
+    std::vector<torch::Tensor> key_cache;
+    std::vector<torch::Tensor> value_cache;
+
+    // [batch_size, num_key_value_heads, max_cache_len] per layer, empty unless int8
+    std::vector<torch::Tensor> key_scales;
+    std::vector<torch::Tensor> value_scales;
+
+    // tokens written so far per layer
+    std::vector<int64_t> seq_lengths;
+
+    // stores the states at the current offset and returns the new length
+    int64_t write(const torch::Tensor& key_states, const torch::Tensor& value_states, int64_t layer_idx);
+};
+
+
+// pool of fixed-size kv blocks shared by many sequences
+// every layer stores [num_blocks, block_size, num_key_value_heads, head_dim] keys and values
+// int8 pools add [num_blocks, block_size, num_key_value_heads] float32 scales
+class LlamaBlockPool {
+public:
+    LlamaBlockPool(
+        const LlamaConfig& config,
+        int64_t num_blocks,
+        int64_t block_size = 16,
+        const torch::Device& device = torch::kCPU);
+
+    // take a free block, throws if the pool is exhausted
+    int64_t allocate();
+    void free(const std::vector<int64_t>& blocks);
+
+    int64_t get_block_size() const;
+    int64_t get_num_blocks() const;
+    int64_t get_num_free_blocks() const;
+
+    // fraction of blocks in use
+    double occupancy() const;
+    int64_t memory_bytes() const;
+
+    torch::Tensor& key_blocks(int64_t layer_idx);
+    torch::Tensor& value_blocks(int64_t layer_idx);
+
+    bool is_int8() const;
+    torch::Dtype get_dtype() const;
+    torch::Tensor& key_scale_blocks(int64_t layer_idx);
+    torch::Tensor& value_scale_blocks(int64_t layer_idx);
+
+private:
+    int64_t num_blocks;
+    int64_t block_size;
+    torch::Dtype dtype;
+
+    std::vector<torch::Tensor> key_cache;
+    std::vector<torch::Tensor> value_cache;
+    std::vector<torch::Tensor> key_scales;
+    std::vector<torch::Tensor> value_scales;
+
+    mutable std::mutex mutex;
+    std::vector<int64_t> free_blocks;
+};
+
+
+// cache of a single sequence whose states live in blocks of a shared pool
+// the block table maps token positions to pool blocks, blocks go back to the pool on reset or destruction
+class LlamaPagedCache : public LlamaCache {
+public:
+    LlamaPagedCache(const LlamaConfig& config, std::shared_ptr<LlamaBlockPool> pool);
+    ~LlamaPagedCache() override;
+
+    LlamaPagedCache(const LlamaPagedCache&) = delete;
+    LlamaPagedCache& operator=(const LlamaPagedCache&) = delete;
+
+    // key_states, value_states: [1, num_key_value_heads, seq_len, head_dim]
+    std::tuple<torch::Tensor, torch::Tensor> update(
+        const torch::Tensor& key_states,
+        const torch::Tensor& value_states,
+        int64_t layer_idx) override;
+
+    std::tuple<torch::Tensor, torch::Tensor> get_states(int64_t layer_idx) override;
+
+    int64_t get_seq_length(int64_t layer_idx = 0) const override;
+    int64_t get_max_length() const override;
+    void reset() override;
+    void crop(int64_t max_length) override;
+
+    // bytes of the blocks owned by this sequence
+    int64_t memory_bytes() const override;
+
+    bool is_int8() const override;
+    std::tuple<torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor> update_int8(
+        const torch::Tensor& key_states,
+        const torch::Tensor& value_states,
+        int64_t layer_idx) override;
+
+    // attention reads the blocks in place, only the dense fallback gathers them into a copy
+    bool is_paged() const override;
+    LlamaPagedStates update_paged(
+        const torch::Tensor& key_states,
+        const torch::Tensor& value_states,
+        int64_t layer_idx) override;
+
+    const std::vector<int64_t>& get_block_table() const;
+
+private:
+    std::shared_ptr<LlamaBlockPool> pool;
+    int64_t max_cache_len;
+
+    std::vector<int64_t> block_table;
+    torch::Tensor block_table_tensor;
+    std::vector<int64_t> seq_lengths;
+
+    void reserve(int64_t num_tokens);
+
+    // scatters the states into the blocks and returns the new length
+    int64_t write(const torch::Tensor& key_states, const torch::Tensor& value_states, int64_t layer_idx);
+
+    // [1, num_key_value_heads, num_tokens, ...] of blocks through the block table
+    torch::Tensor gather(const torch::Tensor& blocks, int64_t num_tokens) const;
+    std::tuple<torch::Tensor, torch::Tensor> gather_states(int64_t layer_idx, int64_t num_tokens) const;
+};
+
+
+// view of several single-sequence caches as one batch for a shared decode step
+// rows may hold different lengths, the returned states are right padded to the longest row
+// and the caller masks the padding out
+class LlamaBatchCache : public LlamaCache {
+public:
+    explicit LlamaBatchCache(std::vector<LlamaCache*> caches);
+
+    // key_states, value_states: [num_rows, num_key_value_heads, seq_len, head_dim]
+    std::tuple<torch::Tensor, torch::Tensor> update(
+        const torch::Tensor& key_states,
+        const torch::Tensor& value_states,
+        int64_t layer_idx) override;
+
+    std::tuple<torch::Tensor, torch::Tensor> get_states(int64_t layer_idx) override;
+
+    // longest row
+    int64_t get_seq_length(int64_t layer_idx = 0) const override;
+
+    // shortest row limit
+    int64_t get_max_length() const override;
+    void reset() override;
+    void crop(int64_t max_length) override;
+    int64_t memory_bytes() const override;
+
+    // int8 when every row is
+    bool is_int8() const override;
+    std::tuple<torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor> update_int8(
+        const torch::Tensor& key_states,
+        const torch::Tensor& value_states,
+        int64_t layer_idx) override;
+
+    // paged when every row is, the rows must share one pool
+    // the block tables are right padded with block 0, the mask hides the positions past each row
+    bool is_paged() const override;
+    LlamaPagedStates update_paged(
+        const torch::Tensor& key_states,
+        const torch::Tensor& value_states,
+        int64_t layer_idx) override;
+
+private:
+    std::vector<LlamaCache*> caches;
+
+    std::tuple<torch::Tensor, torch::Tensor> pad_and_cat(std::vector<torch::Tensor>& keys, std::vector<torch::Tensor>& values) const;
+
+    // right pads rows of states or scales to max_len tokens and concatenates them
+    static torch::Tensor cat_rows(std::vector<torch::Tensor>& rows, int64_t max_len);
+};
+
+// bounded cache for conversations that never end
+// keeps the first num_sink_tokens tokens, which draw attention whatever they hold, and the latest window_length tokens
+// positions count from the start of the cache, so they stay below num_sink_tokens + window_length forever
+// a full window drops its oldest quarter at once and the keys left are rotated back by as many positions,
+// so every key is re-rotated a handful of times instead of on every step
+class LlamaSinkCache : public LlamaCache {
+public:
+    LlamaSinkCache(
+        const LlamaConfig& config,
+        int64_t num_sink_tokens = 4,
+        int64_t window_length = 1020,
+        int64_t batch_size = 1,
+        const torch::Device& device = torch::kCPU);
+
+    std::tuple<torch::Tensor, torch::Tensor> update(
+        const torch::Tensor& key_states,
+        const torch::Tensor& value_states,
+        int64_t layer_idx) override;
+
+    std::tuple<torch::Tensor, torch::Tensor> get_states(int64_t layer_idx) override;
+
+    int64_t get_seq_length(int64_t layer_idx = 0) const override;
+
+    // -1, old tokens are evicted instead
+    int64_t get_max_length() const override;
+    void reset() override;
+    void crop(int64_t max_length) override;
+    int64_t memory_bytes() const override;
+
+    int64_t get_past_length(int64_t num_new_tokens, int64_t layer_idx = 0) const override;
+
+    // window_length, longer prompts are fed in chunks
+    int64_t get_max_step_length() const override;
+
+    int64_t get_num_sink_tokens() const;
+    int64_t get_window_length() const;
+
+private:
+    int64_t num_sink_tokens;
+    int64_t window_length;
+    int64_t batch_size;
+
+    // [head_dim / 2] float64 rotary frequencies of the model
+    torch::Tensor inv_freq;
+
+    // [batch_size, num_key_value_heads, num_sink_tokens + window_length, head_dim] per layer
+    std::vector<torch::Tensor> key_cache;
+    std::vector<torch::Tensor> value_cache;
+    std::vector<int64_t> seq_lengths;
+
+    // window tokens dropped before num_new_tokens more are stored
+    int64_t num_to_evict(int64_t num_new_tokens, int64_t layer_idx) const;
+
+    // drops the oldest num_tokens window tokens and moves the rest down
+    void evict(int64_t num_tokens, int64_t layer_idx);
+};
+
+#endif // LLAMA_CACHE_H
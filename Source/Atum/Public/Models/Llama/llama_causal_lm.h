@@ -5,10 +5,14 @@
 TORCH_INCLUDES_START
 #include <torch/torch.h>
 TORCH_INCLUDES_END
+#include <functional>
 #include <tuple>
 #include <vector>
 #include "llama_config.h"
+#include "llama_linear.h"
 #include "llama_model.h"
+#include "llama_prefix_cache.h"
+#include "llama_sampling.h"
 
 
 #ifndef LLAMA_CAUSAL_LM_H
@@ -18,6 +22,8 @@ class LlamaCausalLMImpl : public torch::nn::Module {
 public:
     LlamaCausalLMImpl(const LlamaConfig& config);
 
+    // num_logits_to_keep > 0 runs lm_head only over that many last positions, the logits are [bsz, num_logits_to_keep, vocab]
+    // generation only samples from the last one, 0 keeps every position, as computing a loss from labels always does
     std::tuple<torch::Tensor, c10::optional<torch::Tensor>, std::vector<std::tuple<at::Tensor, at::Tensor>>, std::vector<torch::Tensor>, std::vector<c10::optional<torch::Tensor>>> forward(
         const c10::optional<torch::Tensor> input_ids = {},
         c10::optional<torch::Tensor> attention_mask = {},
@@ -27,19 +33,61 @@ public:
         const std::vector<std::tuple<torch::Tensor, torch::Tensor>>& past_key_values = {},
         bool output_attentions = false,
         bool output_hidden_states = false,
-        bool use_cache = false);
+        bool use_cache = false,
+        LlamaCache* cache = nullptr,
+        int64_t num_logits_to_keep = 0);
 
+    // input_ids continue whatever is already stored in cache
+    // without a cache, one sized for this call is allocated
+    // a row stops at its first stop token and is padded with pad_token_id (eos if unset) afterwards
+    // streamer gets the [bsz, 1] tokens of every step, returning false stops the generation
+    // a single prompt starting on an empty cache reuses and feeds prefix_cache
+    // past_tokens are the tokens of a single sequence cached before input_ids, only the penalties read them
     torch::Tensor generate(
         torch::Tensor& input_ids,
-        const int32_t num_new_tokens = 10
+        const int32_t num_new_tokens = 10,
+        LlamaCache* cache = nullptr,
+        const LlamaSamplingOptions& sampling = LlamaSamplingOptions(),
+        const std::function<bool(const torch::Tensor&)>& streamer = nullptr,
+        LlamaPrefixCache* prefix_cache = nullptr,
+        const std::vector<int64_t>& past_tokens = {}
+    );
+
+    // speculative decoding of a single [1, seq_len] sequence
+    // draft proposes num_draft_tokens tokens one by one, this model checks all of them in one forward
+    // accepted tokens follow the distribution of this model, rejected ones are cropped from both caches
+    // draft must share the vocabulary, both caches must hold the same prefix
+    torch::Tensor speculative_generate(
+        torch::Tensor& input_ids,
+        LlamaCausalLMImpl& draft,
+        const int32_t num_new_tokens = 10,
+        const int64_t num_draft_tokens = 4,
+        LlamaCache* cache = nullptr,
+        LlamaCache* draft_cache = nullptr,
+        const LlamaSamplingOptions& sampling = LlamaSamplingOptions(),
+        const std::function<bool(const torch::Tensor&)>& streamer = nullptr
     );
     
 
+    // quantizes the projections of every layer in place, call after loading plain weights
+    // lm_head stays in config.dtype unless include_lm_head, and always when it is tied to the embeddings
+    // fused projections are dropped first and fused again from the quantized parts
+    void quantize(LlamaQuantization format, int64_t group_size = 64, bool include_lm_head = false);
+
+    // lets every layer run its q/k/v and gate/up projections on fused weights, checkpoint keys stay the same
+    // call after loading, quantizing or moving the weights, stale fusions fall back to the separate projections
+    void fuse_projections();
+
+    // back to the separate projections, returns whether any layer was fused
+    bool unfuse_projections();
+
     LlamaConfig config;
 
 private:
     LlamaModel model = nullptr;
-    torch::nn::Linear lm_head = nullptr;
+
+    // nullptr with config.tie_word_embeddings, the logits then come from the embedding weight
+    LlamaLinear lm_head = nullptr;
 
 };
 
@@ -10,6 +10,16 @@ TORCH_INCLUDES_START
 TORCH_INCLUDES_END
 
 
+// storage format of the linear projection weights
+enum class LlamaQuantization {
+    None,
+    // int8 weights with one float scale per output channel
+    Int8,
+    // 4-bit weights with a float16 scale and zero point per group of input features
+    Int4
+};
+
+
 struct LlamaConfig {
     int vocab_size = 32000;
     int hidden_size = 4096;
@@ -37,5 +47,21 @@ struct LlamaConfig {
     // torch dtype
     torch::Dtype dtype = torch::kBFloat16;
 
+    // format the linear weights are stored and loaded in
+    LlamaQuantization quantization = LlamaQuantization::None;
+
+    // input features sharing one scale in Int4
+    int quantization_group_size = 64;
+
+    // lm_head follows quantization instead of staying in dtype
+    bool quantize_lm_head = false;
+
+    // false allocates the weights in dtype without filling them, for models whose weights are loaded right away
+    bool init_weights = true;
+
+    // format the kv caches built from this config keep their states in
+    // Int8 stores one float32 scale per head and token, Int4 is not supported
+    LlamaQuantization kv_cache_quantization = LlamaQuantization::None;
+
 };
 
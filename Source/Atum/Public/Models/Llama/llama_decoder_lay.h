@@ -17,7 +17,7 @@ TORCH_INCLUDES_END
 
 class LlamaDecoderLayerImpl : public torch::nn::Module {
 public:
-    LlamaDecoderLayerImpl(const LlamaConfig& config);
+    LlamaDecoderLayerImpl(const LlamaConfig& config, int64_t layer_idx = 0);
 
     std::tuple<torch::Tensor, c10::optional<torch::Tensor>, c10::optional<std::tuple<torch::Tensor, torch::Tensor>>> forward(
         torch::Tensor& hidden_states,
@@ -25,7 +25,8 @@ public:
         const c10::optional<torch::Tensor>& position_ids,
         c10::optional<std::tuple<torch::Tensor, torch::Tensor>>& past_key_value,
         bool output_attentions = false,
-        bool use_cache = false);
+        bool use_cache = false,
+        LlamaCache* cache = nullptr);
 
 private:
     LlamaConfig config;
@@ -0,0 +1,130 @@
+#pragma once
+#include "GenericPlatform/GenericPlatformCompilerPreSetup.h"
+#include "Macros/AtumMacrosGuards.h"
+
+TORCH_INCLUDES_START
+#include <torch/torch.h>
+TORCH_INCLUDES_END
+#include <cstdint>
+#include <initializer_list>
+#include <tuple>
+
+#ifndef LLAMA_KERNELS_H
+#define LLAMA_KERNELS_H
+
+// cpu kernels for inference, the weights stay quantized and are expanded one row at a time
+
+// x @ (qweight * scales[:, None]).T
+// x: [..., in_features], qweight: int8 [out_features, in_features], scales: float32 [out_features]
+torch::Tensor int8_linear(const torch::Tensor& x, const torch::Tensor& qweight, const torch::Tensor& scales);
+
+// per output channel symmetric quantization of a [out_features, in_features] weight
+// returns int8 weights and float32 scales
+std::tuple<torch::Tensor, torch::Tensor> quantize_int8(const torch::Tensor& weight);
+
+// x @ dequantize_int4(qweight, scales, zeros, group_size).T
+// qweight: uint8 [out_features, in_features / 2] holding two 4-bit values per byte, low nibble first
+// scales, zeros: float16 [out_features, in_features / group_size]
+// uses avx2 or avx-512 when the cpu has them and group_size is a multiple of 32
+torch::Tensor int4_linear(
+    const torch::Tensor& x,
+    const torch::Tensor& qweight,
+    const torch::Tensor& scales,
+    const torch::Tensor& zeros,
+    int64_t group_size);
+
+// asymmetric quantization of groups of group_size input features, w = (q - zero) * scale
+// returns packed weights, scales and zeros as expected by int4_linear
+std::tuple<torch::Tensor, torch::Tensor, torch::Tensor> quantize_int4(const torch::Tensor& weight, int64_t group_size);
+
+// float32 [out_features, in_features]
+torch::Tensor dequantize_int4(
+    const torch::Tensor& qweight,
+    const torch::Tensor& scales,
+    const torch::Tensor& zeros,
+    int64_t group_size);
+
+// whether grad mode is on and autograd tracks any of the tensors
+// the kernels below write through raw pointers or in place and would cut such tensors off the graph
+bool requires_autograd(std::initializer_list<torch::Tensor> tensors);
+
+// gate_up: [..., 2 * intermediate_size] holding the gate followed by the up projection
+// writes silu(gate) * up over the gate half and returns it as a view, no temporaries are allocated
+// float32, bfloat16 and float16 cpu inputs are done in one pass, avx2 for the first two
+// a gate_up tracked by autograd gets a new tensor instead
+torch::Tensor silu_mul_(const torch::Tensor& gate_up);
+
+// x * rsqrt(mean(x^2) + eps) * weight over the last dimension, accumulated in float32
+// float32, bfloat16 and float16 cpu inputs are done in one kernel, avx2 for the first two
+// inputs tracked by autograd take the plain torch ops
+torch::Tensor rms_norm(const torch::Tensor& x, const torch::Tensor& weight, double eps);
+
+// adds residual to x in place and returns rms_norm of the sum, x then holds the next residual
+torch::Tensor add_rms_norm_(const torch::Tensor& x, const torch::Tensor& residual, const torch::Tensor& weight, double eps);
+
+// rotates q and k in place by the angles of their positions
+// q: [batch, heads, seq_len, head_dim], k: [batch, kv_heads, seq_len, head_dim], the last dimension contiguous
+// cos, sin: [positions, head_dim] tables in the dtype of q whose two halves repeat, position_ids: [batch or 1, seq_len]
+// position ids are not range checked, LlamaModelImpl::forward checks them once against the tables every layer asks for
+// throws for q or k tracked by autograd, apply_rotary_pos_emb rotates those out of place
+void rotary_embedding_(
+    const torch::Tensor& q,
+    const torch::Tensor& k,
+    const torch::Tensor& cos,
+    const torch::Tensor& sin,
+    const torch::Tensor& position_ids);
+
+// tiled_attention over an int8 kv cache, each key block is dequantized inside the kernel as it is loaded
+// k, v: int8 [batch, kv_heads, kv_seq_len, head_dim], k_scales, v_scales: float32 [batch, kv_heads, kv_seq_len]
+torch::Tensor tiled_attention_int8(
+    const torch::Tensor& q,
+    const torch::Tensor& k,
+    const torch::Tensor& k_scales,
+    const torch::Tensor& v,
+    const torch::Tensor& v_scales,
+    const c10::optional<torch::Tensor>& attention_mask,
+    bool causal,
+    double scale);
+
+// symmetric quantization of kv states [..., head_dim] with one float32 scale per head and token
+// returns int8 states and float32 [...] scales
+std::tuple<torch::Tensor, torch::Tensor> quantize_kv_int8(const torch::Tensor& states);
+
+// states * scales[..., None] in dtype
+torch::Tensor dequantize_kv_int8(const torch::Tensor& states, const torch::Tensor& scales, torch::Dtype dtype);
+
+// whether tiled_attention takes activations like x, cpu float32, bfloat16 or float16 with grad mode off
+// without a padding mask the model then leaves causality to the kernel and builds no mask
+// with grad mode on, attention and the model both take the dense path and its explicit causal mask
+bool supports_tiled_attention(const torch::Tensor& x);
+
+// softmax(q @ k.T * scale + mask) @ v in key blocks with an online softmax, memory stays linear in the sequence
+// q: [batch, heads, seq_len, head_dim], k, v: [batch, kv_heads, kv_seq_len, head_dim], each kv head serves heads / kv_heads query heads
+// causal hides keys after each query, which are taken to be the last seq_len positions, and skips their blocks
+// attention_mask: optional additive [batch, 1, seq_len, kv_seq_len], broadcast dims allowed
+// returns [batch, heads, seq_len, head_dim] as a transposed view, so transposing back to [batch, seq_len, heads, head_dim] is free
+torch::Tensor tiled_attention(
+    const torch::Tensor& q,
+    const torch::Tensor& k,
+    const torch::Tensor& v,
+    const c10::optional<torch::Tensor>& attention_mask,
+    bool causal,
+    double scale);
+
+// tiled_attention over the pool blocks of a paged cache, key rows are read through the block table instead of gathered
+// k_blocks, v_blocks: [num_blocks, block_size, kv_heads, head_dim] in the dtype of q,
+// or int8 with float32 [num_blocks, block_size, kv_heads] k_scales and v_scales, which are undefined otherwise
+// block_table: int64 [batch, max_blocks], every row reads kv_len tokens and attention_mask hides those past its own length
+torch::Tensor paged_attention(
+    const torch::Tensor& q,
+    const torch::Tensor& k_blocks,
+    const torch::Tensor& v_blocks,
+    const torch::Tensor& k_scales,
+    const torch::Tensor& v_scales,
+    const torch::Tensor& block_table,
+    int64_t kv_len,
+    const c10::optional<torch::Tensor>& attention_mask,
+    bool causal,
+    double scale);
+
+#endif // LLAMA_KERNELS_H
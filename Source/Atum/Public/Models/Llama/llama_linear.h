@@ -0,0 +1,71 @@
+#pragma once
+#include "GenericPlatform/GenericPlatformCompilerPreSetup.h"
+#include "Macros/AtumMacrosGuards.h"
+
+TORCH_INCLUDES_START
+#include <torch/torch.h>
+TORCH_INCLUDES_END
+#include "llama_config.h"
+
+#ifndef LLAMA_LINEAR_H
+#define LLAMA_LINEAR_H
+
+// bias free projection whose weight can be kept quantized
+// the plain weight keeps the "weight" key of torch::nn::Linear so existing archives load unchanged
+// quantized layers also store "qweight", "scales" and for Int4 "zeros", built quantized they load those from a quantized archive
+class LlamaLinearImpl : public torch::nn::Module {
+public:
+    LlamaLinearImpl(
+        int64_t in_features,
+        int64_t out_features,
+        LlamaQuantization quantization = LlamaQuantization::None,
+        int64_t group_size = 64,
+        torch::Dtype dtype = torch::kFloat32,
+        bool init_weights = true);
+
+    // x: [..., in_features] -> [..., out_features]
+    torch::Tensor forward(const torch::Tensor& x);
+
+    // converts the loaded weight and frees it
+    void quantize(LlamaQuantization format, int64_t new_group_size = 64);
+
+    // one projection over the concatenated outputs of parts, which must share input size and format
+    // the tensors of every part become views into the fused ones, so the parts keep their keys and memory
+    static std::shared_ptr<LlamaLinearImpl> fuse(const std::vector<std::shared_ptr<LlamaLinearImpl>>& parts);
+
+    // false once loading or moving the module gave this part storage of its own
+    bool is_part_of(const LlamaLinearImpl& fused) const;
+
+    LlamaQuantization get_quantization() const;
+    int64_t get_in_features() const;
+    int64_t get_out_features() const;
+
+    // dtype changes only apply to the plain weight, quantized buffers keep their format
+    void to(torch::Device device, torch::Dtype dtype, bool non_blocking = false) override;
+    void to(torch::Dtype dtype, bool non_blocking = false) override;
+    void to(torch::Device device, bool non_blocking = false) override;
+
+    // [out_features, in_features], empty once quantized
+    torch::Tensor weight;
+
+    // Int8: int8 [out_features, in_features] and float32 [out_features]
+    // Int4: packed uint8 [out_features, in_features / 2] and float16 [out_features, in_features / group_size] scales and zeros
+    torch::Tensor qweight;
+    torch::Tensor scales;
+    torch::Tensor zeros;
+
+private:
+    int64_t in_features;
+    int64_t out_features;
+    LlamaQuantization quantization;
+    int64_t group_size;
+
+    void register_quantized(
+        const torch::Tensor& new_qweight,
+        const torch::Tensor& new_scales,
+        const torch::Tensor& new_zeros = torch::Tensor());
+};
+
+TORCH_MODULE(LlamaLinear);
+
+#endif // LLAMA_LINEAR_H
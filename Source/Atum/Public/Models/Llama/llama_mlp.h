@@ -6,6 +6,7 @@ TORCH_INCLUDES_START
 #include <torch/torch.h>
 TORCH_INCLUDES_END
 #include "llama_config.h"
+#include "llama_linear.h"
 
 #ifndef LLAMA_MLP_H
 #define LLAMA_MLP_H
@@ -19,12 +20,21 @@ public:
 
     torch::Tensor forward(const torch::Tensor& x);
 
+    // runs gate_proj and up_proj as one projection from now on, call after loading the weights
+    void fuse_projections();
+
+    // drops the fused projection, returns whether there was one
+    bool unfuse_projections();
+
 
 private:
     int hidden_size;
     int intermediate_size;
 
-    torch::nn::Linear gate_proj, up_proj, down_proj = nullptr;
+    LlamaLinear gate_proj, up_proj, down_proj = nullptr;
+
+    // concatenation of gate_proj and up_proj, not registered so checkpoints keep the separate keys
+    LlamaLinear gate_up_proj = nullptr;
 
 
 };
@@ -10,6 +10,7 @@ TORCH_INCLUDES_END
 #include <vector>
 #include "llama_config.h"
 #include "llama_rms.h"
+#include "llama_cache.h"
 #include <variant>
 
 #ifndef LLAMA_MODEL_H
@@ -32,7 +33,8 @@ public:
         const std::vector<std::tuple<torch::Tensor, torch::Tensor>>& past_key_values = {},
         c10::optional<bool> output_attentions = {},
         c10::optional<bool> output_hidden_states = {},
-        c10::optional<bool> use_cache = {});
+        c10::optional<bool> use_cache = {},
+        LlamaCache* cache = nullptr);
 
 
     // basic generate
@@ -41,6 +43,9 @@ public:
         const int32_t num_new_tokens
     );
 
+    // [vocab_size, hidden_size] embedding weight, also the output projection when word embeddings are tied
+    const torch::Tensor& get_input_embeddings() const;
+
 private:
     LlamaConfig config;
 
@@ -48,6 +53,17 @@ private:
     torch::nn::ModuleList layers = nullptr;
     LlamaRMSNorm rms_norm = nullptr;
 
+    // additive [n, n] causal mask, the dense attention path takes views of it
+    torch::Tensor causal_mask_cache;
+
+    // [batch_size, 1, query_length, key_value_length] view of causal_mask_cache
+    torch::Tensor causal_mask(
+        int64_t batch_size,
+        int64_t query_length,
+        int64_t key_value_length,
+        const at::ScalarType& dtype,
+        const torch::Device& device);
+
 
 };
 
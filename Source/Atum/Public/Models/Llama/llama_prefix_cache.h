@@ -0,0 +1,80 @@
+#pragma once
+#include "GenericPlatform/GenericPlatformCompilerPreSetup.h"
+#include "Macros/AtumMacrosGuards.h"
+
+TORCH_INCLUDES_START
+#include <torch/torch.h>
+TORCH_INCLUDES_END
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "llama_cache.h"
+
+#ifndef LLAMA_PREFIX_CACHE_H
+#define LLAMA_PREFIX_CACHE_H
+
+// kv states of prompt prefixes seen before, reused by every later prompt starting the same way
+// prompts are cut into blocks of block_size tokens, each block is keyed by a hash of its tokens and of the block before it
+// so a block only matches behind the exact same prefix
+// least recently used blocks are evicted once the stored states exceed max_bytes
+class LlamaPrefixCache {
+public:
+    LlamaPrefixCache(const LlamaConfig& config, int64_t max_bytes, int64_t block_size = 64);
+
+    // writes the longest known prefix of tokens into an empty cache and returns its length
+    // the last token is never loaded, so the caller always has a token left to run
+    int64_t load(const int64_t* tokens, int64_t num_tokens, LlamaCache& cache);
+
+    // remembers the full blocks of tokens whose states are in cache, tokens[0] sits at cache position 0
+    void store(const int64_t* tokens, int64_t num_tokens, LlamaCache& cache);
+
+    void clear();
+
+    int64_t memory_bytes() const;
+    int64_t get_num_blocks() const;
+    int64_t get_block_size() const;
+
+private:
+    struct Block {
+        uint64_t hash = 0;
+        uint64_t parent_hash = 0;
+
+        // kept to tell hash collisions apart
+        std::vector<int64_t> tokens;
+
+        // [1, num_key_value_heads, block_size, head_dim] per layer
+        std::vector<torch::Tensor> keys;
+        std::vector<torch::Tensor> values;
+        int64_t bytes = 0;
+
+        // hashes of the blocks stored behind this one
+        std::vector<uint64_t> children;
+    };
+
+    int64_t num_layers;
+    int64_t max_bytes;
+    int64_t block_size;
+    int64_t used_bytes = 0;
+
+    // most recently used first
+    std::list<Block> blocks;
+    std::unordered_map<uint64_t, std::list<Block>::iterator> index;
+
+    mutable std::mutex mutex;
+
+    static uint64_t hash_block(uint64_t parent_hash, const int64_t* tokens, int64_t count);
+
+    // end() unless the block is stored behind parent_hash
+    std::list<Block>::iterator find(uint64_t hash, uint64_t parent_hash, const int64_t* tokens);
+
+    // moves a chain of blocks, root first, to the front with the root most recent
+    void touch(const std::vector<std::list<Block>::iterator>& chain);
+
+    // drops a block together with every block behind it, which could never be matched again
+    void remove(std::list<Block>::iterator it);
+    void evict();
+};
+
+#endif // LLAMA_PREFIX_CACHE_H
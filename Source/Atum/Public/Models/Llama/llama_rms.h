@@ -17,6 +17,11 @@ public:
 
     torch::Tensor forward(torch::Tensor& x);
 
+    // x += residual in place, then the norm of the sum
+    // saves the separate residual add and its allocation between the attention and the mlp
+    // when autograd tracks the inputs, x is rebound to a new sum so the graph keeps both summands
+    torch::Tensor forward_residual(torch::Tensor& x, const torch::Tensor& residual);
+
 private:
     double variance_epsilon;
 
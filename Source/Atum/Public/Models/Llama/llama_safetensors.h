@@ -0,0 +1,71 @@
+#pragma once
+#include "GenericPlatform/GenericPlatformCompilerPreSetup.h"
+#include "Macros/AtumMacrosGuards.h"
+
+TORCH_INCLUDES_START
+#include <torch/torch.h>
+TORCH_INCLUDES_END
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#ifndef LLAMA_SAFETENSORS_H
+#define LLAMA_SAFETENSORS_H
+
+struct LlamaMappedFile;
+
+// memory mapped safetensors checkpoint
+// tensors are wrapped over the mapping without a copy whenever dtype and alignment allow,
+// so the weights stay in the page cache and every process mapping the same file shares them
+// the mapped pages are read only, the mapping lives as long as any tensor taken from it
+class LlamaSafetensors {
+public:
+    explicit LlamaSafetensors(const std::string& path);
+
+    std::vector<std::string> keys() const;
+    bool contains(const std::string& key) const;
+
+    // a view of the mapping, or a copy when it is stored in another dtype than the one asked for or misaligned
+    torch::Tensor get(const std::string& key, c10::optional<torch::ScalarType> dtype = c10::nullopt) const;
+
+    // points every parameter and buffer of module that the file holds at its tensor, converted to the dtype of the module
+    // goes one decoder layer at a time, parallel reads the tensors of a layer on the intra-op threads
+    // a module in eval mode keeps views of the read only mapping and its mapped parameters stop requiring grad,
+    // a module in training mode gets writable copies so optimizers and in place ops can update them
+    // returns the names of the module tensors the file does not hold
+    std::vector<std::string> load_into(torch::nn::Module& module, bool parallel = true) const;
+
+private:
+    struct Entry {
+        torch::ScalarType dtype;
+        std::vector<int64_t> shape;
+        int64_t begin;
+        int64_t end;
+    };
+
+    std::shared_ptr<LlamaMappedFile> file;
+
+    // first byte after the header, data_offsets count from here
+    const uint8_t* data = nullptr;
+    int64_t data_size = 0;
+
+    std::unordered_map<std::string, Entry> entries;
+
+    // the stored tensor for target, in its dtype and on its device
+    torch::Tensor read_into(const std::string& name, const torch::Tensor& target) const;
+
+    // whether tensor still points into the mapping
+    bool is_mapped(const torch::Tensor& tensor) const;
+};
+
+// loads a .safetensors file, or every one of them in a directory for sharded checkpoints, into module
+// throws if a parameter or buffer of module is in none of them
+// call module.eval() first to keep the weights mapped, they are then read only and frozen, see LlamaSafetensors::load_into
+void load_safetensors(torch::nn::Module& module, const std::string& path, bool parallel = true);
+
+// writes every parameter and buffer of module, streamed one tensor at a time
+// quantized modules load back into a model built with the same quantization
+void save_safetensors(const torch::nn::Module& module, const std::string& path);
+
+#endif // LLAMA_SAFETENSORS_H
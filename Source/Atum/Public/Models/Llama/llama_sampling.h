@@ -0,0 +1,84 @@
+#pragma once
+#include "GenericPlatform/GenericPlatformCompilerPreSetup.h"
+#include "Macros/AtumMacrosGuards.h"
+
+TORCH_INCLUDES_START
+#include <c10/util/Optional.h>
+#include <torch/torch.h>
+TORCH_INCLUDES_END
+#include <cstdint>
+#include <random>
+#include <vector>
+
+#ifndef LLAMA_SAMPLING_H
+#define LLAMA_SAMPLING_H
+
+struct LlamaSamplingOptions {
+    // greedy decoding when false
+    bool do_sample = false;
+    double temperature = 1.0;
+
+    // 0 keeps every token
+    int64_t top_k = 0;
+    double top_p = 1.0;
+
+    // > 1 discourages tokens that already appeared
+    double repetition_penalty = 1.0;
+
+    // subtracted once per previous occurrence / once if the token occurred at all
+    double frequency_penalty = 0.0;
+    double presence_penalty = 0.0;
+
+    // random seed when unset
+    c10::optional<uint64_t> seed = c10::nullopt;
+
+    // generation of a sequence stops once it samples one of these, eos included unless ignore_eos
+    std::vector<int64_t> stop_token_ids;
+    bool ignore_eos = false;
+};
+
+
+// turns the logits of one sequence into its next token
+// runs on the cpu over the raw logits and only partially orders the vocabulary
+class LlamaSampler {
+public:
+    LlamaSampler(const LlamaSamplingOptions& options, int64_t eos_token_id);
+
+    // logits: [vocab], history: every token of the sequence so far
+    int64_t sample(const torch::Tensor& logits, const int64_t* history, int64_t history_length);
+    int64_t sample(const torch::Tensor& logits, const std::vector<int64_t>& history);
+
+    // full next-token distribution the sampler would draw from, [vocab] summing to one
+    // greedy sampling gives a one-hot distribution
+    std::vector<float> distribution(const torch::Tensor& logits, const int64_t* history, int64_t history_length);
+
+    // draws from an unnormalised distribution over the vocabulary
+    int64_t draw(const std::vector<float>& weights);
+
+    // uniform number in [0, 1) from the sampler's stream
+    double uniform();
+
+    bool is_stop_token(int64_t token) const;
+
+    const LlamaSamplingOptions& get_options() const;
+
+private:
+    LlamaSamplingOptions options;
+    std::vector<int64_t> stop_tokens;
+    std::mt19937_64 generator;
+
+    // scratch buffers reused between calls
+    std::vector<float> scores;
+    std::vector<int64_t> candidates;
+    std::vector<float> probs;
+
+    void load_scores(const torch::Tensor& logits);
+    void apply_penalties(const int64_t* history, int64_t history_length);
+    int64_t argmax() const;
+
+    // fills candidates/probs with the smallest sorted set of tokens allowed by top_k and top_p
+    void select_candidates();
+    int64_t draw();
+};
+
+#endif // LLAMA_SAMPLING_H
@@ -0,0 +1,91 @@
+#pragma once
+#include "GenericPlatform/GenericPlatformCompilerPreSetup.h"
+#include "Macros/AtumMacrosGuards.h"
+
+TORCH_INCLUDES_START
+#include <torch/torch.h>
+TORCH_INCLUDES_END
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include "llama_cache.h"
+#include "llama_causal_lm.h"
+#include "llama_sampling.h"
+
+#ifndef LLAMA_SCHEDULER_H
+#define LLAMA_SCHEDULER_H
+
+struct LlamaSequence {
+    int64_t id = 0;
+
+    // prompt followed by every generated token
+    std::vector<int64_t> tokens;
+    int64_t prompt_length = 0;
+    int64_t max_new_tokens = 0;
+
+    // tokens of this sequence already stored in its cache
+    std::unique_ptr<LlamaPagedCache> cache;
+    std::unique_ptr<LlamaSampler> sampler;
+
+    // why the request failed, empty while it did not
+    std::string error;
+
+    int64_t num_generated() const { return static_cast<int64_t>(tokens.size()) - prompt_length; }
+};
+
+
+// continuous batching over a shared block pool
+// every step admits waiting requests, then runs one batched decode forward for all running sequences
+// finished sequences leave the batch right away so new requests can take their place
+class LlamaScheduler {
+public:
+    LlamaScheduler(
+        std::shared_ptr<LlamaCausalLMImpl> model,
+        std::shared_ptr<LlamaBlockPool> pool,
+        int64_t max_batch_size = 16);
+
+    // input_ids: [1, seq_len] or [seq_len]
+    // throws for empty prompts and prompts the whole pool could not hold
+    int64_t submit(
+        const torch::Tensor& input_ids,
+        int64_t max_new_tokens,
+        const LlamaSamplingOptions& sampling = LlamaSamplingOptions());
+
+    // one scheduling iteration
+    void step();
+
+    bool has_unfinished() const;
+    bool is_finished(int64_t id) const;
+
+    // [1, prompt_len + generated] of a finished request, removed from the scheduler
+    // throws why a failed request failed instead, it is removed all the same
+    torch::Tensor take_result(int64_t id);
+
+    // drop a request wherever it is, its blocks go back to the pool
+    void cancel(int64_t id);
+
+    int64_t get_num_running() const;
+    int64_t get_num_waiting() const;
+
+private:
+    std::shared_ptr<LlamaCausalLMImpl> model;
+    std::shared_ptr<LlamaBlockPool> pool;
+    int64_t max_batch_size;
+    int64_t next_id = 0;
+
+    std::deque<std::unique_ptr<LlamaSequence>> waiting;
+    std::vector<std::unique_ptr<LlamaSequence>> running;
+    std::map<int64_t, std::unique_ptr<LlamaSequence>> finished;
+
+    int64_t blocks_for(int64_t num_tokens) const;
+    void admit();
+    void prefill(LlamaSequence& sequence);
+    void decode();
+    void preempt_until_fits();
+    void retire_finished();
+    bool should_stop(const LlamaSequence& sequence) const;
+};
+
+#endif // LLAMA_SCHEDULER_H
@@ -0,0 +1,112 @@
+#pragma once
+#include "GenericPlatform/GenericPlatformCompilerPreSetup.h"
+#include "Macros/AtumMacrosGuards.h"
+
+TORCH_INCLUDES_START
+#include <torch/torch.h>
+TORCH_INCLUDES_END
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#ifndef LLAMA_TOKENIZER_H
+#define LLAMA_TOKENIZER_H
+
+// sentencepiece style bpe tokenizer of llama 1 and 2, read from a tokenizer.model or a tokenizer.json
+// spaces become "▁" and text without a piece falls back to byte tokens "<0xXX>" when the vocabulary has them
+// byte level tokenizers (llama 3) and unigram models are rejected
+class LlamaTokenizer {
+public:
+    enum class PieceType : uint8_t { Normal, Unknown, Control, UserDefined, Byte, Unused };
+
+    explicit LlamaTokenizer(const std::string& path);
+
+    LlamaTokenizer(const LlamaTokenizer&) = delete;
+    LlamaTokenizer& operator=(const LlamaTokenizer&) = delete;
+
+    std::vector<int64_t> encode(const std::string& text, bool add_bos = true) const;
+
+    // every text is encoded on the intra-op threads
+    std::vector<std::vector<int64_t>> encode_batch(const std::vector<std::string>& texts, bool add_bos = true) const;
+
+    // utf-8 text of ids, control and unknown tokens are skipped
+    // the space a leading "▁" stands for is dropped, as sentencepiece does
+    std::string decode(const int64_t* ids, int64_t num_ids) const;
+    std::string decode(const std::vector<int64_t>& ids) const;
+
+    // the bytes id stands for, empty for control tokens and ids outside the vocabulary
+    const std::string& token_bytes(int64_t id) const;
+
+    // -1 for pieces outside the vocabulary
+    int64_t token_to_id(const std::string& piece) const;
+
+    int64_t vocab_size() const;
+    int64_t get_bos_id() const;
+    int64_t get_eos_id() const;
+    int64_t get_unk_id() const;
+    bool get_add_dummy_prefix() const;
+
+private:
+    struct Merge {
+        int32_t rank;
+        int32_t id;
+    };
+
+    std::vector<std::string> pieces;
+    std::vector<PieceType> types;
+
+    // decoded bytes of every piece
+    std::vector<std::string> bytes;
+
+    // views into pieces, which are never modified after loading
+    std::unordered_map<std::string_view, int32_t> piece_ids;
+
+    // keyed by the ids of the left and right piece, lower ranks merge first
+    std::unordered_map<uint64_t, Merge> merges;
+
+    int32_t byte_ids[256];
+
+    int64_t bos_id = -1;
+    int64_t eos_id = -1;
+    int64_t unk_id = -1;
+    bool add_dummy_prefix = true;
+    bool remove_extra_whitespaces = false;
+    bool byte_fallback = false;
+
+    // protobuf ModelProto of sentencepiece, merges follow the scores of the merged pieces
+    void read_model(const std::string& path);
+
+    // huggingface tokenizer.json of a "BPE" model, merges follow their listed order
+    void read_json(const std::string& path);
+
+    // piece_ids, bytes and byte_ids from pieces and types
+    void index_pieces();
+    void add_merge(int32_t left, int32_t right, int32_t id, int32_t rank);
+
+    std::string normalize(const std::string& text) const;
+};
+
+// decodes generated tokens one at a time, never splitting a utf-8 character across two calls
+// the tokenizer must outlive it
+class LlamaDetokenizer {
+public:
+    explicit LlamaDetokenizer(const LlamaTokenizer& tokenizer, bool strip_leading_space = false);
+
+    // the complete characters decoded since the previous call
+    std::string push(int64_t id);
+
+    // whatever is still held back, also when it is not valid utf-8
+    std::string flush();
+
+    void reset();
+
+private:
+    const LlamaTokenizer& tokenizer;
+    bool strip_leading_space;
+    bool at_start = true;
+    std::string pending;
+};
+
+#endif // LLAMA_TOKENIZER_H
@@ -6,6 +6,7 @@ TORCH_INCLUDES_START
 #include <torch/torch.h>
 TORCH_INCLUDES_END
 #include <tuple>
+#include "llama_config.h"
 
 #ifndef LLAMA_UTILS_H
 #define LLAMA_UTILS_H
@@ -98,5 +99,30 @@ public:
     c10::impl::GenericDict WeightsDict;
 };
 
+
+// converts a pickled state dict into an archive with quantized projections
+// the result loads into a model built with the same quantization, group size and quantize_lm_head
+class QuantizedArchiveConverter
+{
+public:
+    QuantizedArchiveConverter(LlamaQuantization quantization, int64_t group_size = 64, bool quantize_lm_head = false)
+    : quantization(quantization),
+    group_size(group_size),
+    quantize_lm_head(quantize_lm_head)
+    {}
+    void toOutputArchive(
+        const std::string& in_path,
+        const std::string& out_path
+    );
+
+private:
+    LlamaQuantization quantization;
+    int64_t group_size;
+    bool quantize_lm_head;
+
+    // weights stored by LlamaLinear, every other tensor is copied as is
+    bool isQuantized(const std::string& key) const;
+};
+
 #endif // ROTARY_EMBEDDING_H
 
@@ -15,6 +15,10 @@ public:
 	LlamaRotaryEmbeddingImpl(int64_t dim, int64_t max_position_embeddings = 2048, double base = 10000);
 	std::tuple<torch::Tensor, torch::Tensor> forward(torch::Tensor x, int64_t seq_len );
 
+	// full [positions, dim] cos and sin tables in dtype on device, covering at least seq_len positions
+	// converted once and kept, so decoding steps only index into them
+	std::tuple<torch::Tensor, torch::Tensor> tables(torch::ScalarType dtype, const torch::Device& device, int64_t seq_len);
+
 private:
 	int64_t dim_;
 	int64_t max_position_embeddings_;
@@ -24,6 +28,10 @@ private:
 	torch::Tensor cos_cached_;
 	torch::Tensor sin_cached_;
 
+	// cos_cached_ and sin_cached_ in the dtype and device last asked for
+	torch::Tensor cos_typed_;
+	torch::Tensor sin_typed_;
+
 	void _set_cos_sin_cache(int64_t seq_len);
 };
 